@@ -0,0 +1,210 @@
+// Command line renderer for FunRay scene files. Uses the same core headers as the Cinema 4D
+// plugin, without the SDK.
+//
+//   funray <scene> <output.ppm> [-t threads] [-s samples] [-d depth] [--seed n] [--compressed-bvh]
+//          [--bvh sah|linear] [--rotations passes] [--spatial-bvh]
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "color.h"
+#include "bvh.h"
+#include "integrator.h"
+#include "adaptive.h"
+#include "scene_file.h"
+#include "thread_runner.h"
+#include "tile_scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+static void print_usage() {
+    std::cerr << "usage: funray <scene> <output.ppm> [-t threads] [-s samples] [-d depth] [--seed n] [--compressed-bvh]\n"
+              << "              [--bvh sah|linear] [--rotations passes] [--spatial-bvh]\n";
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+
+    const std::string scene_path = argv[1];
+    const std::string output_path = argv[2];
+
+    scene_description scene;
+    std::string error;
+    if (!load_scene(scene_path, scene, error)) {
+        std::cerr << scene_path << ": " << error << "\n";
+        return 1;
+    }
+
+    render_settings& settings = scene.settings;
+    int threads = 0;
+    bool compressed_bvh = false;
+    bool linear_bvh = false;
+    int rotation_passes = 0;
+    bool spatial_bvh = false;
+    for (int a = 3; a < argc; a++) {
+        bool has_value = a + 1 < argc;
+        if (!strcmp(argv[a], "-t") && has_value)
+            threads = atoi(argv[++a]);
+        else if (!strcmp(argv[a], "-s") && has_value)
+            settings.samples_per_pixel = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "-d") && has_value)
+            settings.max_depth = std::max(1, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--seed") && has_value)
+            settings.seed = static_cast<uint32_t>(strtoul(argv[++a], nullptr, 10));
+        else if (!strcmp(argv[a], "--compressed-bvh"))
+            compressed_bvh = true;
+        else if (!strcmp(argv[a], "--bvh") && has_value && (!strcmp(argv[a + 1], "sah") || !strcmp(argv[a + 1], "linear")))
+            linear_bvh = !strcmp(argv[++a], "linear");
+        else if (!strcmp(argv[a], "--rotations") && has_value)
+            rotation_passes = std::max(0, atoi(argv[++a]));
+        else if (!strcmp(argv[a], "--spatial-bvh"))
+            spatial_bvh = true;
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (scene.world.objects.empty()) {
+        std::cerr << scene_path << ": the scene is empty\n";
+        return 1;
+    }
+
+    thread_task_runner runner(threads);
+
+    auto build_start = std::chrono::steady_clock::now();
+    bvh world;
+    world.tree.quantized = compressed_bvh;
+    world.tree.linear = linear_bvh;
+    world.tree.rotation_passes = rotation_passes;
+    world.tree.spatial = spatial_bvh;
+    world.build(scene.world.objects, &runner);
+    double build_ms = elapsed_ms(build_start);
+
+    light_list lights;
+    lights.gather(scene.world.objects);
+
+    environment_light environment;
+    if (!settings.environment.empty()) {
+        std::string path = settings.environment;
+        auto slash = scene_path.find_last_of("/\\");
+        if (path[0] != '/' && slash != std::string::npos)
+            path = scene_path.substr(0, slash + 1) + path;
+        if (!environment.load(path, error)) {
+            std::cerr << scene_path << ": " << error << "\n";
+            return 1;
+        }
+        environment.intensity = settings.environment_intensity;
+        environment.rotation = degrees_to_radians(settings.environment_rotation);
+    }
+
+    const int width = settings.image_width;
+    const int height = settings.image_height;
+    const camera cam = settings.make_camera();
+    std::vector<color> image(size_t(width) * height);
+    std::vector<pixel_features> features(settings.denoise ? image.size() : 0);
+
+    std::vector<std::unique_ptr<sampler>> samplers;
+    for (int w = 0; w < runner.thread_count(); w++) {
+        if (settings.sobol)
+            samplers.emplace_back(new sobol_sampler(settings.seed));
+        else
+            samplers.emplace_back(new random_sampler(settings.seed));
+    }
+
+    const adaptive_settings& adaptive = settings.adaptive;
+    const int samples_per_pixel = adaptive.enabled ? adaptive.max_samples : settings.samples_per_pixel;
+    std::atomic<long long> sample_total(0);
+
+    tile_scheduler scheduler;
+    scheduler.run(width, height, 64, runner, [&](int worker, int j, int x0, int x1) {
+        sampler& rng = *samplers[worker];
+        for (int i = x0; i < x1; i++) {
+            pixel_estimate estimate;
+            pixel_features first_hits;
+            pixel_features* feature_sum = settings.denoise ? &first_hits : nullptr;
+            for (int s = 0; s < samples_per_pixel; s++) {
+                rng.start(uint32_t(j * width + i), uint32_t(s));
+                double du, dv;
+                rng.next_2d(du, dv);
+                auto u = (i + du) / (width - 1);
+                auto v = (j + dv) / (height - 1);
+                ray r = cam.get_ray(u, v, rng);
+                estimate.add(ray_color(r, settings.background, settings.dome_background, world, lights, &environment, settings.max_depth, rng, feature_sum));
+                if (adaptive.converged(estimate.count, estimate.display_error()))
+                    break;
+            }
+            sample_total += estimate.count;
+            image[size_t(j) * width + i] = estimate.average();
+            if (feature_sum)
+                features[size_t(j) * width + i] = first_hits / estimate.count;
+        }
+        return true;
+    });
+
+    const tile_scheduler_stats& stats = scheduler.stats();
+    double render_ms = stats.wall_ms;
+
+    // One ray through every pixel center, to compare trees by the work a traversal does.
+    bvh_traversal_stats traversal;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            samplers[0]->start(uint32_t(j * width + i), 0);
+            ray r = cam.get_ray((i + 0.5) / (width - 1), (j + 0.5) / (height - 1), *samplers[0]);
+            hit_record rec;
+            world.hit(r, 0.001, infinity, rec, &traversal);
+        }
+    }
+
+    double denoise_ms = 0.0;
+    if (settings.denoise) {
+        auto denoise_start = std::chrono::steady_clock::now();
+        atrous_denoiser denoiser(settings.denoiser);
+        denoiser.run(width, height, image.data(), features.data(), image.data(), &runner);
+        denoise_ms = elapsed_ms(denoise_start);
+    }
+
+    std::ofstream out(output_path);
+    if (!out) {
+        std::cerr << "cannot write " << output_path << "\n";
+        return 1;
+    }
+
+    out << "P3\n" << width << ' ' << height << "\n255\n";
+    for (int j = height - 1; j >= 0; j--) {
+        for (int i = 0; i < width; i++)
+            write_color(out, image[size_t(j) * width + i], 1);
+    }
+
+    double samples = double(sample_total);
+    std::cerr << scene.world.objects.size() << " objects, " << lights.size() << " lights, " << runner.thread_count() << " threads\n"
+              << "BVH build: " << build_ms << " ms, " << (linear_bvh ? "linear" : "SAH") << ", cost " << world.stats().build_cost << ", "
+              << world.stats().node_bytes / 1024 << " KB nodes, " << world.stats().reference_count << " references, "
+              << world.stats().spatial_splits << " spatial splits\n"
+              << "Traversal: " << double(traversal.nodes) / traversal.rays << " nodes, "
+              << double(traversal.primitives) / traversal.rays << " primitives per camera ray\n"
+              << "Render: " << render_ms << " ms, " << samples / (render_ms * 1000.0) << " Msamples/s, "
+              << samples / (double(width) * height) << " samples per pixel\n"
+              << "Tiles: " << stats.utilisation() * 100.0 << "% utilisation, " << stats.buckets << " buckets, "
+              << stats.steals << " steals, " << stats.splits << " splits, " << stats.tail_ms << " ms tail\n";
+    if (settings.denoise)
+        std::cerr << "Denoise: " << denoise_ms << " ms\n";
+
+    return 0;
+}
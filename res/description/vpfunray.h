@@ -10,6 +10,26 @@ enum
 		VP_FUNRAY_RENDERMODE_MULTITHREAD   = 1,
 		VP_FUNRAY_RENDERMODE_SINGLETHREAD_PROGRESSIVE = 2,
 		VP_FUNRAY_RENDERMODE_MULTITHREAD_PROGRESSIVE = 3,
+	VP_FUNRAY_SEED					=	1003,
+	VP_FUNRAY_SAMPLER				=	1004,
+		VP_FUNRAY_SAMPLER_RANDOM = 0,
+		VP_FUNRAY_SAMPLER_SOBOL  = 1,
+	VP_FUNRAY_ADAPTIVE				=	1005,
+	VP_FUNRAY_ADAPTIVE_MIN_SAMPLES	=	1006,
+	VP_FUNRAY_ADAPTIVE_MAX_SAMPLES	=	1007,
+	VP_FUNRAY_ADAPTIVE_THRESHOLD	=	1008,
+	VP_FUNRAY_DENOISE				=	1009,
+	VP_FUNRAY_DENOISE_ITERATIONS	=	1010,
+	VP_FUNRAY_ENVIRONMENT			=	1011,
+	VP_FUNRAY_ENVIRONMENT_INTENSITY	=	1012,
+	VP_FUNRAY_ENVIRONMENT_ROTATION	=	1013,
+	VP_FUNRAY_BVH_COMPRESSED		=	1014,
+	VP_FUNRAY_BVH_BUILDER_VIEWPORT	=	1015,
+		VP_FUNRAY_BVH_BUILDER_SAH    = 0,
+		VP_FUNRAY_BVH_BUILDER_LINEAR = 1,
+	VP_FUNRAY_BVH_ROTATIONS			=	1016,
+	VP_FUNRAY_BVH_SPATIAL			=	1017,
+	VP_FUNRAY_BVH_SPATIAL_BUDGET	=	1018,
 };
 
 #endif // VPFUNRAY_H__
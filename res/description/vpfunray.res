@@ -18,5 +18,41 @@ CONTAINER VPfunray
 				VP_FUNRAY_RENDERMODE_MULTITHREAD_PROGRESSIVE;	
 			}
 		}
+		LONG VP_FUNRAY_SEED { MIN 0; ANIM OFF;}
+		LONG VP_FUNRAY_SAMPLER
+		{
+			ANIM OFF;
+			CYCLE
+			{
+				VP_FUNRAY_SAMPLER_RANDOM;
+				VP_FUNRAY_SAMPLER_SOBOL;
+			}
+		}
+		SEPARATOR { LINE; }
+		BOOL VP_FUNRAY_ADAPTIVE { ANIM OFF; }
+		LONG VP_FUNRAY_ADAPTIVE_MIN_SAMPLES { MIN 2; MAX 1000; ANIM OFF; }
+		LONG VP_FUNRAY_ADAPTIVE_MAX_SAMPLES { MIN 2; MAX 10000; ANIM OFF; }
+		REAL VP_FUNRAY_ADAPTIVE_THRESHOLD { MIN 0.0001; MAX 1.0; STEP 0.001; ANIM OFF; }
+		SEPARATOR { LINE; }
+		BOOL VP_FUNRAY_DENOISE { ANIM OFF; }
+		LONG VP_FUNRAY_DENOISE_ITERATIONS { MIN 1; MAX 8; ANIM OFF; }
+		SEPARATOR { LINE; }
+		FILENAME VP_FUNRAY_ENVIRONMENT { ANIM OFF; }
+		REAL VP_FUNRAY_ENVIRONMENT_INTENSITY { MIN 0.0; STEP 0.1; ANIM OFF; }
+		REAL VP_FUNRAY_ENVIRONMENT_ROTATION { UNIT DEGREE; ANIM OFF; }
+		SEPARATOR { LINE; }
+		BOOL VP_FUNRAY_BVH_COMPRESSED { ANIM OFF; }
+		LONG VP_FUNRAY_BVH_BUILDER_VIEWPORT
+		{
+			ANIM OFF;
+			CYCLE
+			{
+				VP_FUNRAY_BVH_BUILDER_SAH;
+				VP_FUNRAY_BVH_BUILDER_LINEAR;
+			}
+		}
+		LONG VP_FUNRAY_BVH_ROTATIONS { MIN 0; MAX 8; ANIM OFF; }
+		BOOL VP_FUNRAY_BVH_SPATIAL { ANIM OFF; }
+		REAL VP_FUNRAY_BVH_SPATIAL_BUDGET { UNIT PERCENT; MIN 0.0; MAX 400.0; STEP 5.0; ANIM OFF; }
 	}
 }
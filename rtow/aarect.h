@@ -14,6 +14,8 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "material.h"
+#include "lights.h"
 
 
 class xy_rect : public hittable {
@@ -35,6 +37,14 @@ class xy_rect : public hittable {
             return true;
         }
 
+        virtual bool is_light() const override {
+            return mp && mp->emissive();
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, sampler& s) const override;
+        virtual bool emitter_bounds(light_bounds& bounds) const override;
+
     public:
         double x0, x1, y0, y1, k;
 		shared_ptr<material> mp;
@@ -59,6 +69,14 @@ class xz_rect : public hittable {
             return true;
         }
 
+        virtual bool is_light() const override {
+            return mp && mp->emissive();
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, sampler& s) const override;
+        virtual bool emitter_bounds(light_bounds& bounds) const override;
+
     public:
         double x0, x1, z0, z1, k;
 		shared_ptr<material> mp;
@@ -83,12 +101,20 @@ class yz_rect : public hittable {
             return true;
         }
 
+        virtual bool is_light() const override {
+            return mp && mp->emissive();
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, sampler& s) const override;
+        virtual bool emitter_bounds(light_bounds& bounds) const override;
+
     public:
         double y0, y1, z0, z1, k;
 		shared_ptr<material> mp;
 };
 
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     auto t = (k-r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max)
         return false;
@@ -103,13 +129,13 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
 
     return true;
 }
 
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     auto t = (k-r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -124,13 +150,13 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
 
     return true;
 }
 
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+inline bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     auto t = (k-r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -145,10 +171,81 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
 
     return true;
 }
 
+// Points are picked uniformly over the area and the density converted to solid angle seen from o.
+// Both faces emit, so the cosine is taken on either side.
+inline double rect_pdf_value(const hittable& rect, double area, const point3& o, const vec3& v) {
+    hit_record rec;
+    if (!rect.hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    if (cosine <= 0)
+        return 0;
+
+    return distance_squared / (cosine * area);
+}
+
+inline double xy_rect::pdf_value(const point3& o, const vec3& v) const {
+    return rect_pdf_value(*this, (x1-x0)*(y1-y0), o, v);
+}
+
+inline vec3 xy_rect::random(const point3& o, sampler& s) const {
+    double a, b;
+    s.next_2d(a, b);
+    return point3(x0 + a*(x1-x0), y0 + b*(y1-y0), k) - o;
+}
+
+inline double xz_rect::pdf_value(const point3& o, const vec3& v) const {
+    return rect_pdf_value(*this, (x1-x0)*(z1-z0), o, v);
+}
+
+inline vec3 xz_rect::random(const point3& o, sampler& s) const {
+    double a, b;
+    s.next_2d(a, b);
+    return point3(x0 + a*(x1-x0), k, z0 + b*(z1-z0)) - o;
+}
+
+inline double yz_rect::pdf_value(const point3& o, const vec3& v) const {
+    return rect_pdf_value(*this, (y1-y0)*(z1-z0), o, v);
+}
+
+inline vec3 yz_rect::random(const point3& o, sampler& s) const {
+    double a, b;
+    s.next_2d(a, b);
+    return point3(k, y0 + a*(y1-y0), z0 + b*(z1-z0)) - o;
+}
+
+// Both faces emit, so the cone is the normal and light reaches either side.
+inline bool rect_emitter_bounds(const hittable& rect, const material& mat, double area, const vec3& normal,
+    const point3& center, light_bounds& bounds)
+{
+    if (!rect.bounding_box(0, 1, bounds.box))
+        return false;
+    bounds.power = luminance(mat.emitted(0.5, 0.5, center)) * 2*area * pi;
+    bounds.axis = normal;
+    bounds.cos_theta_o = 1.0;
+    bounds.cos_theta_e = 0.0;
+    bounds.two_sided = true;
+    return true;
+}
+
+inline bool xy_rect::emitter_bounds(light_bounds& bounds) const {
+    return rect_emitter_bounds(*this, *mp, (x1-x0)*(y1-y0), vec3(0, 0, 1), point3(0.5*(x0+x1), 0.5*(y0+y1), k), bounds);
+}
+
+inline bool xz_rect::emitter_bounds(light_bounds& bounds) const {
+    return rect_emitter_bounds(*this, *mp, (x1-x0)*(z1-z0), vec3(0, 1, 0), point3(0.5*(x0+x1), k, 0.5*(z0+z1)), bounds);
+}
+
+inline bool yz_rect::emitter_bounds(light_bounds& bounds) const {
+    return rect_emitter_bounds(*this, *mp, (y1-y0)*(z1-z0), vec3(1, 0, 0), point3(k, 0.5*(y0+y1), 0.5*(z0+z1)), bounds);
+}
+
 #endif
@@ -0,0 +1,60 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+#include "rtweekend.h"
+
+
+struct adaptive_settings {
+    bool enabled = false;
+    int min_samples = 16;
+    int max_samples = 400;
+    double noise_threshold = 0.01;  // Standard error a pixel may keep, in display units.
+
+    // Convergence is only tested every few samples, which keeps the Sobol points of a pixel in
+    // stratified runs and the cost of the test out of the sample loop.
+    static const int check_interval = 8;
+
+    bool converged(int samples, double error) const {
+        return enabled && samples >= min_samples && samples % check_interval == 0 && error < noise_threshold;
+    }
+};
+
+
+// Running mean and variance of the luminance of the samples of one pixel, updated with
+// Welford's method so the estimate needs no second pass and stays stable over many samples.
+struct pixel_estimate {
+    color sum = color(0, 0, 0);
+    int count = 0;
+    double mean = 0.0;
+    double m2 = 0.0;
+
+    void add(const color& c) {
+        sum += c;
+        count++;
+
+        // A NaN sample must not keep the variance from ever converging.
+        auto y = 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+        if (y != y)
+            y = 0.0;
+        auto delta = y - mean;
+        mean += delta / count;
+        m2 += delta * (y - mean);
+    }
+
+    // Standard error of the mean luminance carried through the gamma 2 display curve, where a
+    // change dm of the mean shows up as dm / (2 sqrt(m)). Dark pixels need a smaller absolute
+    // error than bright ones before they look as clean.
+    double display_error() const {
+        if (count < 2)
+            return infinity;
+        auto variance = m2 / (count - 1);
+        return sqrt(variance / count) / (2.0 * sqrt(fmax(mean, 1e-4)));
+    }
+
+    color average() const {
+        return count > 0 ? sum / count : sum;
+    }
+};
+
+
+#endif
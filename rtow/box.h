@@ -37,7 +37,7 @@ class box : public hittable  {
 };
 
 
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
+inline box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
     box_min = p0;
     box_max = p1;
 
@@ -0,0 +1,2031 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SSE 1
+#include <emmintrin.h>
+#endif
+
+
+struct bvh_stats {
+    double build_ms = 0.0;
+    int primitive_count = 0;
+    int node_count = 0;
+    int leaf_count = 0;
+    int max_depth = 0;
+    int subtree_tasks = 0;
+    int wide_node_count = 0;
+    int reference_count = 0; // Entries in the leaves, above primitive_count when spatial splits duplicated some.
+    int spatial_splits = 0;
+    size_t node_bytes = 0;   // Memory held by the node arrays once the build is done.
+    double build_cost = 0.0; // SAH cost right after the build, refits are compared against it.
+};
+
+
+// Work done by traversals that were given a counter, for comparing trees on the same rays.
+struct bvh_traversal_stats {
+    long long rays = 0;
+    long long nodes = 0;        // Wide nodes whose children were tested.
+    long long primitives = 0;   // Calls to hit_primitive.
+};
+
+
+inline aabb empty_box() {
+    return aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+}
+
+inline void grow_box(aabb& box, const point3& p) {
+    for (int a = 0; a < 3; a++) {
+        box.minimum[a] = fmin(box.minimum[a], p[a]);
+        box.maximum[a] = fmax(box.maximum[a], p[a]);
+    }
+}
+
+// Per component, so an empty box leaves box unchanged instead of spreading its infinities.
+inline void grow_box(aabb& box, const aabb& other) {
+    for (int a = 0; a < 3; a++) {
+        box.minimum[a] = fmin(box.minimum[a], other.minimum[a]);
+        box.maximum[a] = fmax(box.maximum[a], other.maximum[a]);
+    }
+}
+
+inline double half_area(const aabb& box) {
+    auto d = box.maximum - box.minimum;
+    if (d.x() < 0 || d.y() < 0 || d.z() < 0)
+        return 0.0;
+    return d.x()*d.y() + d.y()*d.z() + d.z()*d.x();
+}
+
+
+// Runs a batch of independent tasks and returns once all of them have finished. The tree has
+// no threading of its own, the host plugs in a runner backed by its job system.
+class bvh_task_runner {
+    public:
+        virtual ~bvh_task_runner() {}
+
+        virtual int thread_count() const = 0;
+        virtual void run(std::vector<std::function<void()>>& tasks) = 0;
+};
+
+
+// Bounding volume hierarchy over an arbitrary set of boxes. The tree only knows about
+// primitive indices, the caller decides what a primitive is and how to intersect it.
+// Built top down with a binned surface area heuristic. The binary tree is kept for refits and
+// statistics, rays traverse a copy collapsed into nodes of four children whose boxes are tested
+// together, see Wald et al., "Getting Rid of Packets", 2008. A quantized tree stores the wide
+// nodes with 8 bit child bounds and drops the binary tree, at the price of rebuilding on change.
+//
+// The linear builder trades tree quality for build time: primitives are radix sorted by the
+// Morton code of their centroid and every node splits where the highest differing code bit
+// changes, see Lauterbach et al., "Fast BVH Construction on GPUs", 2009. Boxes are filled in
+// bottom up afterwards, optionally followed by passes of local tree rotations that take back
+// some of the lost quality, see Kensler, "Tree Rotations for Improving Bounding Volume
+// Hierarchies", 2008.
+//
+// Spatial splits cut a node with a plane instead of sorting whole primitives to one side, and a
+// primitive crossing the plane is referenced from both children with its box clipped to each
+// half. Long, thin or rotated primitives then stop dragging every box they touch across the
+// scene. Splits are only tried where the children of the best object split overlap, and stop
+// once the budget of extra references is used up, see Stich et al., "Spatial Splits in Bounding
+// Volume Hierarchies", HPG 2009. Primitives referenced twice cannot be refit.
+class bvh_tree {
+    public:
+        struct node {
+            aabb box;
+            int left_first; // Interior: index of the left child, the right child is left_first + 1.
+                            // Leaf: index of the first entry in indices.
+            int count;      // Number of primitives in a leaf, 0 for interior nodes.
+
+            bool is_leaf() const { return count > 0; }
+        };
+
+        static const int wide_width = 4;
+
+        // Children of a collapsed node. The bounds are stored per axis across the children, in
+        // single precision rounded outward, so one slab test covers all of them. Unused lanes
+        // hold an empty box and are never entered. At 32 bytes per child a node fills exactly
+        // two cache lines.
+        struct alignas(64) wide_node {
+            float lo[3][wide_width];
+            float hi[3][wide_width];
+            int child[wide_width];  // Interior: index into wide_nodes. Leaf: first entry in indices.
+            int count[wide_width];  // Number of primitives in a leaf child, 0 for interior children.
+        };
+
+        // Wide node with the child bounds stored as 8 bit steps from the origin of its frame. The
+        // origin is not stored, it is the lower corner of the node's own quantized box in its
+        // parent, and the steps are powers of two chosen per node and axis so that 255 of them
+        // reach past the union of the children. Every child box is rounded outward to whole
+        // steps, so the quantized boxes always contain the exact ones. Unused lanes hold an
+        // inverted box. Interior children are stored one after another from child, the
+        // primitives of the leaf children one after another from first, both in lane order, so
+        // a lane only needs its primitive count. A node takes 40 bytes against the 128 of a
+        // wide node. See Ylitie et al., "Efficient Incoherent Ray Traversal on GPUs Through Compressed
+        // Wide BVHs", HPG 2017.
+        //
+        // All children of a node share one grid, so next to a child far bigger than its
+        // siblings, a ground plane sized sphere for example, the small ones are padded to the
+        // big one's step and rays test noticeably more primitives.
+        struct quantized_node {
+            uint8_t lo[3][wide_width];
+            uint8_t hi[3][wide_width];
+            int child;                  // Index into quantized_nodes of the first interior child.
+            int first;                  // First entry in indices of the first leaf child.
+            uint8_t count[wide_width];  // Number of primitives in a leaf child, 0 for interior and unused lanes.
+            int8_t exponent[3];         // The step on each axis is 2^exponent.
+        };
+
+        static const int bin_count = 16;
+        static const int max_leaf_size = 4;
+        static const int max_depth = 60;            // Deeper than this is forced into a leaf, keeps the traversal stack fixed.
+        static const int parallel_bin_size = 16384; // Nodes at least this big are binned in parallel chunks.
+        static const int min_subtree_size = 1024;   // Smallest range handed to a subtree task.
+        static constexpr double refit_cost_limit = 1.3; // Refits may degrade the SAH cost this much before a rebuild is due.
+        static constexpr double spatial_overlap = 1e-5; // Child overlap, relative to the root area, above which spatial splits are tried.
+
+        // Writes the box of the part of primitive index inside clip to output_box, returns false
+        // when none of it is inside. Without one spatial splits clip the primitive boxes.
+        typedef std::function<bool(int index, const aabb& clip, aabb& output_box)> clip_function;
+
+        void clear() {
+            nodes.clear();
+            indices.clear();
+            parents.clear();
+            prim_leaf.clear();
+            wide_nodes.clear();
+            wide_lane.clear();
+            quantized_nodes.clear();
+            root_bounds = aabb();
+            area_sum = 0.0;
+            stats = bvh_stats();
+        }
+
+        bool empty() const { return indices.empty(); }
+
+        // Box of the whole tree.
+        const aabb& bounds() const { return root_bounds; }
+
+        // Without a runner, or with a single thread, the build runs on the calling thread.
+        void build(const std::vector<aabb>& boxes, bvh_task_runner* runner = nullptr, const clip_function& clip = nullptr);
+
+        // Closest hit traversal. hit_primitive(index, t_min, t_max) must return true and shrink
+        // t_max when the primitive is hit closer than t_max. A primitive split across leaves can
+        // be offered more than once. With counters the work done is added to them.
+        template <typename F>
+        bool hit(const ray& r, double t_min, double& t_max, F&& hit_primitive, bvh_traversal_stats* counters = nullptr) const;
+
+        // Update the boxes of the leaves holding the given primitives and of their ancestors.
+        // prim_box(index) returns the new box of a primitive. Topology is left unchanged.
+        template <typename F>
+        void refit(const std::vector<int>& prims, F&& prim_box);
+
+        // Surface area heuristic cost of the current tree relative to the root box.
+        double sah_cost() const {
+            auto root_area = nodes.empty() ? 0.0 : half_area(nodes[0].box);
+            return root_area > 0.0 ? area_sum / root_area : 0.0;
+        }
+
+        // A quantized tree keeps no binary nodes to refit, and a primitive in several leaves has
+        // clipped boxes the refit cannot recompute, so both ask for a rebuild on every change.
+        bool refit_degraded() const {
+            return compressed() || split_references() || sah_cost() > stats.build_cost * refit_cost_limit;
+        }
+
+        static bool hit_box(
+            const aabb& box, const point3& origin, const vec3& inv_dir, double t_min, double t_max, double& t_entry
+        ) {
+            for (int a = 0; a < 3; a++) {
+                auto t0 = (box.minimum[a] - origin[a]) * inv_dir[a];
+                auto t1 = (box.maximum[a] - origin[a]) * inv_dir[a];
+                if (inv_dir[a] < 0.0)
+                    std::swap(t0, t1);
+                // Written so that a NaN from 0 * infinity leaves the interval untouched.
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max < t_min)
+                    return false;
+            }
+            t_entry = t_min;
+            return true;
+        }
+
+    public:
+        std::vector<node> nodes;
+        std::vector<int> indices;
+        std::vector<int> parents;   // Parent of every node, -1 for the root.
+        std::vector<int> prim_leaf; // Leaf node holding every primitive.
+        std::vector<wide_node> wide_nodes;
+        std::vector<int> wide_lane; // Wide node * wide_width + lane holding the box of every node, -1 when collapsed away.
+        std::vector<quantized_node> quantized_nodes;
+        bool quantized = false;     // Build quantized nodes instead of float ones, set before building.
+                                    // Leaves of more than 255 primitives keep the float nodes.
+        bool linear = false;        // Build with the Morton code builder instead of SAH binning, set before building.
+        int rotation_passes = 0;    // Tree rotation passes after a linear build.
+        bool spatial = false;       // Allow spatial splits in SAH builds, set before building.
+        double spatial_budget = 0.3; // Extra references spatial splits may add, relative to the primitive count.
+        bvh_stats stats;
+
+    private:
+        double area_sum = 0.0;      // Sum of node areas weighted by their cost, kept current by refit.
+        aabb root_bounds;
+        float root_origin[3] = { 0.0f, 0.0f, 0.0f };   // Frame origin of the quantized root.
+
+        static double node_weight(const node& n) {
+            return n.is_leaf() ? n.count : 1.0;
+        }
+
+        bool split_references() const {
+            return stats.reference_count > stats.primitive_count;
+        }
+
+        bool compressed() const {
+            return !quantized_nodes.empty();
+        }
+
+        void update_links();
+        void collapse();
+        bool quantize();
+        void release_binary_nodes();
+
+        void store_wide_box(int node_index, const aabb& box) {
+            int slot = wide_lane[node_index];
+            if (slot < 0)
+                return;
+            wide_node& w = wide_nodes[slot / wide_width];
+            int lane = slot % wide_width;
+            for (int a = 0; a < 3; a++) {
+                w.lo[a][lane] = round_down(box.minimum[a]);
+                w.hi[a][lane] = round_up(box.maximum[a]);
+            }
+        }
+
+        static float round_down(double v) {
+            float f = static_cast<float>(v);
+            return f > v ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float round_up(double v) {
+            float f = static_cast<float>(v);
+            return f < v ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+
+        // Ray prepared once per traversal for the wide slab tests.
+        struct wide_ray {
+            float origin[3];
+            float inv_dir[3];
+            bool negative[3];   // The near plane on this axis is the maximum.
+        };
+
+        // Entry distance of every lane in t_near, returns a bit mask of the lanes that are hit.
+        static int intersect(const wide_node& w, const wide_ray& wr, float t_min, float t_max, float t_near[wide_width]);
+        // Same for a quantized node in the frame starting at origin, also returns the lower
+        // planes of the lanes, which are the frame origins of the children.
+        static int intersect(const quantized_node& q, const float origin[3], const wide_ray& wr, float t_min, float t_max,
+            float t_near[wide_width], float lo[3][wide_width]);
+
+        static float step_size(int exponent) {
+            uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+            float step;
+            std::memcpy(&step, &bits, sizeof(step));
+            return step;
+        }
+
+        // Tests the root box and prepares wr, returns false when the ray misses the tree.
+        bool start_traversal(const ray& r, double t_min, double t_max, wide_ray& wr, bvh_traversal_stats* counters) const;
+
+        template <typename F>
+        bool traverse(const ray& r, double t_min, double& t_max, F&& hit_primitive, bvh_traversal_stats* counters) const;
+
+        template <typename F>
+        bool traverse_quantized(const ray& r, double t_min, double& t_max, F&& hit_primitive,
+            bvh_traversal_stats* counters) const;
+
+        struct build_task {
+            int node_index;
+            int begin;
+            int end;
+            int depth;
+        };
+
+        struct bin_set {
+            aabb box[3][bin_count];
+            int count[3][bin_count];
+
+            void reset();
+            void merge(const bin_set& other);
+        };
+
+        struct build_context {
+            const std::vector<aabb>* boxes = nullptr;
+            std::vector<point3> centroids;
+            std::vector<uint64_t> codes;    // Linear builds: Morton code of every entry in indices, ascending.
+            std::atomic<int> nodes_used;
+            bvh_task_runner* runner = nullptr;
+
+            // Spatial builds hand out leaf ranges in indices as they go, and count the references
+            // that may still be added down.
+            const clip_function* clip = nullptr;
+            std::atomic<int> indices_used;
+            std::atomic<int> split_budget;
+            std::atomic<int> spatial_splits;
+            double min_overlap = 0.0;
+        };
+
+        // A primitive, or the part of it on one side of the spatial splits above.
+        struct reference {
+            aabb box;
+            int prim;
+        };
+
+        struct spatial_task {
+            int node_index;
+            int depth;
+            std::vector<reference> refs;
+        };
+
+        struct spatial_split {
+            int axis = -1;
+            double plane = 0.0;
+            double cost = infinity;
+            aabb left_box, right_box;
+            int left_count = 0, right_count = 0;
+        };
+
+        static const int morton_bits = 21;  // Per axis, 63 bits in total.
+        static const int radix_bits = 8;
+
+        static uint64_t spread_bits(uint64_t v) {
+            v &= 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffull;
+            v = (v | v << 16) & 0x1f0000ff0000ffull;
+            v = (v | v << 8) & 0x100f00f00f00f00full;
+            v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+            v = (v | v << 2) & 0x1249249249249249ull;
+            return v;
+        }
+
+        // Splits [0, count) into chunks and runs fn(begin, end) on each, in parallel with a runner.
+        template <typename F>
+        static void for_chunks(const build_context& ctx, int count, F&& fn);
+
+        bool clip_reference(const build_context& ctx, const reference& ref, const aabb& clip, aabb& output_box) const;
+        void find_spatial_split(const build_context& ctx, const std::vector<reference>& refs, const aabb& bounds,
+            spatial_split& split) const;
+        int split_spatial(build_context& ctx, spatial_task& task, spatial_task children[2], bvh_stats& local);
+        void build_spatial(build_context& ctx, int prim_count);
+
+        void sort_morton(build_context& ctx);
+        int split_morton(build_context& ctx, const build_task& task, build_task children[2], bvh_stats& local);
+        void fit_boxes(const std::vector<aabb>& boxes);
+        void rotate(int node_index, int depth, std::vector<int>& heights);
+        void rotate_tree();
+
+        void compute_bounds(const build_context& ctx, int begin, int end, aabb& bounds, aabb& centroid_bounds) const;
+        void compute_bins(const build_context& ctx, int begin, int end, const aabb& centroid_bounds, bin_set& bins) const;
+        bool find_split(const bin_set& bins, const aabb& bounds, const aabb& centroid_bounds, int count,
+            int& split_axis, int& split_bin, double& split_cost) const;
+
+        int split_node(build_context& ctx, const build_task& task, bool parallel, build_task children[2], bvh_stats& local);
+        void build_subtree(build_context& ctx, const build_task& root, bvh_stats& local);
+};
+
+
+inline void bvh_tree::bin_set::reset() {
+    for (int axis = 0; axis < 3; axis++) {
+        for (int b = 0; b < bin_count; b++) {
+            box[axis][b] = empty_box();
+            count[axis][b] = 0;
+        }
+    }
+}
+
+inline void bvh_tree::bin_set::merge(const bin_set& other) {
+    for (int axis = 0; axis < 3; axis++) {
+        for (int b = 0; b < bin_count; b++) {
+            grow_box(box[axis][b], other.box[axis][b]);
+            count[axis][b] += other.count[axis][b];
+        }
+    }
+}
+
+
+inline void bvh_tree::compute_bounds(
+    const build_context& ctx, int begin, int end, aabb& bounds, aabb& centroid_bounds
+) const {
+    bounds = empty_box();
+    centroid_bounds = empty_box();
+    for (int i = begin; i < end; i++) {
+        grow_box(bounds, (*ctx.boxes)[indices[i]]);
+        grow_box(centroid_bounds, ctx.centroids[indices[i]]);
+    }
+}
+
+
+inline void bvh_tree::compute_bins(
+    const build_context& ctx, int begin, int end, const aabb& centroid_bounds, bin_set& bins
+) const {
+    bins.reset();
+
+    for (int axis = 0; axis < 3; axis++) {
+        auto lo = centroid_bounds.minimum[axis];
+        auto extent = centroid_bounds.maximum[axis] - lo;
+        if (extent <= 0.0)
+            continue;
+
+        auto scale = bin_count / extent;
+        for (int i = begin; i < end; i++) {
+            int prim = indices[i];
+            int b = std::min(bin_count - 1, static_cast<int>((ctx.centroids[prim][axis] - lo) * scale));
+            bins.count[axis][b]++;
+            grow_box(bins.box[axis][b], (*ctx.boxes)[prim]);
+        }
+    }
+}
+
+
+inline bool bvh_tree::find_split(const bin_set& bins, const aabb& bounds, const aabb& centroid_bounds, int count,
+    int& split_axis, int& split_bin, double& split_cost) const
+{
+    split_axis = -1;
+    split_cost = infinity;
+
+    for (int axis = 0; axis < 3; axis++) {
+        auto lo = centroid_bounds.minimum[axis];
+        auto extent = centroid_bounds.maximum[axis] - lo;
+        if (extent <= 0.0)
+            continue;
+
+        // Sweep from the right to get the cost of every right hand side, then from the left.
+        double right_area[bin_count - 1];
+        int right_prims[bin_count - 1];
+        aabb acc = empty_box();
+        int acc_count = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            grow_box(acc, bins.box[axis][b]);
+            acc_count += bins.count[axis][b];
+            right_area[b - 1] = half_area(acc);
+            right_prims[b - 1] = acc_count;
+        }
+
+        acc = empty_box();
+        acc_count = 0;
+        for (int b = 0; b < bin_count - 1; b++) {
+            grow_box(acc, bins.box[axis][b]);
+            acc_count += bins.count[axis][b];
+            if (acc_count == 0 || right_prims[b] == 0)
+                continue;
+
+            auto cost = acc_count * half_area(acc) + right_prims[b] * right_area[b];
+            if (cost < split_cost) {
+                split_cost = cost;
+                split_axis = axis;
+                split_bin = b + 1;
+            }
+        }
+    }
+
+    if (split_axis < 0)
+        return false;
+
+    // Normalise to the same units as a leaf: traversal cost of 1, intersection cost of 1.
+    auto parent_area = half_area(bounds);
+    split_cost = 1.0 + (parent_area > 0.0 ? split_cost / parent_area : count);
+    return true;
+}
+
+
+inline int bvh_tree::split_node(
+    build_context& ctx, const build_task& task, bool parallel, build_task children[2], bvh_stats& local
+) {
+    if (!ctx.codes.empty())
+        return split_morton(ctx, task, children, local);
+
+    int count = task.end - task.begin;
+    parallel = parallel && ctx.runner && count >= parallel_bin_size;
+
+    // Large nodes near the root are binned in one chunk per thread and merged afterwards.
+    int chunk_count = parallel ? ctx.runner->thread_count() : 1;
+    int chunk_size = (count + chunk_count - 1) / chunk_count;
+    std::vector<std::function<void()>> jobs;
+
+    aabb bounds, centroid_bounds;
+    if (parallel) {
+        std::vector<aabb> chunk_bounds(chunk_count), chunk_centroids(chunk_count);
+        for (int c = 0; c < chunk_count; c++) {
+            jobs.push_back([&, c]() {
+                int begin = task.begin + c * chunk_size;
+                int end = std::min(task.end, begin + chunk_size);
+                compute_bounds(ctx, begin, end, chunk_bounds[c], chunk_centroids[c]);
+            });
+        }
+        ctx.runner->run(jobs);
+
+        bounds = empty_box();
+        centroid_bounds = empty_box();
+        for (int c = 0; c < chunk_count; c++) {
+            grow_box(bounds, chunk_bounds[c]);
+            grow_box(centroid_bounds, chunk_centroids[c]);
+        }
+    }
+    else {
+        compute_bounds(ctx, task.begin, task.end, bounds, centroid_bounds);
+    }
+
+    node& n = nodes[task.node_index];
+    n.box = bounds;
+    n.left_first = task.begin;
+    n.count = count;
+
+    local.max_depth = std::max(local.max_depth, task.depth);
+
+    if (count == 1 || task.depth >= max_depth) {
+        local.leaf_count++;
+        return 0;
+    }
+
+    std::vector<bin_set> bins(chunk_count);
+    if (parallel) {
+        jobs.clear();
+        for (int c = 0; c < chunk_count; c++) {
+            jobs.push_back([&, c]() {
+                int begin = task.begin + c * chunk_size;
+                int end = std::min(task.end, begin + chunk_size);
+                compute_bins(ctx, begin, end, centroid_bounds, bins[c]);
+            });
+        }
+        ctx.runner->run(jobs);
+
+        for (int c = 1; c < chunk_count; c++)
+            bins[0].merge(bins[c]);
+    }
+    else {
+        compute_bins(ctx, task.begin, task.end, centroid_bounds, bins[0]);
+    }
+
+    int axis;
+    int split_bin;
+    double cost;
+    int mid = task.begin;
+    if (find_split(bins[0], bounds, centroid_bounds, count, axis, split_bin, cost)) {
+        if (cost >= count && count <= max_leaf_size) {
+            local.leaf_count++;
+            return 0;
+        }
+
+        // Same bin mapping as compute_bins, so the partition matches the evaluated split exactly.
+        const auto& centroids = ctx.centroids;
+        auto lo = centroid_bounds.minimum[axis];
+        auto scale = bin_count / (centroid_bounds.maximum[axis] - lo);
+        mid = static_cast<int>(std::partition(indices.begin() + task.begin, indices.begin() + task.end,
+            [&](int prim) {
+                return std::min(bin_count - 1, static_cast<int>((centroids[prim][axis] - lo) * scale)) < split_bin;
+            }) - indices.begin());
+    }
+
+    if (mid == task.begin || mid == task.end) {
+        // All centroids coincide, there is nothing to bin on.
+        if (count <= max_leaf_size) {
+            local.leaf_count++;
+            return 0;
+        }
+        mid = task.begin + count / 2;
+    }
+
+    int left = ctx.nodes_used.fetch_add(2);
+
+    n.left_first = left;
+    n.count = 0;
+
+    children[0] = { left, task.begin, mid, task.depth + 1 };
+    children[1] = { left + 1, mid, task.end, task.depth + 1 };
+    return 2;
+}
+
+
+template <typename F>
+inline void bvh_tree::for_chunks(const build_context& ctx, int count, F&& fn) {
+    int chunk_count = ctx.runner ? ctx.runner->thread_count() : 1;
+    int chunk_size = (count + chunk_count - 1) / chunk_count;
+    if (chunk_count == 1) {
+        fn(0, 0, count);
+        return;
+    }
+
+    std::vector<std::function<void()>> jobs;
+    for (int c = 0; c < chunk_count; c++) {
+        jobs.push_back([&, c]() {
+            int begin = std::min(count, c * chunk_size);
+            fn(c, begin, std::min(count, begin + chunk_size));
+        });
+    }
+    ctx.runner->run(jobs);
+}
+
+
+// Replaces indices by the primitives in Morton order and fills ctx.codes to match. Least
+// significant digit radix sort, every pass counts digits per chunk and scatters each chunk
+// to its own offsets, so the passes run in parallel and stay stable.
+inline void bvh_tree::sort_morton(build_context& ctx) {
+    int count = static_cast<int>(indices.size());
+    aabb centroid_bounds = empty_box();
+    for (const auto& c : ctx.centroids)
+        grow_box(centroid_bounds, c);
+
+    vec3 scale;
+    for (int a = 0; a < 3; a++) {
+        double extent = centroid_bounds.maximum[a] - centroid_bounds.minimum[a];
+        scale[a] = extent > 0.0 ? ((1 << morton_bits) - 1) / extent : 0.0;
+    }
+
+    std::vector<uint64_t> codes(count), codes_swap(count);
+    std::vector<int> prims(count), prims_swap(count);
+    for_chunks(ctx, count, [&](int, int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const point3& c = ctx.centroids[i];
+            uint64_t code = 0;
+            for (int a = 0; a < 3; a++)
+                code |= spread_bits(static_cast<uint64_t>((c[a] - centroid_bounds.minimum[a]) * scale[a])) << a;
+            codes[i] = code;
+            prims[i] = i;
+        }
+    });
+
+    const int radix = 1 << radix_bits;
+    int chunk_count = ctx.runner ? ctx.runner->thread_count() : 1;
+    std::vector<int> histograms(size_t(chunk_count) * radix);
+
+    for (int shift = 0; shift < 3 * morton_bits; shift += radix_bits) {
+        std::fill(histograms.begin(), histograms.end(), 0);
+        for_chunks(ctx, count, [&](int chunk, int begin, int end) {
+            int* h = &histograms[size_t(chunk) * radix];
+            for (int i = begin; i < end; i++)
+                h[(codes[i] >> shift) & (radix - 1)]++;
+        });
+
+        // Turn the counts into scatter offsets, digit major so equal digits keep their order.
+        int offset = 0;
+        bool single_digit = false;
+        for (int d = 0; d < radix; d++) {
+            int digit_start = offset;
+            for (int c = 0; c < chunk_count; c++) {
+                int& h = histograms[size_t(c) * radix + d];
+                int n = h;
+                h = offset;
+                offset += n;
+            }
+            single_digit = single_digit || offset - digit_start == count;
+        }
+        if (single_digit)
+            continue;
+
+        for_chunks(ctx, count, [&](int chunk, int begin, int end) {
+            int* h = &histograms[size_t(chunk) * radix];
+            for (int i = begin; i < end; i++) {
+                int dest = h[(codes[i] >> shift) & (radix - 1)]++;
+                codes_swap[dest] = codes[i];
+                prims_swap[dest] = prims[i];
+            }
+        });
+        codes.swap(codes_swap);
+        prims.swap(prims_swap);
+    }
+
+    indices.swap(prims);
+    ctx.codes.swap(codes);
+}
+
+
+inline int bvh_tree::split_morton(build_context& ctx, const build_task& task, build_task children[2], bvh_stats& local) {
+    int count = task.end - task.begin;
+
+    node& n = nodes[task.node_index];
+    n.left_first = task.begin;
+    n.count = count;
+
+    local.max_depth = std::max(local.max_depth, task.depth);
+
+    if (count == 1 || task.depth >= max_depth) {
+        local.leaf_count++;
+        return 0;
+    }
+
+    // The codes are sorted, so below the highest bit that differs across the range all the
+    // zeros come first.
+    const uint64_t* codes = ctx.codes.data();
+    uint64_t first = codes[task.begin];
+    uint64_t last = codes[task.end - 1];
+    int mid;
+    if (first == last) {
+        mid = task.begin + count / 2;
+    }
+    else {
+        uint64_t bit = uint64_t(1) << 63;
+        while (!((first ^ last) & bit))
+            bit >>= 1;
+        mid = static_cast<int>(std::partition_point(codes + task.begin, codes + task.end,
+            [bit](uint64_t code) { return !(code & bit); }) - codes);
+    }
+
+    int left = ctx.nodes_used.fetch_add(2);
+
+    n.left_first = left;
+    n.count = 0;
+
+    children[0] = { left, task.begin, mid, task.depth + 1 };
+    children[1] = { left + 1, mid, task.end, task.depth + 1 };
+    return 2;
+}
+
+
+// Children always come after their parent in nodes, so one backward sweep sees every child
+// before the node above it. That only holds straight after a build, rotate_tree breaks it.
+inline void bvh_tree::fit_boxes(const std::vector<aabb>& boxes) {
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+        node& n = nodes[i];
+        n.box = empty_box();
+        if (n.is_leaf()) {
+            for (int p = n.left_first; p < n.left_first + n.count; p++)
+                grow_box(n.box, boxes[indices[p]]);
+        }
+        else {
+            grow_box(n.box, nodes[n.left_first].box);
+            grow_box(n.box, nodes[n.left_first + 1].box);
+        }
+    }
+}
+
+
+// Swaps a child of the node with a grandchild on the other side when that shrinks the box in
+// between. The node box and all other boxes stay the same, so the shrink is the whole gain. The
+// child moves one level down, so a swap that would take one of its leaves past max_depth is
+// skipped. heights holds the current subtree height of every node below this one and is kept up
+// to date for them.
+inline void bvh_tree::rotate(int node_index, int depth, std::vector<int>& heights) {
+    const node& n = nodes[node_index];
+    if (n.is_leaf())
+        return;
+
+    int best_child = -1;
+    int best_grandchild = -1;
+    double best_gain = 0.0;
+    for (int side = 0; side < 2; side++) {
+        int child = n.left_first + side;
+        int other = n.left_first + 1 - side;
+        const node& o = nodes[other];
+        if (o.is_leaf() || depth + 2 + heights[child] > max_depth)
+            continue;
+
+        for (int g = 0; g < 2; g++) {
+            aabb box = nodes[child].box;
+            grow_box(box, nodes[o.left_first + 1 - g].box);
+            double gain = half_area(o.box) - half_area(box);
+            if (gain > best_gain) {
+                best_gain = gain;
+                best_child = child;
+                best_grandchild = o.left_first + g;
+            }
+        }
+    }
+
+    if (best_child < 0)
+        return;
+
+    int other = best_child == n.left_first ? n.left_first + 1 : n.left_first;
+    std::swap(nodes[best_child], nodes[best_grandchild]);
+    std::swap(heights[best_child], heights[best_grandchild]);
+
+    node& o = nodes[other];
+    o.box = nodes[o.left_first].box;
+    grow_box(o.box, nodes[o.left_first + 1].box);
+    heights[other] = 1 + std::max(heights[o.left_first], heights[o.left_first + 1]);
+}
+
+
+// One rotation pass. Swapped nodes no longer keep their children after them in nodes, so the
+// order comes from a walk down the tree, and fit_boxes must not run on the tree after this.
+// Visiting the walk backwards rotates every node after the nodes below it, when its depth is
+// still the one from the walk.
+inline void bvh_tree::rotate_tree() {
+    std::vector<int> order;
+    std::vector<int> depths(nodes.size(), 0);
+    std::vector<int> heights(nodes.size(), 0);
+    order.reserve(nodes.size());
+
+    std::vector<int> pending(1, 0);
+    while (!pending.empty()) {
+        int index = pending.back();
+        pending.pop_back();
+        order.push_back(index);
+
+        const node& n = nodes[index];
+        if (!n.is_leaf()) {
+            depths[n.left_first] = depths[n.left_first + 1] = depths[index] + 1;
+            pending.push_back(n.left_first);
+            pending.push_back(n.left_first + 1);
+        }
+    }
+
+    for (auto it = order.rbegin(); it != order.rend(); ++it) {
+        int index = *it;
+        rotate(index, depths[index], heights);
+
+        const node& n = nodes[index];
+        heights[index] = n.is_leaf() ? 0 : 1 + std::max(heights[n.left_first], heights[n.left_first + 1]);
+    }
+
+    stats.max_depth = heights[0];
+}
+
+
+inline bool bvh_tree::clip_reference(
+    const build_context& ctx, const reference& ref, const aabb& clip, aabb& output_box
+) const {
+    aabb region;
+    if (!intersect_boxes(ref.box, clip, region))
+        return false;
+    if (!ctx.clip || !*ctx.clip) {
+        output_box = region;
+        return true;
+    }
+
+    // The part never grows past the region, whatever the primitive reports.
+    aabb part;
+    return (*ctx.clip)(ref.prim, region, part) && intersect_boxes(part, region, output_box);
+}
+
+
+// Bins the node box itself rather than the centroids. A reference counts on the left from the
+// bin it enters and on the right up to the bin it leaves, and every bin in between gets the box
+// of the part of it inside that bin.
+inline void bvh_tree::find_spatial_split(
+    const build_context& ctx, const std::vector<reference>& refs, const aabb& bounds, spatial_split& split
+) const {
+    struct spatial_bin {
+        aabb box;
+        int enter;
+        int exit;
+    };
+
+    for (int axis = 0; axis < 3; axis++) {
+        auto lo = bounds.minimum[axis];
+        auto extent = bounds.maximum[axis] - lo;
+        if (extent <= 0.0)
+            continue;
+
+        auto width = extent / bin_count;
+        auto scale = bin_count / extent;
+
+        spatial_bin bins[bin_count];
+        for (auto& bin : bins) {
+            bin.box = empty_box();
+            bin.enter = 0;
+            bin.exit = 0;
+        }
+
+        for (const auto& ref : refs) {
+            int first = std::min(bin_count - 1, std::max(0, static_cast<int>((ref.box.minimum[axis] - lo) * scale)));
+            int last = std::min(bin_count - 1, std::max(first, static_cast<int>((ref.box.maximum[axis] - lo) * scale)));
+            bins[first].enter++;
+            bins[last].exit++;
+
+            if (first == last) {
+                grow_box(bins[first].box, ref.box);
+                continue;
+            }
+
+            for (int b = first; b <= last; b++) {
+                aabb slab = ref.box;
+                if (b > first)
+                    slab.minimum[axis] = lo + b * width;
+                if (b < last)
+                    slab.maximum[axis] = lo + (b + 1) * width;
+
+                aabb part;
+                if (clip_reference(ctx, ref, slab, part))
+                    grow_box(bins[b].box, part);
+            }
+        }
+
+        aabb right_box[bin_count - 1];
+        int right_count[bin_count - 1];
+        aabb acc = empty_box();
+        int acc_count = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            grow_box(acc, bins[b].box);
+            acc_count += bins[b].exit;
+            right_box[b - 1] = acc;
+            right_count[b - 1] = acc_count;
+        }
+
+        acc = empty_box();
+        acc_count = 0;
+        for (int b = 0; b < bin_count - 1; b++) {
+            grow_box(acc, bins[b].box);
+            acc_count += bins[b].enter;
+            if (acc_count == 0 || right_count[b] == 0)
+                continue;
+
+            auto cost = acc_count * half_area(acc) + right_count[b] * half_area(right_box[b]);
+            if (cost < split.cost) {
+                split.axis = axis;
+                split.plane = lo + (b + 1) * width;
+                split.cost = cost;
+                split.left_box = acc;
+                split.right_box = right_box[b];
+                split.left_count = acc_count;
+                split.right_count = right_count[b];
+            }
+        }
+    }
+}
+
+
+inline int bvh_tree::split_spatial(build_context& ctx, spatial_task& task, spatial_task children[2], bvh_stats& local) {
+    std::vector<reference>& refs = task.refs;
+    int count = static_cast<int>(refs.size());
+
+    auto centroid = [](const reference& ref, int axis) {
+        return 0.5 * (ref.box.minimum[axis] + ref.box.maximum[axis]);
+    };
+
+    aabb bounds = empty_box();
+    aabb centroid_bounds = empty_box();
+    for (const auto& ref : refs) {
+        grow_box(bounds, ref.box);
+        grow_box(centroid_bounds, 0.5 * (ref.box.minimum + ref.box.maximum));
+    }
+
+    node& n = nodes[task.node_index];
+    n.box = bounds;
+
+    local.max_depth = std::max(local.max_depth, task.depth);
+
+    auto make_leaf = [&]() {
+        int first = ctx.indices_used.fetch_add(count);
+        for (int i = 0; i < count; i++)
+            indices[first + i] = refs[i].prim;
+        n.left_first = first;
+        n.count = count;
+        local.leaf_count++;
+        return 0;
+    };
+
+    if (count == 1 || task.depth >= max_depth)
+        return make_leaf();
+
+    // Best object split over the reference centroids, binned like split_node does.
+    bin_set bins;
+    bins.reset();
+    for (int axis = 0; axis < 3; axis++) {
+        auto lo = centroid_bounds.minimum[axis];
+        auto extent = centroid_bounds.maximum[axis] - lo;
+        if (extent <= 0.0)
+            continue;
+
+        auto scale = bin_count / extent;
+        for (const auto& ref : refs) {
+            int b = std::min(bin_count - 1, static_cast<int>((centroid(ref, axis) - lo) * scale));
+            grow_box(bins.box[axis][b], ref.box);
+            bins.count[axis][b]++;
+        }
+    }
+
+    int axis = 0;
+    int split_bin = 0;
+    double object_cost = infinity;
+    bool object_found = find_split(bins, bounds, centroid_bounds, count, axis, split_bin, object_cost);
+
+    // A spatial split only has something to win where the object split children overlap.
+    spatial_split spatial;
+    auto parent_area = half_area(bounds);
+    if (ctx.split_budget.load() > 0 && parent_area > 0.0) {
+        bool overlapping = true;
+        if (object_found) {
+            aabb left = empty_box();
+            aabb right = empty_box();
+            for (int b = 0; b < bin_count; b++)
+                grow_box(b < split_bin ? left : right, bins.box[axis][b]);
+            aabb overlap;
+            overlapping = intersect_boxes(left, right, overlap) && half_area(overlap) > ctx.min_overlap;
+        }
+        if (overlapping)
+            find_spatial_split(ctx, refs, bounds, spatial);
+    }
+    double spatial_cost = spatial.axis >= 0 ? 1.0 + spatial.cost / parent_area : infinity;
+
+    if (std::min(object_cost, spatial_cost) >= count && count <= max_leaf_size)
+        return make_leaf();
+
+    // Splits only count, and only keep their budget, once the partition below is kept.
+    int splits = 0;
+    auto take_budget = [&]() {
+        if (ctx.split_budget.fetch_sub(1) > 0)
+            return true;
+        ctx.split_budget++;
+        return false;
+    };
+
+    std::vector<reference>& left = children[0].refs;
+    std::vector<reference>& right = children[1].refs;
+    if (spatial_cost < object_cost) {
+        int a = spatial.axis;
+        auto plane = spatial.plane;
+        auto left_area = half_area(spatial.left_box);
+        auto right_area = half_area(spatial.right_box);
+        int left_count = spatial.left_count;
+        int right_count = spatial.right_count;
+
+        for (const auto& ref : refs) {
+            if (ref.box.maximum[a] <= plane) {
+                left.push_back(ref);
+                continue;
+            }
+            if (ref.box.minimum[a] >= plane) {
+                right.push_back(ref);
+                continue;
+            }
+
+            // A reference across the plane stays whole on one side when that is cheaper than
+            // splitting it, or when the budget is used up.
+            aabb left_with = spatial.left_box;
+            grow_box(left_with, ref.box);
+            aabb right_with = spatial.right_box;
+            grow_box(right_with, ref.box);
+            auto split_cost = left_area * left_count + right_area * right_count;
+            auto left_cost = half_area(left_with) * left_count + right_area * (right_count - 1);
+            auto right_cost = left_area * (left_count - 1) + half_area(right_with) * right_count;
+
+            if (split_cost < std::min(left_cost, right_cost) && take_budget()) {
+                aabb left_clip = ref.box;
+                left_clip.maximum[a] = plane;
+                aabb right_clip = ref.box;
+                right_clip.minimum[a] = plane;
+
+                reference left_part = ref;
+                reference right_part = ref;
+                bool in_left = clip_reference(ctx, ref, left_clip, left_part.box);
+                bool in_right = clip_reference(ctx, ref, right_clip, right_part.box);
+                if (in_left)
+                    left.push_back(left_part);
+                if (in_right)
+                    right.push_back(right_part);
+
+                if (in_left && in_right) {
+                    splits++;
+                    continue;
+                }
+
+                // The primitive only touches one half after all, the reference goes back.
+                ctx.split_budget++;
+                if (!in_left && !in_right)
+                    left.push_back(ref);
+                continue;
+            }
+
+            (left_cost <= right_cost ? left : right).push_back(ref);
+        }
+    }
+    else if (object_found) {
+        auto lo = centroid_bounds.minimum[axis];
+        auto scale = bin_count / (centroid_bounds.maximum[axis] - lo);
+        for (const auto& ref : refs) {
+            int b = std::min(bin_count - 1, static_cast<int>((centroid(ref, axis) - lo) * scale));
+            (b < split_bin ? left : right).push_back(ref);
+        }
+    }
+
+    if (left.empty() || right.empty()) {
+        // All centroids coincide, or the split put everything on one side. The references split
+        // for it are dropped, so their budget goes back.
+        left.clear();
+        right.clear();
+        ctx.split_budget += splits;
+        splits = 0;
+        if (count <= max_leaf_size)
+            return make_leaf();
+        left.assign(refs.begin(), refs.begin() + count / 2);
+        right.assign(refs.begin() + count / 2, refs.end());
+    }
+
+    ctx.spatial_splits += splits;
+    int first = ctx.nodes_used.fetch_add(2);
+
+    n.left_first = first;
+    n.count = 0;
+
+    children[0].node_index = first;
+    children[0].depth = task.depth + 1;
+    children[1].node_index = first + 1;
+    children[1].depth = task.depth + 1;
+    std::vector<reference>().swap(refs);
+    return 2;
+}
+
+
+inline void bvh_tree::build_spatial(build_context& ctx, int prim_count) {
+    // Every split adds one reference, so the budget bounds the leaf entries and the node count.
+    int budget = static_cast<int>(prim_count * std::max(0.0, spatial_budget));
+    int capacity = prim_count + budget;
+    nodes.resize(2 * capacity - 1);
+    indices.resize(capacity);
+    ctx.nodes_used = 1;
+    ctx.indices_used = 0;
+    ctx.split_budget = budget;
+    ctx.spatial_splits = 0;
+
+    spatial_task root;
+    root.node_index = 0;
+    root.depth = 0;
+    root.refs.resize(prim_count);
+    aabb scene_box = empty_box();
+    for (int i = 0; i < prim_count; i++) {
+        root.refs[i] = { (*ctx.boxes)[i], i };
+        grow_box(scene_box, (*ctx.boxes)[i]);
+    }
+    ctx.min_overlap = spatial_overlap * half_area(scene_box);
+
+    // Same scheme as the object split build: the top levels are split on this thread until
+    // the ranges are small enough to hand one subtree to each task.
+    std::vector<spatial_task> subtrees;
+    if (!ctx.runner || prim_count < 2 * min_subtree_size) {
+        subtrees.push_back(std::move(root));
+    }
+    else {
+        size_t subtree_size = std::max(min_subtree_size, prim_count / (ctx.runner->thread_count() * 8));
+
+        std::vector<spatial_task> frontier;
+        frontier.push_back(std::move(root));
+        while (!frontier.empty()) {
+            std::vector<spatial_task> next;
+            for (auto& task : frontier) {
+                if (task.refs.size() <= subtree_size) {
+                    subtrees.push_back(std::move(task));
+                    continue;
+                }
+
+                spatial_task children[2];
+                int child_count = split_spatial(ctx, task, children, stats);
+                for (int c = 0; c < child_count; c++)
+                    next.push_back(std::move(children[c]));
+            }
+            frontier.swap(next);
+        }
+
+        std::sort(subtrees.begin(), subtrees.end(), [](const spatial_task& a, const spatial_task& b) {
+            return a.refs.size() > b.refs.size();
+        });
+        stats.subtree_tasks = static_cast<int>(subtrees.size());
+    }
+
+    std::vector<bvh_stats> subtree_stats(subtrees.size());
+    std::vector<std::function<void()>> jobs;
+    for (size_t i = 0; i < subtrees.size(); i++) {
+        jobs.push_back([&, i]() {
+            std::vector<spatial_task> stack;
+            stack.push_back(std::move(subtrees[i]));
+            while (!stack.empty()) {
+                spatial_task task = std::move(stack.back());
+                stack.pop_back();
+
+                spatial_task children[2];
+                if (split_spatial(ctx, task, children, subtree_stats[i]) == 2) {
+                    stack.push_back(std::move(children[1]));
+                    stack.push_back(std::move(children[0]));
+                }
+            }
+        });
+    }
+    if (ctx.runner) {
+        ctx.runner->run(jobs);
+    }
+    else {
+        for (auto& job : jobs)
+            job();
+    }
+
+    for (const auto& s : subtree_stats) {
+        stats.leaf_count += s.leaf_count;
+        stats.max_depth = std::max(stats.max_depth, s.max_depth);
+    }
+
+    indices.resize(ctx.indices_used);
+    stats.spatial_splits = ctx.spatial_splits;
+}
+
+
+inline void bvh_tree::build_subtree(build_context& ctx, const build_task& root, bvh_stats& local) {
+    std::vector<build_task> stack;
+    stack.push_back(root);
+
+    while (!stack.empty()) {
+        auto task = stack.back();
+        stack.pop_back();
+
+        build_task children[2];
+        if (split_node(ctx, task, false, children, local) == 2) {
+            stack.push_back(children[1]);
+            stack.push_back(children[0]);
+        }
+    }
+}
+
+
+inline void bvh_tree::build(const std::vector<aabb>& boxes, bvh_task_runner* runner, const clip_function& clip) {
+    auto start_time = std::chrono::steady_clock::now();
+
+    clear();
+
+    int prim_count = static_cast<int>(boxes.size());
+    stats.primitive_count = prim_count;
+    if (prim_count == 0)
+        return;
+
+    build_context ctx;
+    ctx.boxes = &boxes;
+    ctx.centroids.resize(prim_count);
+    ctx.runner = runner && runner->thread_count() > 1 ? runner : nullptr;
+
+    indices.resize(prim_count);
+    for (int i = 0; i < prim_count; i++) {
+        ctx.centroids[i] = 0.5 * (boxes[i].minimum + boxes[i].maximum);
+        indices[i] = i;
+    }
+
+    if (spatial && !linear) {
+        ctx.clip = &clip;
+        build_spatial(ctx, prim_count);
+    }
+    else {
+        if (linear)
+            sort_morton(ctx);
+
+        // A binary tree over n primitives never needs more than 2n - 1 nodes. Node slots are
+        // handed out atomically so subtree tasks can fill the array concurrently.
+        nodes.resize(2 * prim_count - 1);
+        ctx.nodes_used = 1;
+
+        build_task root = { 0, 0, prim_count, 0 };
+
+        if (!ctx.runner || prim_count < 2 * min_subtree_size) {
+            build_subtree(ctx, root, stats);
+        }
+        else {
+            // Split the top levels breadth first, binning each big node in parallel, until there
+            // are enough independent ranges to keep every thread busy with its own subtree.
+            int subtree_size = std::max(min_subtree_size, prim_count / (ctx.runner->thread_count() * 8));
+
+            std::vector<build_task> frontier(1, root);
+            std::vector<build_task> subtrees;
+            while (!frontier.empty()) {
+                std::vector<build_task> next;
+                for (const auto& task : frontier) {
+                    if (task.end - task.begin <= subtree_size) {
+                        subtrees.push_back(task);
+                        continue;
+                    }
+
+                    build_task children[2];
+                    int child_count = split_node(ctx, task, true, children, stats);
+                    for (int c = 0; c < child_count; c++)
+                        next.push_back(children[c]);
+                }
+                frontier.swap(next);
+            }
+
+            // Largest ranges first so the long tasks do not end up as the tail.
+            std::sort(subtrees.begin(), subtrees.end(), [](const build_task& a, const build_task& b) {
+                return (a.end - a.begin) > (b.end - b.begin);
+            });
+
+            std::vector<bvh_stats> subtree_stats(subtrees.size());
+            std::vector<std::function<void()>> jobs;
+            for (size_t i = 0; i < subtrees.size(); i++) {
+                jobs.push_back([&, i]() {
+                    build_subtree(ctx, subtrees[i], subtree_stats[i]);
+                });
+            }
+            ctx.runner->run(jobs);
+
+            for (const auto& s : subtree_stats) {
+                stats.leaf_count += s.leaf_count;
+                stats.max_depth = std::max(stats.max_depth, s.max_depth);
+            }
+            stats.subtree_tasks = static_cast<int>(subtrees.size());
+        }
+    }
+
+    nodes.resize(ctx.nodes_used);
+    stats.node_count = ctx.nodes_used;
+    stats.reference_count = static_cast<int>(indices.size());
+
+    if (linear) {
+        // The rotations break the children after parent order fit_boxes sweeps in, so the
+        // boxes are fitted once before them and never again.
+        fit_boxes(boxes);
+        for (int pass = 0; pass < rotation_passes; pass++)
+            rotate_tree();
+    }
+
+    update_links();
+    stats.build_cost = sah_cost();
+
+    root_bounds = nodes[0].box;
+    collapse();
+    stats.wide_node_count = static_cast<int>(wide_nodes.size());
+
+    if (quantized && quantize()) {
+        release_binary_nodes();
+        stats.node_bytes = quantized_nodes.size() * sizeof(quantized_node);
+    }
+    else {
+        stats.node_bytes = nodes.size() * sizeof(node) + wide_nodes.size() * sizeof(wide_node)
+            + (parents.size() + prim_leaf.size() + wide_lane.size()) * sizeof(int);
+    }
+
+    auto end_time = std::chrono::steady_clock::now();
+    stats.build_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+}
+
+inline void bvh_tree::update_links() {
+    parents.assign(nodes.size(), -1);
+    prim_leaf.assign(stats.primitive_count, -1);
+    area_sum = 0.0;
+
+    for (int i = 0; i < static_cast<int>(nodes.size()); i++) {
+        const node& n = nodes[i];
+        area_sum += node_weight(n) * half_area(n.box);
+        if (n.is_leaf()) {
+            for (int p = n.left_first; p < n.left_first + n.count; p++)
+                prim_leaf[indices[p]] = i;
+        }
+        else {
+            parents[n.left_first] = i;
+            parents[n.left_first + 1] = i;
+        }
+    }
+}
+
+
+inline void bvh_tree::collapse() {
+    wide_nodes.clear();
+    wide_lane.assign(nodes.size(), -1);
+    if (nodes.empty())
+        return;
+
+    // Every wide node replaces at least one binary interior node, a lone leaf at the root gets one too.
+    wide_nodes.reserve(nodes.size() / 2 + 1);
+
+    // Binary nodes waiting to become a wide node, with the parent lane that will point at it.
+    struct pending {
+        int source;
+        int parent;
+        int lane;
+    };
+    std::vector<pending> stack;
+    stack.push_back({ 0, -1, 0 });
+
+    // Wide nodes are created as they are popped, which lays the array out depth first. The child
+    // with the largest box is popped first and ends up right behind its parent, so the descent a
+    // ray is most likely to take continues in the next cache lines.
+    while (!stack.empty()) {
+        pending p = stack.back();
+        stack.pop_back();
+
+        int target = static_cast<int>(wide_nodes.size());
+        wide_nodes.emplace_back();
+        if (p.parent >= 0)
+            wide_nodes[p.parent].child[p.lane] = target;
+
+        int lanes[wide_width];
+        int lane_count = 0;
+        if (nodes[p.source].is_leaf()) {
+            lanes[lane_count++] = p.source;
+        }
+        else {
+            lanes[lane_count++] = nodes[p.source].left_first;
+            lanes[lane_count++] = nodes[p.source].left_first + 1;
+
+            // Open the interior child with the largest box until the lanes are full, the big
+            // boxes are the ones most rays would otherwise have to enter one level down.
+            while (lane_count < wide_width) {
+                int open = -1;
+                double open_area = -1.0;
+                for (int l = 0; l < lane_count; l++) {
+                    const node& c = nodes[lanes[l]];
+                    if (!c.is_leaf() && half_area(c.box) > open_area) {
+                        open = l;
+                        open_area = half_area(c.box);
+                    }
+                }
+                if (open < 0)
+                    break;
+
+                int opened = lanes[open];
+                lanes[open] = nodes[opened].left_first;
+                lanes[lane_count++] = nodes[opened].left_first + 1;
+            }
+
+            std::sort(lanes, lanes + lane_count, [&](int x, int y) {
+                return half_area(nodes[x].box) > half_area(nodes[y].box);
+            });
+        }
+
+        wide_node& w = wide_nodes[target];
+        for (int l = 0; l < wide_width; l++) {
+            if (l >= lane_count) {
+                for (int a = 0; a < 3; a++) {
+                    w.lo[a][l] = std::numeric_limits<float>::infinity();
+                    w.hi[a][l] = -std::numeric_limits<float>::infinity();
+                }
+                w.child[l] = -1;
+                w.count[l] = 0;
+                continue;
+            }
+
+            const node& c = nodes[lanes[l]];
+            wide_lane[lanes[l]] = target * wide_width + l;
+            store_wide_box(lanes[l], c.box);
+            w.child[l] = c.is_leaf() ? c.left_first : -1;
+            w.count[l] = c.is_leaf() ? c.count : 0;
+        }
+
+        for (int l = lane_count - 1; l >= 0; l--) {
+            if (!nodes[lanes[l]].is_leaf())
+                stack.push_back({ lanes[l], target, l });
+        }
+    }
+}
+
+
+inline bool bvh_tree::quantize() {
+    quantized_nodes.clear();
+    if (wide_nodes.empty())
+        return false;
+    for (const wide_node& w : wide_nodes) {
+        for (int l = 0; l < wide_width; l++) {
+            if (w.count[l] > 255)
+                return false;
+        }
+    }
+
+    // The root frame starts at the corner of the union of its lanes.
+    const wide_node& root = wide_nodes[0];
+    for (int a = 0; a < 3; a++) {
+        root_origin[a] = std::numeric_limits<float>::infinity();
+        for (int l = 0; l < wide_width; l++) {
+            if (root.lo[a][l] <= root.hi[a][l])
+                root_origin[a] = std::min(root_origin[a], root.lo[a][l]);
+        }
+    }
+
+    // Wide nodes waiting to be quantized into the slot their parent reserved for them.
+    struct pending {
+        int source;
+        int target;
+        float origin[3];
+    };
+    std::vector<pending> stack;
+    stack.push_back({ 0, 0, { root_origin[0], root_origin[1], root_origin[2] } });
+
+    std::vector<int> packed_indices;
+    packed_indices.reserve(indices.size());
+    quantized_nodes.reserve(wide_nodes.size());
+    quantized_nodes.emplace_back();
+
+    // The interior children of a node get consecutive slots when it is quantized, and the first
+    // of them is popped next, so the descent most rays take still continues right behind.
+    while (!stack.empty()) {
+        pending p = stack.back();
+        stack.pop_back();
+
+        const wide_node& w = wide_nodes[p.source];
+        quantized_node q;
+        float child_origin[wide_width][3];
+
+        for (int a = 0; a < 3; a++) {
+            const float o = p.origin[a];
+            float hi = o;
+            for (int l = 0; l < wide_width; l++) {
+                if (w.lo[a][l] <= w.hi[a][l])
+                    hi = std::max(hi, w.hi[a][l]);
+            }
+
+            // Start a little below the smallest power of two step and grow it until 255 steps
+            // reach past the union in float arithmetic. The step stays above zero so the
+            // inverted box of an unused lane never has zero width.
+            int exponent = -126;
+            if (hi > o) {
+                int e;
+                std::frexp((hi - o) / 255.0f, &e);
+                exponent = std::max(-126, e - 2);
+            }
+            while (exponent < 127 && !(o + 255.0f * step_size(exponent) >= hi && o + 255.0f * step_size(exponent) > o))
+                exponent++;
+            const float step = step_size(exponent);
+            q.exponent[a] = static_cast<int8_t>(exponent);
+
+            for (int l = 0; l < wide_width; l++) {
+                if (!(w.lo[a][l] <= w.hi[a][l])) {
+                    q.lo[a][l] = 255;
+                    q.hi[a][l] = 0;
+                    continue;
+                }
+
+                // Start from the nearest steps and move outward until the planes, computed the
+                // same way as in the traversal, enclose the float box. A box the frame does
+                // not hold can only come from a parent that does not contain its children,
+                // the float nodes are kept then.
+                int qlo = std::max(0, std::min(255, static_cast<int>(floor((w.lo[a][l] - o) / step))));
+                int qhi = std::max(0, std::min(255, static_cast<int>(ceil((w.hi[a][l] - o) / step))));
+                while (qlo > 0 && o + float(qlo) * step > w.lo[a][l])
+                    qlo--;
+                while (qhi < 255 && o + float(qhi) * step < w.hi[a][l])
+                    qhi++;
+                if (o + float(qlo) * step > w.lo[a][l] || o + float(qhi) * step < w.hi[a][l]) {
+                    quantized_nodes.clear();
+                    return false;
+                }
+                q.lo[a][l] = static_cast<uint8_t>(qlo);
+                q.hi[a][l] = static_cast<uint8_t>(qhi);
+                child_origin[l][a] = o + float(qlo) * step;
+            }
+        }
+
+        q.child = static_cast<int>(quantized_nodes.size());
+        q.first = static_cast<int>(packed_indices.size());
+        int interior[wide_width];
+        int interior_count = 0;
+        for (int l = 0; l < wide_width; l++) {
+            q.count[l] = static_cast<uint8_t>(w.count[l]);
+            if (w.count[l] > 0)
+                packed_indices.insert(packed_indices.end(), indices.begin() + w.child[l], indices.begin() + w.child[l] + w.count[l]);
+            else if (w.child[l] >= 0)
+                interior[interior_count++] = l;
+        }
+
+        quantized_nodes[p.target] = q;
+        for (int k = interior_count - 1; k >= 0; k--) {
+            int l = interior[k];
+            stack.push_back({ w.child[l], q.child + k, { child_origin[l][0], child_origin[l][1], child_origin[l][2] } });
+        }
+        quantized_nodes.resize(quantized_nodes.size() + interior_count);
+    }
+
+    indices.swap(packed_indices);
+    return true;
+}
+
+
+inline void bvh_tree::release_binary_nodes() {
+    std::vector<node>().swap(nodes);
+    std::vector<int>().swap(parents);
+    std::vector<int>().swap(prim_leaf);
+    std::vector<wide_node>().swap(wide_nodes);
+    std::vector<int>().swap(wide_lane);
+}
+
+
+inline int bvh_tree::intersect(
+    const wide_node& w, const wide_ray& wr, float t_min, float t_max, float t_near[wide_width]
+) {
+#if BVH_SSE
+    __m128 enter = _mm_set1_ps(t_min);
+    __m128 leave = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        __m128 origin = _mm_set1_ps(wr.origin[a]);
+        __m128 inv_dir = _mm_set1_ps(wr.inv_dir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(wr.negative[a] ? w.hi[a] : w.lo[a]), origin), inv_dir);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(wr.negative[a] ? w.lo[a] : w.hi[a]), origin), inv_dir);
+        // max and min return their second operand for a NaN from 0 * infinity, the interval is kept.
+        enter = _mm_max_ps(t0, enter);
+        leave = _mm_min_ps(t1, leave);
+    }
+    _mm_store_ps(t_near, enter);
+    return _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+#else
+    int mask = 0;
+    for (int l = 0; l < wide_width; l++) {
+        float enter = t_min;
+        float leave = t_max;
+        for (int a = 0; a < 3; a++) {
+            float t0 = ((wr.negative[a] ? w.hi[a][l] : w.lo[a][l]) - wr.origin[a]) * wr.inv_dir[a];
+            float t1 = ((wr.negative[a] ? w.lo[a][l] : w.hi[a][l]) - wr.origin[a]) * wr.inv_dir[a];
+            enter = t0 > enter ? t0 : enter;
+            leave = t1 < leave ? t1 : leave;
+        }
+        t_near[l] = enter;
+        if (enter <= leave)
+            mask |= 1 << l;
+    }
+    return mask;
+#endif
+}
+
+
+inline int bvh_tree::intersect(
+    const quantized_node& q, const float origin[3], const wide_ray& wr, float t_min, float t_max,
+    float t_near[wide_width], float lo[3][wide_width]
+) {
+#if BVH_SSE
+    auto load_steps = [](const uint8_t* steps) {
+        int32_t packed;
+        std::memcpy(&packed, steps, sizeof(packed));
+        __m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), _mm_setzero_si128());
+        return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+    };
+
+    __m128 enter = _mm_set1_ps(t_min);
+    __m128 leave = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        // The step is a power of two, so the products are exact and match quantize() whether
+        // or not they get fused into the additions.
+        __m128 base = _mm_set1_ps(origin[a]);
+        __m128 step = _mm_set1_ps(step_size(q.exponent[a]));
+        __m128 plane_lo = _mm_add_ps(base, _mm_mul_ps(load_steps(q.lo[a]), step));
+        __m128 plane_hi = _mm_add_ps(base, _mm_mul_ps(load_steps(q.hi[a]), step));
+        _mm_storeu_ps(lo[a], plane_lo);
+        __m128 ray_origin = _mm_set1_ps(wr.origin[a]);
+        __m128 inv_dir = _mm_set1_ps(wr.inv_dir[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(wr.negative[a] ? plane_hi : plane_lo, ray_origin), inv_dir);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(wr.negative[a] ? plane_lo : plane_hi, ray_origin), inv_dir);
+        enter = _mm_max_ps(t0, enter);
+        leave = _mm_min_ps(t1, leave);
+    }
+    _mm_store_ps(t_near, enter);
+    return _mm_movemask_ps(_mm_cmple_ps(enter, leave));
+#else
+    int mask = 0;
+    for (int l = 0; l < wide_width; l++) {
+        float enter = t_min;
+        float leave = t_max;
+        for (int a = 0; a < 3; a++) {
+            float step = step_size(q.exponent[a]);
+            float plane_lo = origin[a] + float(q.lo[a][l]) * step;
+            float plane_hi = origin[a] + float(q.hi[a][l]) * step;
+            lo[a][l] = plane_lo;
+            float t0 = ((wr.negative[a] ? plane_hi : plane_lo) - wr.origin[a]) * wr.inv_dir[a];
+            float t1 = ((wr.negative[a] ? plane_lo : plane_hi) - wr.origin[a]) * wr.inv_dir[a];
+            enter = t0 > enter ? t0 : enter;
+            leave = t1 < leave ? t1 : leave;
+        }
+        t_near[l] = enter;
+        if (enter <= leave)
+            mask |= 1 << l;
+    }
+    return mask;
+#endif
+}
+
+
+template <typename F>
+inline void bvh_tree::refit(const std::vector<int>& prims, F&& prim_box) {
+    if (compressed() || split_references())
+        return;
+
+    for (int prim : prims) {
+        if (prim < 0 || prim >= static_cast<int>(prim_leaf.size()))
+            continue;
+
+        int current = prim_leaf[prim];
+        while (current >= 0) {
+            node& n = nodes[current];
+
+            auto box = empty_box();
+            if (n.is_leaf()) {
+                for (int p = n.left_first; p < n.left_first + n.count; p++)
+                    grow_box(box, prim_box(indices[p]));
+            }
+            else {
+                grow_box(box, nodes[n.left_first].box);
+                grow_box(box, nodes[n.left_first + 1].box);
+            }
+
+            // Once a box stops changing nothing above it can change either.
+            if (box.minimum[0] == n.box.minimum[0] && box.minimum[1] == n.box.minimum[1] && box.minimum[2] == n.box.minimum[2]
+                && box.maximum[0] == n.box.maximum[0] && box.maximum[1] == n.box.maximum[1] && box.maximum[2] == n.box.maximum[2])
+                break;
+
+            area_sum += node_weight(n) * (half_area(box) - half_area(n.box));
+            n.box = box;
+            store_wide_box(current, box);
+            if (current == 0)
+                root_bounds = box;
+            current = parents[current];
+        }
+    }
+}
+
+
+template <typename F>
+inline bool bvh_tree::hit(
+    const ray& r, double t_min, double& t_max, F&& hit_primitive, bvh_traversal_stats* counters
+) const {
+    if (indices.empty())
+        return false;
+    if (compressed())
+        return traverse_quantized(r, t_min, t_max, hit_primitive, counters);
+    return traverse(r, t_min, t_max, hit_primitive, counters);
+}
+
+
+inline bool bvh_tree::start_traversal(
+    const ray& r, double t_min, double t_max, wide_ray& wr, bvh_traversal_stats* counters
+) const {
+    const point3 origin = r.origin();
+    const vec3 dir = r.direction();
+    const vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+
+    if (counters)
+        counters->rays++;
+
+    double t_entry;
+    if (!hit_box(root_bounds, origin, inv_dir, t_min, t_max, t_entry))
+        return false;
+
+    for (int a = 0; a < 3; a++) {
+        wr.origin[a] = static_cast<float>(origin[a]);
+        wr.inv_dir[a] = static_cast<float>(inv_dir[a]);
+        wr.negative[a] = inv_dir[a] < 0.0;
+    }
+    return true;
+}
+
+
+template <typename F>
+inline bool bvh_tree::traverse(
+    const ray& r, double t_min, double& t_max, F&& hit_primitive, bvh_traversal_stats* counters
+) const {
+    wide_ray wr;
+    if (!start_traversal(r, t_min, t_max, wr, counters))
+        return false;
+
+    // Distances in single precision are padded by a few ulps so rounding never culls a box the
+    // double precision test would have entered.
+    const float pad = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+    const float t_lo = static_cast<float>(t_min);
+
+    struct entry {
+        int child;
+        int count;
+        float t;
+    };
+
+    // Every wide node replaces its stack entry by at most four, so the depth bounds the stack.
+    entry stack[(wide_width - 1) * (max_depth + 1) + 1];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, t_lo };
+    bool hit_anything = false;
+    int node_visits = 0;
+    int primitive_tests = 0;
+
+    while (stack_size > 0) {
+        entry e = stack[--stack_size];
+        if (e.t > t_max)
+            continue;
+
+        if (e.count > 0) {
+            primitive_tests += e.count;
+            for (int i = e.child; i < e.child + e.count; i++) {
+                if (hit_primitive(indices[i], t_min, t_max))
+                    hit_anything = true;
+            }
+            continue;
+        }
+
+        node_visits++;
+        const wide_node& w = wide_nodes[e.child];
+        float t_near[wide_width];
+        int mask = intersect(w, wr, t_lo, static_cast<float>(t_max) * pad, t_near);
+
+        // Push the hit children far to near, so the nearest is visited first and the shrinking
+        // t_max culls the others when they are popped.
+        entry hits[wide_width];
+        int hit_count = 0;
+        for (int l = 0; l < wide_width; l++) {
+            if (!(mask & (1 << l)))
+                continue;
+            entry h = { w.child[l], w.count[l], t_near[l] };
+            int k = hit_count++;
+            for (; k > 0 && hits[k - 1].t < h.t; k--)
+                hits[k] = hits[k - 1];
+            hits[k] = h;
+        }
+        for (int k = 0; k < hit_count; k++)
+            stack[stack_size++] = hits[k];
+    }
+
+    if (counters) {
+        counters->nodes += node_visits;
+        counters->primitives += primitive_tests;
+    }
+    return hit_anything;
+}
+
+
+template <typename F>
+inline bool bvh_tree::traverse_quantized(
+    const ray& r, double t_min, double& t_max, F&& hit_primitive, bvh_traversal_stats* counters
+) const {
+    wide_ray wr;
+    if (!start_traversal(r, t_min, t_max, wr, counters))
+        return false;
+
+    const float pad = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+    const float t_lo = static_cast<float>(t_min);
+
+    // Same as in traverse(), interior entries also carry the frame origin of their node.
+    struct entry {
+        int child;
+        int count;
+        float t;
+        float origin[3];
+    };
+
+    entry stack[(wide_width - 1) * (max_depth + 1) + 1];
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, t_lo, { root_origin[0], root_origin[1], root_origin[2] } };
+    bool hit_anything = false;
+    int node_visits = 0;
+    int primitive_tests = 0;
+
+    while (stack_size > 0) {
+        entry e = stack[--stack_size];
+        if (e.t > t_max)
+            continue;
+
+        if (e.count > 0) {
+            primitive_tests += e.count;
+            for (int i = e.child; i < e.child + e.count; i++) {
+                if (hit_primitive(indices[i], t_min, t_max))
+                    hit_anything = true;
+            }
+            continue;
+        }
+
+        node_visits++;
+        const quantized_node& q = quantized_nodes[e.child];
+        float t_near[wide_width];
+        float lo[3][wide_width];
+        int mask = intersect(q, e.origin, wr, t_lo, static_cast<float>(t_max) * pad, t_near, lo);
+
+        // Children are found by counting the lanes before them, interior ones take the next
+        // node and leaves the next run of primitives.
+        entry hits[wide_width];
+        int hit_count = 0;
+        int child = q.child;
+        int first = q.first;
+        for (int l = 0; l < wide_width; l++) {
+            int count = q.count[l];
+            if (mask & (1 << l)) {
+                entry h = { count > 0 ? first : child, count, t_near[l], { lo[0][l], lo[1][l], lo[2][l] } };
+                int k = hit_count++;
+                for (; k > 0 && hits[k - 1].t < h.t; k--)
+                    hits[k] = hits[k - 1];
+                hits[k] = h;
+            }
+            if (count > 0)
+                first += count;
+            else
+                child++;
+        }
+        for (int k = 0; k < hit_count; k++)
+            stack[stack_size++] = hits[k];
+    }
+
+    if (counters) {
+        counters->nodes += node_visits;
+        counters->primitives += primitive_tests;
+    }
+    return hit_anything;
+}
+
+
+// Hittable wrapper that traces a list of objects through a bvh_tree.
+class bvh : public hittable {
+    public:
+        bvh() {}
+        bvh(const hittable_list& list) { build(list.objects); }
+        virtual ~bvh() { }
+
+        void clear() {
+            objects.clear();
+            unbounded.clear();
+            slots.clear();
+            tree.clear();
+        }
+
+        void build(const std::vector<shared_ptr<hittable>>& src_objects, bvh_task_runner* runner = nullptr);
+
+        // Update the tree after the given source objects moved or resized. Returns false when the
+        // tree quality dropped far enough that the caller should build it again.
+        bool refit(const std::vector<int>& source_indices);
+
+        const bvh_stats& stats() const { return tree.stats; }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override {
+            return hit(r, t_min, t_max, rec, nullptr);
+        }
+
+        // Same as hit, adding the traversal work to counters.
+        bool hit(const ray& r, double t_min, double t_max, hit_record& rec, bvh_traversal_stats* counters) const;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            if (tree.empty() || !unbounded.empty())
+                return false;
+            output_box = tree.bounds();
+            return true;
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> objects;   // Objects referenced by the tree.
+        std::vector<shared_ptr<hittable>> unbounded; // Objects without a bounding box, tested every ray.
+        std::vector<int> slots;                      // Source object index to index in objects, -1 when unbounded.
+        bvh_tree tree;
+};
+
+
+inline void bvh::build(const std::vector<shared_ptr<hittable>>& src_objects, bvh_task_runner* runner) {
+    clear();
+
+    std::vector<aabb> boxes;
+    boxes.reserve(src_objects.size());
+    objects.reserve(src_objects.size());
+    slots.reserve(src_objects.size());
+
+    for (const auto& object : src_objects) {
+        aabb box;
+        if (object->bounding_box(0, 0, box)) {
+            slots.push_back(static_cast<int>(objects.size()));
+            objects.push_back(object);
+            boxes.push_back(box);
+        }
+        else {
+            slots.push_back(-1);
+            unbounded.push_back(object);
+        }
+    }
+
+    // Spatial splits clip each object through its own shape.
+    tree.build(boxes, runner, [this](int index, const aabb& clip, aabb& output_box) {
+        return objects[index]->clipped_box(clip, output_box);
+    });
+}
+
+
+inline bool bvh::refit(const std::vector<int>& source_indices) {
+    std::vector<int> prims;
+    prims.reserve(source_indices.size());
+    for (int index : source_indices) {
+        if (index >= 0 && index < static_cast<int>(slots.size()) && slots[index] >= 0)
+            prims.push_back(slots[index]);
+    }
+
+    tree.refit(prims, [&](int prim) {
+        aabb box = empty_box();
+        objects[prim]->bounding_box(0, 0, box);
+        return box;
+    });
+
+    return !tree.refit_degraded();
+}
+
+
+inline bool bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec, bvh_traversal_stats* counters) const {
+    auto hit_anything = false;
+    auto closest_so_far = t_max;
+
+    for (const auto& object : unbounded) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
+            hit_anything = true;
+            closest_so_far = rec.t;
+        }
+    }
+
+    // Hittables only write to rec when they report a closer hit, so it can be passed straight through.
+    if (tree.hit(r, t_min, closest_so_far, [&](int index, double t0, double& t1) {
+            if (!objects[index]->hit(r, t0, t1, rec))
+                return false;
+            t1 = rec.t;
+            return true;
+        }, counters))
+        hit_anything = true;
+
+    return hit_anything;
+}
+
+
+#endif
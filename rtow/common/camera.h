@@ -48,13 +48,13 @@ class camera {
             time1 = _time1;
         }
 
-        ray get_ray(double s, double t) const {
-            vec3 rd = lens_radius * random_in_unit_disk();
+        ray get_ray(double s, double t, sampler& smp) const {
+            vec3 rd = lens_radius * random_in_unit_disk(smp);
             vec3 offset = u * rd.x() + v * rd.y();
             return ray(
                 origin + offset,
                 lower_left_corner + s*horizontal + t*vertical - origin - offset,
-                random_double(time0, time1)
+                smp.next_double(time0, time1)
             );
         }
 
@@ -17,15 +17,18 @@
 
 class perlin {
     public:
-        perlin() {
+        // The tables come from a fixed stream, so the noise is the same in every render.
+        perlin(uint32_t seed = 0) {
+            random_sampler s(seed);
+
             ranvec = new vec3[point_count];
             for (int i = 0; i < point_count; ++i) {
-                ranvec[i] = unit_vector(vec3::random(-1,1));
+                ranvec[i] = unit_vector(vec3::random(-1,1,s));
             }
 
-            perm_x = perlin_generate_perm();
-            perm_y = perlin_generate_perm();
-            perm_z = perlin_generate_perm();
+            perm_x = perlin_generate_perm(s);
+            perm_y = perlin_generate_perm(s);
+            perm_z = perlin_generate_perm(s);
         }
 
         ~perlin() {
@@ -77,20 +80,20 @@ class perlin {
         int* perm_y;
         int* perm_z;
 
-        static int* perlin_generate_perm() {
+        static int* perlin_generate_perm(sampler& s) {
             auto p = new int[point_count];
 
             for (int i = 0; i < point_count; i++)
                 p[i] = i;
 
-            permute(p, point_count);
+            permute(p, point_count, s);
 
             return p;
         }
 
-        static void permute(int* p, int n) {
+        static void permute(int* p, int n, sampler& s) {
             for (int i = n-1; i > 0; i--) {
-                int target = random_int(0,i);
+                int target = s.next_int(0,i);
                 int tmp = p[i];
                 p[i] = p[target];
                 p[target] = tmp;
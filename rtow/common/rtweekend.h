@@ -55,6 +55,7 @@ inline int random_int(int min, int max) {
 
 // Common Headers
 
+#include "sampler.h"
 #include "ray.h"
 #include "vec3.h"
 
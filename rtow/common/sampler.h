@@ -0,0 +1,190 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+
+// Source of the sample values for one path. A path asks for its values one dimension at a time;
+// start() selects the pixel and sample index and start_bounce() moves on to the next bounce, so
+// the values only depend on where they are used and never on which thread asks for them.
+class sampler {
+    public:
+        virtual ~sampler() {}
+
+        virtual void start(uint32_t pixel, uint32_t sample_index) = 0;
+        virtual void start_bounce(uint32_t bounce) = 0;
+
+        // Returns the next dimension as a real in [0,1).
+        virtual double next_double() = 0;
+
+        // Returns the next two dimensions. Samplers that stratify pairs of dimensions keep them together.
+        virtual void next_2d(double& u, double& v) {
+            u = next_double();
+            v = next_double();
+        }
+
+        // Returns a random real in [min,max).
+        double next_double(double min, double max) {
+            return min + (max-min)*next_double();
+        }
+
+        // Returns a random integer in [min,max].
+        int next_int(int min, int max) {
+            return static_cast<int>(next_double(min, max+1));
+        }
+
+        // PCG output permutation applied to a single word, see Jarzynski and Olano,
+        // "Hash Functions for GPU Rendering", JCGT 2020.
+        static uint32_t hash(uint32_t v) {
+            uint32_t state = v * 747796405u + 2891336453u;
+            uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+            return (word >> 22u) ^ word;
+        }
+
+        static double to_double(uint32_t v) {
+            return v * (1.0 / 4294967296.0);
+        }
+};
+
+
+// Counter based random numbers. Every value is a hash of the seed, the pixel, the sample index,
+// the bounce and a running dimension counter, so there is no state shared between threads and
+// a pixel gets the same numbers no matter which thread or tile renders it.
+class random_sampler : public sampler {
+    public:
+        random_sampler(uint32_t seed = 0) : seed(seed) { start(0, 0); }
+
+        using sampler::next_double;
+
+        virtual void start(uint32_t pixel, uint32_t sample_index) override {
+            pixel_key = hash(seed ^ hash(pixel ^ hash(sample_index)));
+            start_bounce(0);
+        }
+
+        // Each bounce of a path draws from its own stream.
+        virtual void start_bounce(uint32_t bounce) override {
+            stream = hash(pixel_key ^ hash(bounce + 0x9e3779b9u));
+            dimension = 0;
+        }
+
+        virtual double next_double() override {
+            return to_double(hash(stream ^ hash(dimension++)));
+        }
+
+    private:
+        uint32_t seed;
+        uint32_t pixel_key = 0;
+        uint32_t stream = 0;
+        uint32_t dimension = 0;
+};
+
+
+// Owen scrambled Sobol points, following Burley, "Practical Hash-based Owen Scrambling", JCGT 2020.
+// Dimensions are handed out in groups of four from the first four Sobol dimensions. Every group,
+// bounce and pixel shuffles the sample order and scrambles the values with its own seed, which
+// keeps the groups uncorrelated while each one stays stratified over the samples of a pixel.
+class sobol_sampler : public sampler {
+    public:
+        sobol_sampler(uint32_t seed = 0) : seed(seed) { start(0, 0); }
+
+        using sampler::next_double;
+
+        virtual void start(uint32_t pixel, uint32_t sample_index) override {
+            pixel_key = hash(seed ^ hash(pixel));
+            index = sample_index;
+            start_bounce(0);
+        }
+
+        virtual void start_bounce(uint32_t bounce) override {
+            bounce_key = hash(pixel_key ^ hash(bounce + 0x9e3779b9u));
+            dimension = 0;
+        }
+
+        virtual double next_double() override {
+            return to_double(sample(dimension++));
+        }
+
+        virtual void next_2d(double& u, double& v) override {
+            // Start pairs on an even dimension so both values come from one stratified pair.
+            dimension += dimension & 1;
+            u = next_double();
+            v = next_double();
+        }
+
+    private:
+        uint32_t seed;
+        uint32_t pixel_key = 0;
+        uint32_t bounce_key = 0;
+        uint32_t index = 0;
+        uint32_t dimension = 0;
+
+        uint32_t sample(uint32_t dim) const {
+            uint32_t group_key = hash(bounce_key ^ hash(dim >> 2));
+            uint32_t shuffled = nested_uniform_scramble(index, group_key);
+            return nested_uniform_scramble(sobol(shuffled, dim & 3), hash(group_key + (dim & 3)));
+        }
+
+        static uint32_t sobol(uint32_t i, uint32_t dim) {
+            const uint32_t* v = directions()[dim];
+            uint32_t x = 0;
+            for (int bit = 0; i; bit++, i >>= 1) {
+                if (i & 1)
+                    x ^= v[bit];
+            }
+            return x;
+        }
+
+        // Direction numbers of the first four dimensions, from the Joe and Kuo primitive polynomials.
+        static const uint32_t (*directions())[32] {
+            static const struct table {
+                uint32_t v[4][32];
+
+                table() {
+                    const int degree[4] = { 0, 1, 2, 3 };
+                    const uint32_t coefficients[4] = { 0, 0, 1, 1 };
+                    const uint32_t initial[4][3] = { { 0, 0, 0 }, { 1, 0, 0 }, { 1, 3, 0 }, { 1, 3, 1 } };
+
+                    for (int i = 0; i < 32; i++)
+                        v[0][i] = 1u << (31 - i);
+
+                    for (int d = 1; d < 4; d++) {
+                        int s = degree[d];
+                        for (int i = 0; i < 32; i++) {
+                            if (i < s) {
+                                v[d][i] = initial[d][i] << (31 - i);
+                                continue;
+                            }
+                            v[d][i] = v[d][i - s] ^ (v[d][i - s] >> s);
+                            for (int k = 1; k < s; k++)
+                                v[d][i] ^= ((coefficients[d] >> (s - 1 - k)) & 1) * v[d][i - k];
+                        }
+                    }
+                }
+            } t;
+            return t.v;
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+            x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+            x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+            x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+            return (x >> 16) | (x << 16);
+        }
+
+        static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+            x += seed;
+            x ^= x * 0x6c50b47cu;
+            x ^= x * 0xb82f1e52u;
+            x ^= x * 0xc7afe638u;
+            x ^= x * 0x8d22f6e6u;
+            return x;
+        }
+
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+        }
+};
+
+
+#endif
@@ -70,6 +70,10 @@ class vec3 {
             return vec3(random_double(min,max), random_double(min,max), random_double(min,max));
         }
 
+        inline static vec3 random(double min, double max, sampler& s) {
+            return vec3(s.next_double(min,max), s.next_double(min,max), s.next_double(min,max));
+        }
+
     public:
         double e[3];
 };
@@ -126,28 +130,47 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
-inline vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
+// The sampling functions map the sampler values directly instead of rejecting points, so every
+// value drawn is used and stratified sampler dimensions stay stratified.
+
+inline vec3 random_in_unit_disk(sampler& s) {
+    // Concentric mapping of the square onto the disk, see Shirley and Chiu, "A Low Distortion Map
+    // Between Disk and Square", 1997.
+    double u, v;
+    s.next_2d(u, v);
+    auto a = 2*u - 1;
+    auto b = 2*v - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, phi;
+    if (a*a > b*b) {
+        r = a;
+        phi = (pi/4) * (b/a);
+    }
+    else {
+        r = b;
+        phi = (pi/2) - (pi/4) * (a/b);
     }
+    return vec3(r*cos(phi), r*sin(phi), 0);
 }
 
-inline vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1,1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+inline vec3 random_unit_vector(sampler& s) {
+    double u, v;
+    s.next_2d(u, v);
+    auto z = 1 - 2*u;
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    auto phi = 2*pi*v;
+    return vec3(r*cos(phi), r*sin(phi), z);
 }
 
-inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+inline vec3 random_in_unit_sphere(sampler& s) {
+    auto direction = random_unit_vector(s);
+    return cbrt(s.next_double()) * direction;
 }
 
-inline vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+inline vec3 random_in_hemisphere(const vec3& normal, sampler& s) {
+    vec3 in_unit_sphere = random_in_unit_sphere(s);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -30,10 +30,14 @@ class cylinder : public hittable  {
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
             point3 box_max(m_Radius, m_Top, m_Radius);
 			point3 box_min(-m_Radius, m_Bottom, -m_Radius);
+			box_max += m_cen;
+			box_min += m_cen;
             output_box = aabb(box_min, box_max);
             return true;
         }
 
+        virtual bool clipped_box(const aabb& clip, aabb& output_box) const override;
+
     public:
 		point3		m_cen;
 		double		m_Top;
@@ -43,6 +47,31 @@ class cylinder : public hittable  {
         shared_ptr<material> mat_ptr;
 };
 
+// A slab across the axis cuts the caps down to the part of the disk inside it, so the extent
+// along the other horizontal axis shrinks with the distance of the slab from the axis.
+inline bool cylinder::clipped_box(const aabb& clip, aabb& output_box) const {
+    aabb box;
+    bounding_box(0, 0, box);
+    if (!intersect_boxes(box, clip, output_box))
+        return false;
+
+    // Two rounds, the first narrows z through the x range and the second x through the new z range.
+    for (int round = 0; round < 2; round++) {
+        for (int a = 0; a < 3; a += 2) {
+            int other = 2 - a;
+            double lo = output_box.minimum[other] - m_cen[other];
+            double hi = output_box.maximum[other] - m_cen[other];
+            double nearest = lo > 0 ? lo : (hi < 0 ? -hi : 0.0);
+            double half = sqrt(fmax(0.0, m_Radius*m_Radius - nearest*nearest));
+            output_box.minimum[a] = fmax(output_box.minimum[a], m_cen[a] - half);
+            output_box.maximum[a] = fmin(output_box.maximum[a], m_cen[a] + half);
+            if (output_box.minimum[a] > output_box.maximum[a])
+                return false;
+        }
+    }
+    return true;
+}
+
 static const double kEpsilon = 0.0001f;		///< @em 0.0001
 inline bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
 
@@ -79,7 +108,7 @@ inline bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record&
 		rec.t = t;
 		rec.p = r.at(t);
 		rec.set_face_normal(r, n);
-		rec.mat_ptr = mat_ptr;
+		rec.mat_ptr = mat_ptr.get();
 		return true;
 	}
 
@@ -113,7 +142,7 @@ inline bool cylinder::hit(const ray& r, double t_min, double t_max, hit_record&
 			rec.p = r.at(rec.t);
 			vec3 outward_normal((ox + t * dx) * m_InvRadius, 0.0, (oz + t * dz) * m_InvRadius);
 			rec.set_face_normal(r, outward_normal);
-			rec.mat_ptr = mat_ptr;
+			rec.mat_ptr = mat_ptr.get();
 			return true;
 		}
 	}
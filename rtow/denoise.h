@@ -0,0 +1,166 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+
+#include <functional>
+#include <vector>
+
+
+// What the camera ray of a sample saw first. Summed over the samples of a pixel while tracing
+// and divided by the sample count before denoising. Rays that miss leave the normal and depth
+// at zero, which keeps the background apart from the geometry in the filter.
+struct pixel_features {
+    color albedo = color(0, 0, 0);
+    vec3 normal = vec3(0, 0, 0);
+    double depth = 0.0;
+
+    pixel_features& operator+=(const pixel_features& other) {
+        albedo += other.albedo;
+        normal += other.normal;
+        depth += other.depth;
+        return *this;
+    }
+
+    pixel_features operator/(double count) const {
+        pixel_features f;
+        f.albedo = albedo / count;
+        f.normal = normal / count;
+        f.depth = depth / count;
+        return f;
+    }
+};
+
+
+struct denoise_settings {
+    int iterations = 5;
+    double color_sigma = 0.6;   // Halved every iteration, fine detail survives the wide steps.
+    double normal_sigma = 0.3;
+    double depth_sigma = 0.05;  // Relative to the depth of the center pixel.
+};
+
+
+// Edge-avoiding a-trous wavelet filter, see Dammertz et al., "Edge-Avoiding A-Trous Wavelet
+// Transform for fast Global Illumination Filtering", HPG 2010. Every iteration applies the 5x5
+// B3 spline kernel with holes of 2^i pixels between the taps, weighted down across changes of
+// color, normal and depth. The color is divided by the first hit albedo before filtering and
+// multiplied back afterwards, so textures stay sharp while the lighting is smoothed.
+class atrous_denoiser {
+    public:
+        atrous_denoiser() {}
+        atrous_denoiser(const denoise_settings& settings) : settings(settings) {}
+
+        // colors and features hold width*height averaged pixels, out receives the filtered colors
+        // and may be the same buffer as colors. Rows are split into tasks for the runner.
+        void run(int width, int height, const color* colors, const pixel_features* features, color* out,
+            bvh_task_runner* runner = nullptr) const;
+
+    public:
+        denoise_settings settings;
+
+    private:
+        static color demodulation(const color& albedo) {
+            const double min_albedo = 0.01;
+            return color(fmax(albedo.x(), min_albedo), fmax(albedo.y(), min_albedo), fmax(albedo.z(), min_albedo));
+        }
+
+        void filter_rows(int width, int height, int y0, int y1, int step, double color_sigma,
+            const color* in, const pixel_features* features, color* out) const;
+};
+
+
+inline void atrous_denoiser::run(int width, int height, const color* colors, const pixel_features* features,
+    color* out, bvh_task_runner* runner) const
+{
+    size_t count = size_t(width) * height;
+    std::vector<color> a(count), b(count);
+    for (size_t p = 0; p < count; p++) {
+        auto albedo = demodulation(features[p].albedo);
+        a[p] = colors[p] * color(1.0 / albedo.x(), 1.0 / albedo.y(), 1.0 / albedo.z());
+    }
+
+    const int band = 16;
+    double color_sigma = settings.color_sigma;
+    for (int i = 0; i < settings.iterations; i++) {
+        int step = 1 << i;
+        std::vector<std::function<void()>> tasks;
+        for (int y = 0; y < height; y += band) {
+            int y1 = std::min(y + band, height);
+            tasks.push_back([this, width, height, y, y1, step, color_sigma, &a, &b, features]() {
+                filter_rows(width, height, y, y1, step, color_sigma, a.data(), features, b.data());
+            });
+        }
+
+        if (runner && runner->thread_count() > 1) {
+            runner->run(tasks);
+        }
+        else {
+            for (auto& task : tasks)
+                task();
+        }
+
+        std::swap(a, b);
+        color_sigma *= 0.5;
+    }
+
+    for (size_t p = 0; p < count; p++)
+        out[p] = a[p] * demodulation(features[p].albedo);
+}
+
+
+inline void atrous_denoiser::filter_rows(int width, int height, int y0, int y1, int step, double color_sigma,
+    const color* in, const pixel_features* features, color* out) const
+{
+    static const double kernel[5] = { 1.0/16.0, 1.0/4.0, 3.0/8.0, 1.0/4.0, 1.0/16.0 };
+
+    // Colors are compared after a square root, close to how they are displayed, so one sigma
+    // works for dark and bright regions alike.
+    auto display = [](const color& c) {
+        return color(sqrt(fmax(c.x(), 0.0)), sqrt(fmax(c.y(), 0.0)), sqrt(fmax(c.z(), 0.0)));
+    };
+
+    double inv_color = 1.0 / (color_sigma * color_sigma);
+    double inv_normal = 1.0 / (settings.normal_sigma * settings.normal_sigma);
+    double inv_depth = 1.0 / (settings.depth_sigma * settings.depth_sigma);
+
+    for (int y = y0; y < y1; y++) {
+        for (int x = 0; x < width; x++) {
+            int p = y * width + x;
+            color center = display(in[p]);
+            const pixel_features& fp = features[p];
+            double depth_scale = 1.0 / fmax(fp.depth, 1e-3);
+
+            color sum(0, 0, 0);
+            double weight_sum = 0.0;
+            for (int dy = -2; dy <= 2; dy++) {
+                int qy = y + dy * step;
+                if (qy < 0 || qy >= height)
+                    continue;
+                for (int dx = -2; dx <= 2; dx++) {
+                    int qx = x + dx * step;
+                    if (qx < 0 || qx >= width)
+                        continue;
+
+                    int q = qy * width + qx;
+                    const pixel_features& fq = features[q];
+                    double dc = (display(in[q]) - center).length_squared();
+                    double dn = (fq.normal - fp.normal).length_squared();
+                    double dz = (fq.depth - fp.depth) * depth_scale;
+
+                    double w = kernel[dx + 2] * kernel[dy + 2]
+                        * exp(-dc * inv_color - dn * inv_normal - dz * dz * inv_depth);
+                    sum += w * in[q];
+                    weight_sum += w;
+                }
+            }
+
+            // The center tap always has weight, so the sum is never zero.
+            out[p] = sum / weight_sum;
+        }
+    }
+}
+
+
+#endif
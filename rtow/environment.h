@@ -0,0 +1,188 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+
+#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// An HDR image in latitude-longitude layout lighting the scene from infinitely far away. The top
+// row looks up along +y, the u coordinate goes around the y axis the same way as the sphere
+// texture coordinates. Directions are importance sampled from a piecewise constant density
+// proportional to the pixel luminance, built once per image as a marginal CDF over the rows and
+// one conditional CDF per row, see Pharr et al., "Physically Based Rendering", section 13.6.5.
+// The image and its tables never change after loading, copies share them and only carry their
+// own intensity and rotation.
+class environment_light {
+    public:
+        environment_light() {}
+
+        // Reads an image through stb_image, Radiance .hdr files keep their full range. Returns
+        // false and describes the problem in error.
+        bool load(const std::string& path, std::string& error);
+
+        bool empty() const { return !image; }
+
+        // Radiance arriving along the opposite of direction.
+        color eval(const vec3& direction) const {
+            double u, v;
+            direction_to_uv(unit_vector(direction), u, v);
+            return intensity * image->texel(std::min(int(u * image->width), image->width - 1),
+                std::min(int(v * image->height), image->height - 1));
+        }
+
+        // Picks a unit direction, pdf receives its density in solid angle.
+        vec3 sample(sampler& s, double& pdf) const;
+
+        double pdf_value(const vec3& direction) const;
+
+    public:
+        double intensity = 1.0;
+        double rotation = 0.0;  // Around the y axis, in radians.
+
+    private:
+        struct image_data {
+            int width = 0;
+            int height = 0;
+            std::vector<float> pixels;          // RGB, width*height*3.
+            std::vector<float> marginal_cdf;    // height+1 entries.
+            std::vector<float> conditional_cdf; // height rows of width+1 entries.
+
+            color texel(int x, int y) const {
+                const float* p = &pixels[(size_t(y) * width + x) * 3];
+                return color(p[0], p[1], p[2]);
+            }
+
+            void build_distribution();
+        };
+
+        void direction_to_uv(const vec3& d, double& u, double& v) const {
+            double phi = atan2(-d.z(), d.x()) + pi + rotation;
+            u = phi / (2*pi);
+            u -= floor(u);
+            v = acos(clamp(d.y(), -1.0, 1.0)) / pi;
+        }
+
+        vec3 uv_to_direction(double u, double v) const {
+            double phi = 2*pi*u - rotation;
+            double theta = pi*v;
+            double sin_theta = sin(theta);
+            return vec3(-cos(phi)*sin_theta, cos(theta), sin(phi)*sin_theta);
+        }
+
+        // Index of the interval of cdf (count+1 entries starting at zero) holding x.
+        static int find_interval(const float* cdf, int count, double x) {
+            int i = int(std::upper_bound(cdf, cdf + count + 1, float(x)) - cdf) - 1;
+            return std::min(std::max(i, 0), count - 1);
+        }
+
+    private:
+        std::shared_ptr<const image_data> image;
+};
+
+
+inline bool environment_light::load(const std::string& path, std::string& error) {
+    int w, h, components;
+    float* data = stbi_loadf(path.c_str(), &w, &h, &components, 3);
+    if (!data) {
+        error = "cannot load environment image " + path;
+        return false;
+    }
+
+    auto loaded = std::make_shared<image_data>();
+    loaded->width = w;
+    loaded->height = h;
+    loaded->pixels.assign(data, data + size_t(w) * h * 3);
+    stbi_image_free(data);
+
+    loaded->build_distribution();
+    image = loaded;
+    return true;
+}
+
+
+inline void environment_light::image_data::build_distribution() {
+    marginal_cdf.assign(height + 1, 0.0f);
+    conditional_cdf.assign(size_t(height) * (width + 1), 0.0f);
+
+    // Rows near the poles cover less solid angle, sin(theta) takes that out of the density.
+    std::vector<double> sums(width + 1);
+    std::vector<double> row_sums(height + 1, 0.0);
+    for (int y = 0; y < height; y++) {
+        double sin_theta = sin(pi * (y + 0.5) / height);
+        sums[0] = 0.0;
+        for (int x = 0; x < width; x++) {
+            color c = texel(x, y);
+            double lum = 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+            sums[x + 1] = sums[x] + fmax(lum, 0.0) * sin_theta;
+        }
+
+        float* cdf = &conditional_cdf[size_t(y) * (width + 1)];
+        double row = sums[width];
+        for (int x = 0; x <= width; x++)
+            cdf[x] = float(row > 0 ? sums[x] / row : double(x) / width);
+        row_sums[y + 1] = row_sums[y] + row;
+    }
+
+    double total = row_sums[height];
+    for (int y = 0; y <= height; y++)
+        marginal_cdf[y] = float(total > 0 ? row_sums[y] / total : double(y) / height);
+}
+
+
+inline vec3 environment_light::sample(sampler& s, double& pdf) const {
+    double r1, r2;
+    s.next_2d(r1, r2);
+
+    const int width = image->width;
+    const int height = image->height;
+    const std::vector<float>& marginal_cdf = image->marginal_cdf;
+
+    int y = find_interval(marginal_cdf.data(), height, r2);
+    double dy = (r2 - marginal_cdf[y]) / fmax(double(marginal_cdf[y + 1]) - marginal_cdf[y], 1e-12);
+    const float* cdf = &image->conditional_cdf[size_t(y) * (width + 1)];
+    int x = find_interval(cdf, width, r1);
+    double dx = (r1 - cdf[x]) / fmax(double(cdf[x + 1]) - cdf[x], 1e-12);
+
+    double u = (x + clamp(dx, 0.0, 1.0)) / width;
+    double v = (y + clamp(dy, 0.0, 1.0)) / height;
+    vec3 direction = uv_to_direction(u, v);
+
+    // The density over the image is the pixel weight over the mean weight, dividing by the
+    // area element 2*pi^2*sin(theta) of the mapping turns it into solid angle.
+    double sin_theta = sin(pi * v);
+    if (sin_theta <= 0) {
+        pdf = 0;
+        return direction;
+    }
+    pdf = (marginal_cdf[y + 1] - marginal_cdf[y]) * height
+        * (cdf[x + 1] - cdf[x]) * width / (2*pi*pi*sin_theta);
+    return direction;
+}
+
+
+inline double environment_light::pdf_value(const vec3& direction) const {
+    const int width = image->width;
+    const int height = image->height;
+    const std::vector<float>& marginal_cdf = image->marginal_cdf;
+
+    double u, v;
+    direction_to_uv(unit_vector(direction), u, v);
+    double sin_theta = sin(pi * v);
+    if (sin_theta <= 0)
+        return 0;
+
+    int x = std::min(int(u * width), width - 1);
+    int y = std::min(int(v * height), height - 1);
+    const float* cdf = &image->conditional_cdf[size_t(y) * (width + 1)];
+    return (marginal_cdf[y + 1] - marginal_cdf[y]) * height
+        * (cdf[x + 1] - cdf[x]) * width / (2*pi*pi*sin_theta);
+}
+
+
+#endif
@@ -17,12 +17,13 @@
 
 
 class material;
+struct light_bounds;
 
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    const material* mat_ptr; // Owned by the scene objects, a raw pointer keeps refcounting off the hit path.
     double t;
     double u;
     double v;
@@ -35,10 +36,122 @@ struct hit_record {
 };
 
 
+// Overlap of two boxes in output_box, false when they do not touch.
+inline bool intersect_boxes(const aabb& a, const aabb& b, aabb& output_box) {
+    for (int i = 0; i < 3; i++) {
+        output_box.minimum[i] = fmax(a.minimum[i], b.minimum[i]);
+        output_box.maximum[i] = fmin(a.maximum[i], b.maximum[i]);
+        if (output_box.minimum[i] > output_box.maximum[i])
+            return false;
+    }
+    return true;
+}
+
+
+// Box of the part of a convex polygon inside clip, false when nothing is left. The polygon is
+// clipped against the six planes of the box in turn, see Sutherland and Hodgman, "Reentrant
+// Polygon Clipping", 1974. At most 8 input points.
+inline bool clipped_polygon_box(const point3* points, int count, const aabb& clip, aabb& output_box) {
+    point3 buffers[2][14];
+    int sizes[2] = { count, 0 };
+    for (int i = 0; i < count; i++)
+        buffers[0][i] = points[i];
+
+    int current = 0;
+    for (int plane = 0; plane < 6 && sizes[current] > 0; plane++) {
+        int axis = plane >> 1;
+        bool upper = plane & 1;
+        double bound = upper ? clip.maximum[axis] : clip.minimum[axis];
+        const point3* in = buffers[current];
+        point3* out = buffers[current ^ 1];
+        int in_size = sizes[current];
+        int out_size = 0;
+
+        for (int i = 0; i < in_size; i++) {
+            const point3& p = in[i];
+            const point3& q = in[(i + 1) % in_size];
+            double dp = upper ? bound - p[axis] : p[axis] - bound;
+            double dq = upper ? bound - q[axis] : q[axis] - bound;
+            if (dp >= 0)
+                out[out_size++] = p;
+            if ((dp >= 0) != (dq >= 0)) {
+                point3 x = p + (dp / (dp - dq)) * (q - p);
+                x[axis] = bound;
+                out[out_size++] = x;
+            }
+        }
+
+        sizes[current ^ 1] = out_size;
+        current ^= 1;
+    }
+
+    if (sizes[current] == 0)
+        return false;
+
+    output_box = aabb(point3(infinity, infinity, infinity), point3(-infinity, -infinity, -infinity));
+    for (int i = 0; i < sizes[current]; i++) {
+        for (int a = 0; a < 3; a++) {
+            output_box.minimum[a] = fmin(output_box.minimum[a], buffers[current][i][a]);
+            output_box.maximum[a] = fmax(output_box.maximum[a], buffers[current][i][a]);
+        }
+    }
+
+    // Intersections are rounded, keep the result inside clip.
+    return intersect_boxes(output_box, clip, output_box);
+}
+
+
+// Box around the eight corners of box, each mapped through transform.
+template <typename F>
+inline aabb transformed_box(const aabb& box, F&& transform) {
+    point3 min( infinity,  infinity,  infinity);
+    point3 max(-infinity, -infinity, -infinity);
+    for (int i = 0; i < 8; i++) {
+        point3 corner(
+            i & 1 ? box.maximum.x() : box.minimum.x(),
+            i & 2 ? box.maximum.y() : box.minimum.y(),
+            i & 4 ? box.maximum.z() : box.minimum.z());
+        point3 p = transform(corner);
+        for (int a = 0; a < 3; a++) {
+            min[a] = fmin(min[a], p[a]);
+            max[a] = fmax(max[a], p[a]);
+        }
+    }
+    return aabb(min, max);
+}
+
+
 class hittable {
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+        // Bounds of the part of the surface inside clip, for spatial splits in the BVH. Returns
+        // false when none of it is inside. The default cuts the bounding box down to clip,
+        // objects that know their shape override it with something tighter.
+        virtual bool clipped_box(const aabb& clip, aabb& output_box) const {
+            aabb box;
+            return bounding_box(0, 0, box) && intersect_boxes(box, clip, output_box);
+        }
+
+        // Light sampling. Emitters that can pick directions toward themselves return true from
+        // is_light, pdf_value is the density of random in solid angle seen from o.
+        virtual bool is_light() const {
+            return false;
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const {
+            return 0.0;
+        }
+
+        virtual vec3 random(const point3& o, sampler& s) const {
+            return vec3(1, 0, 0);
+        }
+
+        // Box, power and normal cone of a light, for the light hierarchy.
+        virtual bool emitter_bounds(light_bounds& bounds) const {
+            return false;
+        }
 };
 
 class translate : public hittable {
@@ -52,6 +165,8 @@ class translate : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool clipped_box(const aabb& clip, aabb& output_box) const override;
+
     public:
         shared_ptr<hittable> ptr;
         vec3 offset;
@@ -82,6 +197,18 @@ inline bool translate::bounding_box(double time0, double time1, aabb& output_box
 }
 
 
+inline bool translate::clipped_box(const aabb& clip, aabb& output_box) const {
+    if (!ptr->clipped_box(aabb(clip.min() - offset, clip.max() - offset), output_box))
+        return false;
+
+    output_box = aabb(
+        output_box.min() + offset,
+        output_box.max() + offset);
+
+    return true;
+}
+
+
 class rotate_y : public hittable {
     public:
         rotate_y(shared_ptr<hittable> p, double angle);
@@ -95,6 +222,8 @@ class rotate_y : public hittable {
             return hasbox;
         }
 
+        virtual bool clipped_box(const aabb& clip, aabb& output_box) const override;
+
     public:
         shared_ptr<hittable> ptr;
         double sin_theta;
@@ -167,6 +296,24 @@ inline bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record&
     return true;
 }
 
+
+// The clip box turns into a rotated box in object space, so the object is clipped against the
+// bounds of that instead. The part found is rotated back and cut down to the clip box again.
+inline bool rotate_y::clipped_box(const aabb& clip, aabb& output_box) const {
+    aabb object_clip = transformed_box(clip, [this](const point3& p) {
+        return point3(cos_theta*p[0] - sin_theta*p[2], p[1], sin_theta*p[0] + cos_theta*p[2]);
+    });
+
+    aabb part;
+    if (!ptr->clipped_box(object_clip, part))
+        return false;
+
+    aabb world_part = transformed_box(part, [this](const point3& p) {
+        return point3(cos_theta*p[0] + sin_theta*p[2], p[1], -sin_theta*p[0] + cos_theta*p[2]);
+    });
+    return intersect_boxes(world_part, clip, output_box);
+}
+
 class rotate_z : public hittable {
 public:
 	rotate_z(shared_ptr<hittable> p, double angle);
@@ -180,6 +327,8 @@ public:
 		return hasbox;
 	}
 
+	virtual bool clipped_box(const aabb& clip, aabb& output_box) const override;
+
 public:
 	shared_ptr<hittable> ptr;
 	double sin_theta;
@@ -252,6 +401,22 @@ inline bool rotate_z::hit(const ray& r, double t_min, double t_max, hit_record&
 	return true;
 }
 
+
+inline bool rotate_z::clipped_box(const aabb& clip, aabb& output_box) const {
+	aabb object_clip = transformed_box(clip, [this](const point3& p) {
+		return point3(cos_theta * p[0] - sin_theta * p[1], sin_theta * p[0] + cos_theta * p[1], p[2]);
+	});
+
+	aabb part;
+	if (!ptr->clipped_box(object_clip, part))
+		return false;
+
+	aabb world_part = transformed_box(part, [this](const point3& p) {
+		return point3(cos_theta * p[0] + sin_theta * p[1], -sin_theta * p[0] + cos_theta * p[1], p[2]);
+	});
+	return intersect_boxes(world_part, clip, output_box);
+}
+
 class rotate_x : public hittable {
 public:
 	rotate_x(shared_ptr<hittable> p, double angle);
@@ -265,6 +430,8 @@ public:
 		return hasbox;
 	}
 
+	virtual bool clipped_box(const aabb& clip, aabb& output_box) const override;
+
 public:
 	shared_ptr<hittable> ptr;
 	double sin_theta;
@@ -338,5 +505,21 @@ inline bool rotate_x::hit(const ray& r, double t_min, double t_max, hit_record&
 }
 
 
+inline bool rotate_x::clipped_box(const aabb& clip, aabb& output_box) const {
+	aabb object_clip = transformed_box(clip, [this](const point3& p) {
+		return point3(p[0], cos_theta * p[1] - sin_theta * p[2], sin_theta * p[1] + cos_theta * p[2]);
+	});
+
+	aabb part;
+	if (!ptr->clipped_box(object_clip, part))
+		return false;
+
+	aabb world_part = transformed_box(part, [this](const point3& p) {
+		return point3(p[0], cos_theta * p[1] + sin_theta * p[2], -sin_theta * p[1] + cos_theta * p[2]);
+	});
+	return intersect_boxes(world_part, clip, output_box);
+}
+
+
 
 #endif
@@ -39,15 +39,14 @@ class hittable_list : public hittable  {
 
 
 inline bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
     auto hit_anything = false;
     auto closest_so_far = t_max;
 
+    // Hittables only write to rec when they report a closer hit, so no temporary record is needed.
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
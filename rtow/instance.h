@@ -0,0 +1,191 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Affine 3x4 transform, rows of the linear part with the translation in the last column.
+// Stored in single precision to keep per instance memory small.
+struct affine_transform {
+    float m[3][4];
+
+    static affine_transform identity() {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 4; j++)
+                t.m[i][j] = (i == j) ? 1.0f : 0.0f;
+        return t;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(
+            m[0][0]*p.x() + m[0][1]*p.y() + m[0][2]*p.z() + m[0][3],
+            m[1][0]*p.x() + m[1][1]*p.y() + m[1][2]*p.z() + m[1][3],
+            m[2][0]*p.x() + m[2][1]*p.y() + m[2][2]*p.z() + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v.x() + m[0][1]*v.y() + m[0][2]*v.z(),
+            m[1][0]*v.x() + m[1][1]*v.y() + m[1][2]*v.z(),
+            m[2][0]*v.x() + m[2][1]*v.y() + m[2][2]*v.z());
+    }
+
+    // Multiplies by the transposed linear part. Applied to a world to object transform this
+    // takes an object space normal to world space.
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(
+            m[0][0]*v.x() + m[1][0]*v.y() + m[2][0]*v.z(),
+            m[0][1]*v.x() + m[1][1]*v.y() + m[2][1]*v.z(),
+            m[0][2]*v.x() + m[1][2]*v.y() + m[2][2]*v.z());
+    }
+
+    // Inverse computed in double precision. Returns false for a singular transform.
+    bool inverse(affine_transform& out) const {
+        double a[3][3];
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                a[i][j] = m[i][j];
+
+        double c00 = a[1][1]*a[2][2] - a[1][2]*a[2][1];
+        double c01 = a[1][2]*a[2][0] - a[1][0]*a[2][2];
+        double c02 = a[1][0]*a[2][1] - a[1][1]*a[2][0];
+        double det = a[0][0]*c00 + a[0][1]*c01 + a[0][2]*c02;
+        if (fabs(det) < 1e-20)
+            return false;
+
+        double inv_det = 1.0 / det;
+        double r[3][3] = {
+            { c00, a[0][2]*a[2][1] - a[0][1]*a[2][2], a[0][1]*a[1][2] - a[0][2]*a[1][1] },
+            { c01, a[0][0]*a[2][2] - a[0][2]*a[2][0], a[0][2]*a[1][0] - a[0][0]*a[1][2] },
+            { c02, a[0][1]*a[2][0] - a[0][0]*a[2][1], a[0][0]*a[1][1] - a[0][1]*a[1][0] },
+        };
+
+        for (int i = 0; i < 3; i++) {
+            double offset = 0.0;
+            for (int j = 0; j < 3; j++) {
+                r[i][j] *= inv_det;
+                offset -= r[i][j] * m[j][3];
+            }
+            for (int j = 0; j < 3; j++)
+                out.m[i][j] = static_cast<float>(r[i][j]);
+            out.m[i][3] = static_cast<float>(offset);
+        }
+        return true;
+    }
+};
+
+
+// A large number of placements of a few shared objects. Every instance only stores a world to
+// object transform plus indices into the shared geometry and material tables, so memory grows
+// with the unique geometry rather than with the instance count. Traced through its own tree
+// over the instance boxes, the geometry objects are the bottom level.
+class instance_set : public hittable {
+    public:
+        struct instance {
+            affine_transform world_to_object;
+            uint32_t geometry;
+            uint32_t material;
+        };
+
+        instance_set() {}
+        virtual ~instance_set() { }
+
+        bool empty() const { return instances.empty(); }
+
+        int add_geometry(shared_ptr<hittable> object) {
+            geometries.push_back(object);
+            return static_cast<int>(geometries.size()) - 1;
+        }
+
+        int add_material(shared_ptr<material> mat) {
+            materials.push_back(mat);
+            return static_cast<int>(materials.size()) - 1;
+        }
+
+        bool add_instance(const affine_transform& object_to_world, int geometry, int material);
+
+        // Builds the top level tree. The instance boxes are only kept until then.
+        void build(bvh_task_runner* runner = nullptr) {
+            tree.build(boxes, runner);
+            std::vector<aabb>().swap(boxes);
+            bounds = tree.empty() ? aabb() : tree.bounds();
+        }
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            if (tree.empty())
+                return false;
+            output_box = bounds;
+            return true;
+        }
+
+    public:
+        std::vector<shared_ptr<hittable>> geometries;
+        std::vector<shared_ptr<material>> materials;
+        std::vector<instance> instances;
+        bvh_tree tree;
+
+    private:
+        std::vector<aabb> boxes;
+        aabb bounds;
+};
+
+
+inline bool instance_set::add_instance(const affine_transform& object_to_world, int geometry, int material) {
+    aabb local;
+    if (!geometries[geometry]->bounding_box(0, 0, local))
+        return false;
+
+    instance inst;
+    if (!object_to_world.inverse(inst.world_to_object))
+        return false;
+    inst.geometry = static_cast<uint32_t>(geometry);
+    inst.material = static_cast<uint32_t>(material);
+
+    // World box from the eight transformed corners of the object box.
+    auto box = empty_box();
+    for (int i = 0; i < 8; i++) {
+        point3 corner(
+            (i & 1) ? local.maximum.x() : local.minimum.x(),
+            (i & 2) ? local.maximum.y() : local.minimum.y(),
+            (i & 4) ? local.maximum.z() : local.minimum.z());
+        grow_box(box, object_to_world.point(corner));
+    }
+
+    instances.push_back(inst);
+    boxes.push_back(box);
+    return true;
+}
+
+
+inline bool instance_set::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    auto closest_so_far = t_max;
+
+    return tree.hit(r, t_min, closest_so_far, [&](int index, double t0, double& t1) {
+        const instance& inst = instances[index];
+
+        // The direction is not normalised, so distances along the local ray match the world ray.
+        ray local_r(inst.world_to_object.point(r.origin()), inst.world_to_object.vector(r.direction()), r.time());
+        if (!geometries[inst.geometry]->hit(local_r, t0, t1, rec))
+            return false;
+
+        auto outward_normal = rec.front_face ? rec.normal : -rec.normal;
+        rec.p = r.at(rec.t);
+        rec.set_face_normal(r, unit_vector(inst.world_to_object.transposed_vector(outward_normal)));
+        rec.mat_ptr = materials[inst.material].get();
+
+        t1 = rec.t;
+        return true;
+    });
+}
+
+
+#endif
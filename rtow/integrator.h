@@ -0,0 +1,143 @@
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "denoise.h"
+#include "pdf.h"
+#include "lights.h"
+#include "environment.h"
+
+
+// Paths are never cut by roulette before this many bounces, most of the image converges within them.
+const int roulette_min_bounces = 3;
+
+
+inline color dome_color(const ray& r) {
+    vec3 unit_direction = unit_vector(r.direction());
+    auto t = 0.5*(unit_direction.y() + 1.0);
+    return (1.0-t)*color(1.0, 1.0, 1.0) + t*color(0.5, 0.7, 1.0);
+}
+
+
+// Follows one path as a loop, carrying the product of the attenuations in throughput. The dome mode
+// ignores emission and lights misses with the sky gradient, the other mode adds emission and uses the
+// background color. After a few bounces a path survives with a probability given by its throughput,
+// survivors are reweighted so the estimate stays unbiased. When features is given, the first surface
+// that is not a mirror is added to it, so reflections and refractions keep their own edges in the
+// denoiser instead of taking on those of the mirror.
+//
+// Outside the dome mode every diffuse vertex also sends a shadow ray toward a point picked on one
+// of the lights. Light samples and scattered rays that hit an emitter are weighted against each
+// other with the power heuristic, so small lights stop producing fireflies without large lights
+// getting noisier.
+//
+// An environment, when given, takes the place of the background and the dome. It is sampled like
+// one more light at every diffuse vertex, misses are weighted against those samples.
+inline color ray_color(
+    const ray& r, const color& background, bool dome_background, const hittable& world, const light_list& lights,
+    const environment_light* environment, int max_depth, sampler& s, pixel_features* features = nullptr
+) {
+    hit_record rec;
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray current = r;
+    double distance = 0.0;
+    double scatter_pdf = 0.0;   // Density of the last scattered direction, zero after a mirror.
+    vec3 scatter_normal;
+    if (environment && environment->empty())
+        environment = nullptr;
+    bool dome = dome_background && !environment;
+    bool sample_lights = !dome && (!lights.empty() || environment);
+
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        if (!world.hit(current, 0.001, infinity, rec)) {
+            color miss = dome ? dome_color(current) : background;
+            if (environment) {
+                miss = environment->eval(current.direction());
+                if (scatter_pdf > 0)
+                    miss = miss * power_heuristic(scatter_pdf, environment->pdf_value(current.direction()));
+            }
+            if (features)
+                features->albedo += throughput * miss;
+            radiance += throughput * miss;
+            break;
+        }
+
+        if (features) {
+            distance += rec.t * current.direction().length();
+            if (!rec.mat_ptr->specular()) {
+                features->albedo += throughput * rec.mat_ptr->albedo_at(rec);
+                features->normal += rec.normal;
+                features->depth += distance;
+                features = nullptr;
+            }
+        }
+
+        if (!dome) {
+            color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+            if (sample_lights && scatter_pdf > 0 && rec.mat_ptr->emissive())
+                emitted = emitted * power_heuristic(scatter_pdf, lights.pdf_value(current, scatter_normal, rec.t));
+            radiance += throughput * emitted;
+        }
+
+        s.start_bounce(bounce + 1);
+
+        color value;
+        double pdf;
+        if (sample_lights) {
+            vec3 direction;
+            double pick_pdf;
+            const hittable* light = lights.sample(rec.p, rec.normal, s, direction, pick_pdf);
+            if (light && rec.mat_ptr->eval(current, rec, direction, value, pdf) && pdf > 0) {
+                double light_pdf = pick_pdf * light->pdf_value(rec.p, direction);
+                hit_record light_rec, blocker;
+                ray shadow(rec.p, direction, current.time());
+                if (light_pdf > 0
+                    && light->hit(shadow, 0.001, infinity, light_rec)
+                    && !world.hit(shadow, 0.001, light_rec.t * (1 - 1e-4), blocker)) {
+                    color emitted = light_rec.mat_ptr->emitted(light_rec.u, light_rec.v, light_rec.p);
+                    radiance += throughput * value * emitted * (power_heuristic(light_pdf, pdf) / light_pdf);
+                }
+            }
+
+            if (environment) {
+                double env_pdf;
+                direction = environment->sample(s, env_pdf);
+                hit_record blocker;
+                if (env_pdf > 0
+                    && rec.mat_ptr->eval(current, rec, direction, value, pdf) && pdf > 0
+                    && !world.hit(ray(rec.p, direction, current.time()), 0.001, infinity, blocker)) {
+                    radiance += throughput * value * environment->eval(direction) * (power_heuristic(env_pdf, pdf) / env_pdf);
+                }
+            }
+        }
+
+        ray scattered;
+        color attenuation;
+        if (!rec.mat_ptr->scatter(current, rec, attenuation, scattered, s))
+            break;
+
+        if (!sample_lights || !rec.mat_ptr->eval(current, rec, scattered.direction(), value, scatter_pdf))
+            scatter_pdf = 0.0;
+        scatter_normal = rec.normal;
+
+        throughput = throughput * attenuation;
+
+        if (bounce + 1 >= roulette_min_bounces) {
+            double survive = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 0.95);
+            if (s.next_double() >= survive)
+                break;
+            throughput /= survive;
+        }
+
+        current = scattered;
+    }
+
+    return radiance;
+}
+
+
+#endif
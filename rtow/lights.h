@@ -0,0 +1,402 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// What the light hierarchy knows about an emitter or a group of them: where they are, how much
+// they emit in total and the cone their surface normals lie in. Light leaves the surfaces up to
+// theta_e away from a normal, so no light leaves the group further than theta_o + theta_e from
+// the axis. Two sided emitters light both sides of their normal cone.
+struct light_bounds {
+    aabb box;
+    double power = 0.0;
+    vec3 axis = vec3(0, 0, 1);
+    double cos_theta_o = -1.0;
+    double cos_theta_e = 0.0;
+    bool two_sided = false;
+};
+
+
+inline double luminance(const color& c) {
+    return 0.2126*c.x() + 0.7152*c.y() + 0.0722*c.z();
+}
+
+
+// The emitters of a scene as one density over directions. A light is picked by walking a tree
+// over the emitters from the root, taking each child with a probability given by how much its
+// lights could contribute at the shading point, see Conty Estevez and Kulla, "Importance Sampling
+// of Many Lights with Adaptive Tree Splitting", HPG 2018. A far or dim group is rarely visited, so
+// the noise no longer grows with the number of lights. The light then picks a direction toward
+// itself, as the hittable_pdf of "The Rest of Your Life" does. Only objects that can sample
+// themselves are taken, emitters hidden inside other shapes are still found by scattering alone.
+class light_list {
+    public:
+        light_list() {}
+
+        void clear() { lights.clear(); nodes.clear(); leaf_of.clear(); }
+        bool empty() const { return lights.empty(); }
+        int size() const { return static_cast<int>(lights.size()); }
+
+        // Takes the lights out of a list of scene objects and builds the tree over them. Has to be
+        // called again when the lights move.
+        void gather(const std::vector<shared_ptr<hittable>>& objects);
+
+        // Picks one light and a direction from o toward it, n is the surface normal at o. pick_pdf
+        // receives the probability the light was picked with, null is returned when no light can
+        // reach o.
+        const hittable* sample(const point3& o, const vec3& n, sampler& s, vec3& direction, double& pick_pdf) const;
+
+        // Density the list would have picked the direction of r with from a surface with normal n,
+        // given that r found an emitter at t. Lights further away than t are behind the one that
+        // was hit.
+        double pdf_value(const ray& r, const vec3& n, double t) const;
+
+    public:
+        std::vector<shared_ptr<hittable>> lights;
+
+    private:
+        struct node {
+            light_bounds bounds;
+            int second_child = -1;  // The first child follows its parent.
+            int light = -1;         // Leaves hold a single light.
+            int parent = -1;
+        };
+
+        // Below this depth nodes are split in half, so the tree is never deeper than this plus
+        // log2 of the light count.
+        static const int max_binned_depth = 32;
+        static const int stack_size = 2 * max_binned_depth + 64;
+
+        std::vector<node> nodes;
+        std::vector<int> leaf_of;   // Leaf node of every light.
+
+        int build(std::vector<int>& order, std::vector<light_bounds>& bounds, int begin, int end, int parent, int depth);
+        double pick_probability(int light, const point3& o, const vec3& n) const;
+
+        static light_bounds merge(const light_bounds& a, const light_bounds& b);
+        static double orientation_cost(const light_bounds& b);
+        static double importance(const light_bounds& b, const point3& p, const vec3& n);
+};
+
+
+inline void light_list::gather(const std::vector<shared_ptr<hittable>>& objects) {
+    clear();
+    std::vector<light_bounds> bounds;
+    for (const auto& object : objects) {
+        light_bounds b;
+        if (object->is_light() && object->emitter_bounds(b) && b.power > 0) {
+            lights.push_back(object);
+            bounds.push_back(b);
+        }
+    }
+
+    if (lights.empty())
+        return;
+
+    std::vector<int> order(lights.size());
+    for (int i = 0; i < size(); i++)
+        order[i] = i;
+
+    nodes.reserve(2 * lights.size());
+    leaf_of.assign(lights.size(), -1);
+    build(order, bounds, 0, size(), -1, 0);
+}
+
+
+// Splits where the summed power times box area times orientation measure of the two sides is
+// lowest, the surface area orientation heuristic of the paper, over a few bins per axis. Deep down
+// the tree only halves, which keeps the depth within the traversal stack.
+inline int light_list::build(
+    std::vector<int>& order, std::vector<light_bounds>& bounds, int begin, int end, int parent, int depth
+) {
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+    nodes[index].parent = parent;
+
+    light_bounds total = bounds[order[begin]];
+    aabb centroid_bounds = empty_box();
+    for (int i = begin; i < end; i++) {
+        const light_bounds& b = bounds[order[i]];
+        if (i > begin)
+            total = merge(total, b);
+        grow_box(centroid_bounds, 0.5 * (b.box.min() + b.box.max()));
+    }
+    nodes[index].bounds = total;
+
+    if (end - begin == 1) {
+        nodes[index].light = order[begin];
+        leaf_of[order[begin]] = index;
+        return index;
+    }
+
+    const int bin_count = 12;
+    int best_axis = -1;
+    int best_bin = 0;
+    double best_cost = infinity;
+
+    for (int axis = 0; axis < 3 && depth < max_binned_depth; axis++) {
+        double lo = centroid_bounds.min()[axis];
+        double extent = centroid_bounds.max()[axis] - lo;
+        if (extent <= 0)
+            continue;
+
+        light_bounds bins[bin_count];
+        bool used[bin_count] = {};
+        for (int i = begin; i < end; i++) {
+            const light_bounds& b = bounds[order[i]];
+            double c = 0.5 * (b.box.min()[axis] + b.box.max()[axis]);
+            int bin = std::min(static_cast<int>(bin_count * (c - lo) / extent), bin_count - 1);
+            bins[bin] = used[bin] ? merge(bins[bin], b) : b;
+            used[bin] = true;
+        }
+
+        // Cost of the bins above every split, swept from the top.
+        double above_cost[bin_count] = {};
+        bool has_above[bin_count] = {};
+        light_bounds above;
+        for (int b = bin_count - 1; b > 0; b--) {
+            has_above[b] = used[b] || (b + 1 < bin_count && has_above[b + 1]);
+            if (used[b])
+                above = b + 1 < bin_count && has_above[b + 1] ? merge(above, bins[b]) : bins[b];
+            if (has_above[b])
+                above_cost[b] = above.power * above.box.area() * orientation_cost(above);
+        }
+
+        light_bounds below;
+        bool has_below = false;
+        for (int split = 1; split < bin_count; split++) {
+            if (used[split - 1]) {
+                below = has_below ? merge(below, bins[split - 1]) : bins[split - 1];
+                has_below = true;
+            }
+            if (!has_below || !has_above[split])
+                continue;
+
+            double cost = below.power * below.box.area() * orientation_cost(below) + above_cost[split];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = split;
+            }
+        }
+    }
+
+    int mid;
+    if (best_axis >= 0) {
+        double lo = centroid_bounds.min()[best_axis];
+        double extent = centroid_bounds.max()[best_axis] - lo;
+        auto first_above = std::partition(order.begin() + begin, order.begin() + end, [&](int light) {
+            const light_bounds& b = bounds[light];
+            double c = 0.5 * (b.box.min()[best_axis] + b.box.max()[best_axis]);
+            return std::min(static_cast<int>(bin_count * (c - lo) / extent), bin_count - 1) < best_bin;
+        });
+        mid = static_cast<int>(first_above - order.begin());
+    }
+    else {
+        // Halve along the widest spread of the centroids. With all of them in one place any split
+        // is as good as another.
+        int axis = centroid_bounds.longest_axis();
+        mid = (begin + end) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+            return bounds[a].box.min()[axis] + bounds[a].box.max()[axis] < bounds[b].box.min()[axis] + bounds[b].box.max()[axis];
+        });
+    }
+
+    build(order, bounds, begin, mid, index, depth + 1);
+    int second = build(order, bounds, mid, end, index, depth + 1);
+    nodes[index].second_child = second;
+    return index;
+}
+
+
+inline const hittable* light_list::sample(
+    const point3& o, const vec3& n, sampler& s, vec3& direction, double& pick_pdf
+) const {
+    if (nodes.empty())
+        return nullptr;
+
+    // One value picks the whole path down the tree, it is rescaled to [0,1) after every choice.
+    double u = s.next_double();
+    pick_pdf = 1.0;
+    int index = 0;
+    while (nodes[index].light < 0) {
+        double first = importance(nodes[index + 1].bounds, o, n);
+        double second = importance(nodes[nodes[index].second_child].bounds, o, n);
+        if (first + second <= 0)
+            return nullptr;
+
+        double p = first / (first + second);
+        if (u < p) {
+            u = std::min(u / p, 1.0 - 1e-12);
+            pick_pdf *= p;
+            index = index + 1;
+        }
+        else {
+            u = std::min((u - p) / (1 - p), 1.0 - 1e-12);
+            pick_pdf *= 1 - p;
+            index = nodes[index].second_child;
+        }
+    }
+
+    const hittable* light = lights[nodes[index].light].get();
+    direction = light->random(o, s);
+    return light;
+}
+
+
+// Probability of the choices on the way from the root to the leaf of the light.
+inline double light_list::pick_probability(int light, const point3& o, const vec3& n) const {
+    double probability = 1.0;
+    int index = leaf_of[light];
+    while (nodes[index].parent >= 0) {
+        int parent = nodes[index].parent;
+        double first = importance(nodes[parent + 1].bounds, o, n);
+        double second = importance(nodes[nodes[parent].second_child].bounds, o, n);
+        if (first + second <= 0)
+            return 0.0;
+        probability *= (index == parent + 1 ? first : second) / (first + second);
+        index = parent;
+    }
+    return probability;
+}
+
+
+// Only the lights whose boxes the ray passes through before t are looked at.
+inline double light_list::pdf_value(const ray& r, const vec3& normal, double t) const {
+    if (nodes.empty())
+        return 0.0;
+
+    double pdf = 0.0;
+    double t_max = t * (1 + 1e-6);
+    int stack[stack_size];
+    int top = 0;
+    stack[top++] = 0;
+    hit_record rec;
+
+    while (top > 0) {
+        int index = stack[--top];
+        const node& n = nodes[index];
+        if (!n.bounds.box.hit(r, 0.001, t_max))
+            continue;
+
+        if (n.light >= 0) {
+            const hittable& light = *lights[n.light];
+            if (light.hit(r, 0.001, t_max, rec))
+                pdf += pick_probability(n.light, r.origin(), normal) * light.pdf_value(r.origin(), r.direction());
+        }
+        else {
+            stack[top++] = n.second_child;
+            stack[top++] = index + 1;
+        }
+    }
+    return pdf;
+}
+
+
+inline light_bounds light_list::merge(const light_bounds& a, const light_bounds& b) {
+    light_bounds m;
+    m.box = a.box;
+    grow_box(m.box, b.box);
+    m.power = a.power + b.power;
+    m.cos_theta_e = fmin(a.cos_theta_e, b.cos_theta_e);
+    m.two_sided = a.two_sided || b.two_sided;
+
+    // Smallest cone around both normal cones.
+    double theta_a = acos(clamp(a.cos_theta_o, -1, 1));
+    double theta_b = acos(clamp(b.cos_theta_o, -1, 1));
+    vec3 axis_a = a.axis, axis_b = b.axis;
+    if (theta_b > theta_a) {
+        std::swap(theta_a, theta_b);
+        std::swap(axis_a, axis_b);
+    }
+
+    double theta_d = acos(clamp(dot(axis_a, axis_b), -1, 1));
+    m.axis = axis_a;
+    if (fmin(theta_d + theta_b, pi) <= theta_a) {
+        m.cos_theta_o = cos(theta_a);
+        return m;
+    }
+
+    double theta_o = 0.5 * (theta_a + theta_d + theta_b);
+    vec3 normal = cross(axis_a, axis_b);
+    if (theta_o >= pi || normal.length_squared() < 1e-12) {
+        m.cos_theta_o = -1.0;
+        return m;
+    }
+
+    // Rotate the wider axis toward the other one.
+    double theta_r = theta_o - theta_a;
+    vec3 k = unit_vector(normal);
+    m.axis = unit_vector(axis_a * cos(theta_r) + cross(k, axis_a) * sin(theta_r));
+    m.cos_theta_o = cos(theta_o);
+    return m;
+}
+
+
+// Measure of the directions a group of lights can emit into, the M_Omega of the paper.
+inline double light_list::orientation_cost(const light_bounds& b) {
+    double theta_o = acos(clamp(b.cos_theta_o, -1, 1));
+    double theta_e = acos(clamp(b.cos_theta_e, -1, 1));
+    double theta_w = fmin(theta_o + theta_e, pi);
+    double sin_theta_o = sin(theta_o);
+    return 2*pi*(1 - b.cos_theta_o)
+        + pi/2 * (2*theta_w*sin_theta_o - cos(theta_o - 2*theta_w) - 2*theta_o*sin_theta_o + b.cos_theta_o);
+}
+
+
+// Upper estimate of what the lights of a node contribute at p: power over squared distance,
+// weighted by the cosine of the smallest angle any of them can emit toward p under and by the
+// cosine of the smallest angle to the normal at p any of them can arrive under. The second
+// cosine is taken on both sides of the surface.
+inline double light_list::importance(const light_bounds& b, const point3& p, const vec3& n) {
+    point3 center = 0.5 * (b.box.min() + b.box.max());
+    vec3 to_p = p - center;
+    double d2 = to_p.length_squared();
+    double radius2 = 0.25 * (b.box.max() - b.box.min()).length_squared();
+
+    // Close to or inside the box the distance says little, the box size takes over.
+    d2 = fmax(d2, radius2);
+
+    // cos(max(0, theta_a - theta_b)) from the sines and cosines of the two angles.
+    auto cos_sub_clamped = [](double sin_a, double cos_a, double sin_b, double cos_b) {
+        if (cos_a > cos_b)
+            return 1.0;
+        return cos_a * cos_b + sin_a * sin_b;
+    };
+
+    double cos_w = dot(b.axis, to_p) / sqrt(fmax(to_p.length_squared(), 1e-24));
+    if (b.two_sided)
+        cos_w = fabs(cos_w);
+    double sin_w = sqrt(fmax(0.0, 1 - cos_w*cos_w));
+
+    // Half the angle the box covers seen from p.
+    double cos_b = -1.0;
+    if (to_p.length_squared() > radius2)
+        cos_b = sqrt(fmax(0.0, 1 - radius2 / to_p.length_squared()));
+    double sin_b = sqrt(fmax(0.0, 1 - cos_b*cos_b));
+
+    double cos_o = b.cos_theta_o;
+    double sin_o = sqrt(fmax(0.0, 1 - cos_o*cos_o));
+
+    double cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, cos_o);
+    double sin_x = sqrt(fmax(0.0, 1 - cos_x*cos_x));
+    double cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= b.cos_theta_e)
+        return 0.0;
+
+    double contribution = b.power * cos_p / d2;
+
+    double cos_i = fabs(dot(n, to_p)) / sqrt(fmax(to_p.length_squared(), 1e-24));
+    double sin_i = sqrt(fmax(0.0, 1 - cos_i*cos_i));
+    return contribution * cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+}
+
+
+#endif
@@ -24,8 +24,32 @@ class material {
         }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const = 0;
+
+        // Surface color without lighting, a guide for the denoiser.
+        virtual color albedo_at(const hit_record& rec) const {
+            return color(1,1,1);
+        }
+
+        // Mirrors and glass, the denoiser looks through them for its guides.
+        virtual bool specular() const {
+            return false;
+        }
+
+        // Objects made of an emissive material are gathered as lights.
+        virtual bool emissive() const {
+            return false;
+        }
+
+        // Scattering toward a chosen direction, for combining light samples with scattered rays.
+        // value is the BSDF times the cosine, pdf the density scatter() picks the direction with.
+        // Materials that return false only find lights by scattering.
+        virtual bool eval(
+            const ray& r_in, const hit_record& rec, const vec3& direction, color& value, double& pdf
+        ) const {
+            return false;
+        }
 };
 
 
@@ -36,9 +60,9 @@ class lambertian : public material {
         virtual ~lambertian() { }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
-            auto scatter_direction = rec.normal + random_unit_vector();
+            auto scatter_direction = rec.normal + random_unit_vector(s);
 
             // Catch degenerate scatter direction
             if (scatter_direction.near_zero())
@@ -49,6 +73,21 @@ class lambertian : public material {
             return true;
         }
 
+        virtual color albedo_at(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        // The scatter direction is the normal plus a point on the unit sphere, which is
+        // distributed with density cos/pi.
+        virtual bool eval(
+            const ray& r_in, const hit_record& rec, const vec3& direction, color& value, double& pdf
+        ) const override {
+            auto cosine = dot(unit_vector(direction), rec.normal);
+            pdf = cosine > 0 ? cosine / pi : 0.0;
+            value = albedo->value(rec.u, rec.v, rec.p) * pdf;
+            return true;
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
@@ -60,14 +99,22 @@ class metal : public material {
 		virtual ~metal() { }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
             vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(), r_in.time());
+            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere(s), r_in.time());
             attenuation = albedo;
             return (dot(scattered.direction(), rec.normal) > 0);
         }
 
+        virtual color albedo_at(const hit_record& rec) const override {
+            return albedo;
+        }
+
+        virtual bool specular() const override {
+            return fuzz < 0.1;
+        }
+
     public:
         color albedo;
         double fuzz;
@@ -80,7 +127,7 @@ class dielectric : public material {
         virtual ~dielectric() { }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
             attenuation = color(1.0, 1.0, 1.0);
             double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
@@ -92,7 +139,7 @@ class dielectric : public material {
             bool cannot_refract = refraction_ratio * sin_theta > 1.0;
             vec3 direction;
 
-            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+            if (cannot_refract || reflectance(cos_theta, refraction_ratio) > s.next_double())
                 direction = reflect(unit_direction, rec.normal);
             else
                 direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -101,6 +148,10 @@ class dielectric : public material {
             return true;
         }
 
+        virtual bool specular() const override {
+            return true;
+        }
+
     public:
         double ir; // Index of Refraction
 
@@ -121,7 +172,7 @@ class diffuse_light : public material {
         virtual ~diffuse_light() { }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
             return false;
         }
@@ -130,6 +181,10 @@ class diffuse_light : public material {
             return emit->value(u, v, p);
         }
 
+        virtual bool emissive() const override {
+            return true;
+        }
+
     public:
         shared_ptr<texture> emit;
 };
@@ -142,13 +197,25 @@ class isotropic : public material {
 		virtual ~isotropic() { }
 
         virtual bool scatter(
-            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+            const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s
         ) const override {
-            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+            scattered = ray(rec.p, random_in_unit_sphere(s), r_in.time());
             attenuation = albedo->value(rec.u, rec.v, rec.p);
             return true;
         }
 
+        virtual color albedo_at(const hit_record& rec) const override {
+            return albedo->value(rec.u, rec.v, rec.p);
+        }
+
+        virtual bool eval(
+            const ray& r_in, const hit_record& rec, const vec3& direction, color& value, double& pdf
+        ) const override {
+            pdf = 1 / (4*pi);
+            value = albedo->value(rec.u, rec.v, rec.p) * pdf;
+            return true;
+        }
+
     public:
         shared_ptr<texture> albedo;
 };
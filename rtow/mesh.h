@@ -0,0 +1,198 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "bvh.h"
+
+#include <cstdint>
+#include <vector>
+
+
+// Triangle mesh with its own tree over the triangles. Points are kept as separate float arrays
+// and triangles as a flat index buffer, so a mesh costs a few bytes per triangle instead of a
+// hittable per triangle.
+class triangle_mesh : public hittable {
+    public:
+        triangle_mesh() {}
+        triangle_mesh(shared_ptr<material> m) : mat_ptr(m) {}
+        virtual ~triangle_mesh() { }
+
+        void reserve(size_t point_count, size_t triangle_count) {
+            px.reserve(point_count);
+            py.reserve(point_count);
+            pz.reserve(point_count);
+            indices.reserve(triangle_count * 3);
+        }
+
+        void add_point(const point3& p) {
+            px.push_back(static_cast<float>(p.x()));
+            py.push_back(static_cast<float>(p.y()));
+            pz.push_back(static_cast<float>(p.z()));
+        }
+
+        // Counter clockwise seen from the front.
+        void add_triangle(int a, int b, int c) {
+            indices.push_back(static_cast<uint32_t>(a));
+            indices.push_back(static_cast<uint32_t>(b));
+            indices.push_back(static_cast<uint32_t>(c));
+        }
+
+        int point_count() const { return static_cast<int>(px.size()); }
+        int triangle_count() const { return static_cast<int>(indices.size() / 3); }
+        bool empty() const { return indices.empty(); }
+
+        point3 point(uint32_t index) const {
+            return point3(px[index], py[index], pz[index]);
+        }
+
+        void build(bvh_task_runner* runner = nullptr);
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            if (tree.empty())
+                return false;
+            output_box = tree.bounds();
+            return true;
+        }
+
+    public:
+        std::vector<float> px, py, pz;
+        std::vector<uint32_t> indices;
+        bvh_tree tree;
+        shared_ptr<material> mat_ptr;
+
+    private:
+        // Ray transformed so its direction is the +z axis of a sheared frame, set up once per ray.
+        // See Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection", JCGT 2013.
+        struct watertight_ray {
+            point3 origin;
+            int kx, ky, kz;
+            double sx, sy, sz;
+
+            watertight_ray(const ray& r);
+        };
+
+        bool hit_triangle(const watertight_ray& wr, int triangle, double t_min, double t_max,
+            double& t, double& b1, double& b2) const;
+};
+
+
+inline triangle_mesh::watertight_ray::watertight_ray(const ray& r) : origin(r.origin()) {
+    auto d = r.direction();
+
+    kz = 0;
+    if (fabs(d.y()) > fabs(d[kz])) kz = 1;
+    if (fabs(d.z()) > fabs(d[kz])) kz = 2;
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+
+    // Keep the winding of the sheared triangle independent of the direction sign.
+    if (d[kz] < 0.0)
+        std::swap(kx, ky);
+
+    sx = d[kx] / d[kz];
+    sy = d[ky] / d[kz];
+    sz = 1.0 / d[kz];
+}
+
+
+inline void triangle_mesh::build(bvh_task_runner* runner) {
+    std::vector<aabb> boxes(triangle_count());
+    for (int i = 0; i < triangle_count(); i++) {
+        auto box = empty_box();
+        grow_box(box, point(indices[3*i]));
+        grow_box(box, point(indices[3*i + 1]));
+        grow_box(box, point(indices[3*i + 2]));
+        boxes[i] = box;
+    }
+
+    tree.build(boxes, runner, [this](int triangle, const aabb& clip, aabb& output_box) {
+        point3 corners[3] = {
+            point(indices[3*triangle]), point(indices[3*triangle + 1]), point(indices[3*triangle + 2])
+        };
+        return clipped_polygon_box(corners, 3, clip, output_box);
+    });
+}
+
+
+inline bool triangle_mesh::hit_triangle(const watertight_ray& wr, int triangle, double t_min, double t_max,
+    double& t, double& b1, double& b2) const
+{
+    auto a = point(indices[3*triangle]) - wr.origin;
+    auto b = point(indices[3*triangle + 1]) - wr.origin;
+    auto c = point(indices[3*triangle + 2]) - wr.origin;
+
+    auto ax = a[wr.kx] - wr.sx * a[wr.kz];
+    auto ay = a[wr.ky] - wr.sy * a[wr.kz];
+    auto bx = b[wr.kx] - wr.sx * b[wr.kz];
+    auto by = b[wr.ky] - wr.sy * b[wr.kz];
+    auto cx = c[wr.kx] - wr.sx * c[wr.kz];
+    auto cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    // Scaled barycentrics. An edge through the ray gives exactly zero for both triangles sharing
+    // it, so rays cannot slip through the gap between neighbours.
+    auto u = cx * by - cy * bx;
+    auto v = ax * cy - ay * cx;
+    auto w = bx * ay - by * ax;
+
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+        return false;
+
+    auto det = u + v + w;
+    if (det == 0.0)
+        return false;
+
+    auto az = wr.sz * a[wr.kz];
+    auto bz = wr.sz * b[wr.kz];
+    auto cz = wr.sz * c[wr.kz];
+    auto scaled_t = u * az + v * bz + w * cz;
+
+    auto inv_det = 1.0 / det;
+    t = scaled_t * inv_det;
+    if (t < t_min || t > t_max)
+        return false;
+
+    b1 = v * inv_det;
+    b2 = w * inv_det;
+    return true;
+}
+
+
+inline bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    watertight_ray wr(r);
+
+    int closest = -1;
+    double closest_b1 = 0.0;
+    double closest_b2 = 0.0;
+
+    if (!tree.hit(r, t_min, t_max, [&](int triangle, double t0, double& t1) {
+            double t, b1, b2;
+            if (!hit_triangle(wr, triangle, t0, t1, t, b1, b2))
+                return false;
+            closest = triangle;
+            closest_b1 = b1;
+            closest_b2 = b2;
+            t1 = t;
+            return true;
+        }))
+        return false;
+
+    auto p0 = point(indices[3*closest]);
+    auto p1 = point(indices[3*closest + 1]);
+    auto p2 = point(indices[3*closest + 2]);
+
+    rec.t = t_max;
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+    rec.u = closest_b1;
+    rec.v = closest_b2;
+    rec.mat_ptr = mat_ptr.get();
+
+    return true;
+}
+
+
+#endif
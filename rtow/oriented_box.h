@@ -0,0 +1,178 @@
+#ifndef ORIENTED_BOX_H
+#define ORIENTED_BOX_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "instance.h"
+
+#include <utility>
+
+
+// A box under an arbitrary affine transform, rotation and non-uniform scale included. The ray is
+// taken into the space of the unit cube [-1, 1]^3 once and tested against its three slabs, instead
+// of going through a box of six rectangles wrapped in a translate and one rotate per axis. The
+// transform can be replaced in place, so a moving box only needs its tree refitted.
+class oriented_box : public hittable {
+    public:
+        oriented_box(shared_ptr<material> m) : mat_ptr(m) {}
+
+        oriented_box(const affine_transform& object_to_world, const vec3& half_size, shared_ptr<material> m)
+            : mat_ptr(m) {
+            set_transform(object_to_world, half_size);
+        }
+
+        virtual ~oriented_box() { }
+
+        // Places a box with the given half size around the origin of object_to_world. Returns false
+        // and keeps the previous placement when the transform is singular.
+        bool set_transform(const affine_transform& object_to_world, const vec3& half_size);
+
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+        virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+            output_box = bbox;
+            return hasbox;
+        }
+
+        virtual bool clipped_box(const aabb& clip, aabb& output_box) const override;
+
+    public:
+        shared_ptr<material> mat_ptr;
+
+    private:
+        static point3 unit_corner(int i) {
+            return point3((i & 1) ? 1 : -1, (i & 2) ? 1 : -1, (i & 4) ? 1 : -1);
+        }
+
+    private:
+        affine_transform to_world = affine_transform::identity();  // From the unit cube.
+        affine_transform to_local = affine_transform::identity();
+        point3 world_corners[8];
+        bool hasbox = false;
+        aabb bbox;
+};
+
+
+inline bool oriented_box::set_transform(const affine_transform& object_to_world, const vec3& half_size) {
+    // Scaling the columns by the half size maps the unit cube onto the box. Like the rectangles,
+    // a flat box is padded a small amount so it still has a slab to test against.
+    affine_transform unit_to_world = object_to_world;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            unit_to_world.m[i][j] = static_cast<float>(object_to_world.m[i][j] * fmax(fabs(half_size[j]), 0.0001));
+
+    affine_transform world_to_unit;
+    if (!unit_to_world.inverse(world_to_unit))
+        return false;
+
+    to_world = unit_to_world;
+    to_local = world_to_unit;
+
+    auto box = empty_box();
+    for (int i = 0; i < 8; i++) {
+        world_corners[i] = to_world.point(unit_corner(i));
+        grow_box(box, world_corners[i]);
+    }
+    bbox = box;
+    hasbox = true;
+    return true;
+}
+
+
+inline bool oriented_box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (!hasbox)
+        return false;
+
+    // The direction is not normalised, so distances along the local ray match the world ray.
+    point3 origin = to_local.point(r.origin());
+    vec3 direction = to_local.vector(r.direction());
+
+    double t_near = -infinity;
+    double t_far = infinity;
+    int near_axis = 0;
+    int far_axis = 0;
+    for (int a = 0; a < 3; a++) {
+        double inv_d = 1.0 / direction[a];
+        double t0 = (-1.0 - origin[a]) * inv_d;
+        double t1 = (1.0 - origin[a]) * inv_d;
+        if (inv_d < 0)
+            std::swap(t0, t1);
+        if (t0 > t_near) {
+            t_near = t0;
+            near_axis = a;
+        }
+        if (t1 < t_far) {
+            t_far = t1;
+            far_axis = a;
+        }
+    }
+    if (t_near > t_far)
+        return false;
+
+    // Rays starting inside, refracted ones for example, leave through the far face.
+    double t;
+    int axis;
+    double side;
+    if (t_near >= t_min && t_near <= t_max) {
+        t = t_near;
+        axis = near_axis;
+        side = direction[axis] < 0 ? 1.0 : -1.0;
+    }
+    else if (t_far >= t_min && t_far <= t_max) {
+        t = t_far;
+        axis = far_axis;
+        side = direction[axis] < 0 ? -1.0 : 1.0;
+    }
+    else {
+        return false;
+    }
+
+    // Same face coordinates as the rectangles of a box.
+    point3 p = origin + t * direction;
+    int u_axis = axis == 0 ? 1 : 0;
+    int v_axis = axis == 2 ? 1 : 2;
+    rec.u = 0.5 * (p[u_axis] + 1.0);
+    rec.v = 0.5 * (p[v_axis] + 1.0);
+
+    vec3 local_normal(0, 0, 0);
+    local_normal[axis] = side;
+
+    rec.t = t;
+    rec.p = r.at(t);
+    rec.set_face_normal(r, unit_vector(to_local.transposed_vector(local_normal)));
+    rec.mat_ptr = mat_ptr.get();
+    return true;
+}
+
+
+inline bool oriented_box::clipped_box(const aabb& clip, aabb& output_box) const {
+    if (!hasbox)
+        return false;
+
+    // Each face is clipped on its own, the union of the pieces is exact for the surface.
+    static const int faces[6][4] = {
+        { 0, 2, 6, 4 }, { 1, 3, 7, 5 },
+        { 0, 1, 5, 4 }, { 2, 3, 7, 6 },
+        { 0, 1, 3, 2 }, { 4, 5, 7, 6 },
+    };
+
+    auto box = empty_box();
+    bool inside = false;
+    for (const auto& face : faces) {
+        point3 points[4];
+        for (int i = 0; i < 4; i++)
+            points[i] = world_corners[face[i]];
+
+        aabb part;
+        if (clipped_polygon_box(points, 4, clip, part)) {
+            grow_box(box, part);
+            inside = true;
+        }
+    }
+
+    return inside && intersect_boxes(box, clip, output_box);
+}
+
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PDF_H
+#define PDF_H
+//==============================================================================================
+// Originally written in 2016 by Peter Shirley <ptrshrl@gmail.com>
+//
+// To the extent possible under law, the author(s) have dedicated all copyright and related and
+// neighboring rights to this software to the public domain worldwide. This software is
+// distributed without any warranty.
+//
+// You should have received a copy (see file COPYING.txt) of the CC0 Public Domain Dedication
+// along with this software. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+//==============================================================================================
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "onb.h"
+
+
+// Direction inside the cone a sphere of the given radius covers from distance_squared away,
+// uniform in solid angle around +z.
+inline vec3 random_to_sphere(double radius, double distance_squared, sampler& s) {
+    double r1, r2;
+    s.next_2d(r1, r2);
+    auto z = 1 + r2*(sqrt(1-radius*radius/distance_squared) - 1);
+
+    auto phi = 2*pi*r1;
+    auto x = cos(phi)*sqrt(1-z*z);
+    auto y = sin(phi)*sqrt(1-z*z);
+
+    return vec3(x, y, z);
+}
+
+
+// Weight of a sample drawn with density pdf_a that could also have come from a strategy with
+// density pdf_b, see Veach, "Robust Monte Carlo Methods for Light Transport Simulation", 1997.
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    auto a = pdf_a*pdf_a;
+    auto b = pdf_b*pdf_b;
+    return a + b > 0 ? a / (a + b) : 0.0;
+}
+
+
+#endif
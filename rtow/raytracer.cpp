@@ -25,8 +25,12 @@ SOFTWARE.
 #include "color.h"
 #include "material.h"
 #include "sphere.h"
-#include "box.h"
 #include "cylinder.h"
+#include "oriented_box.h"
+#include "instance.h"
+#include "mesh.h"
+#include "integrator.h"
+#include "scenes.h"
 
 #include "tiledimage.h"
 #include "funraymaterial.h"
@@ -34,6 +38,12 @@ SOFTWARE.
 #include "funraycamera.h"
 #include "opython.h"
 
+#include <atomic>
+#include <functional>
+#include <map>
+#include <thread>
+#include <tuple>
+
 Bool SetupRenderer(maxon::JobGroupRef jobGroup, RENDERMODE renderMode, Raytracer *pRayTracer, TiledImage *pImage, GeUserArea *pArea)
 {
 	iferr_scope_handler
@@ -49,12 +59,8 @@ Bool SetupRenderer(maxon::JobGroupRef jobGroup, RENDERMODE renderMode, Raytracer
 	case RENDERMODE::MULTITHREADED:
 	{
 		pRayTracer->Init(pArea, pImage, false);
-		Int32 count = pImage->GetNumTiles();
-		for (Int32 i = 0; i < count; i++)
-		{
-			maxon::JobRef job = TileJob::Create(pRayTracer, i) iferr_return;
-			jobGroup.Add(job) iferr_return;
-		}
+		maxon::JobRef job = TileJob::Create(pRayTracer) iferr_return;
+		jobGroup.Add(job) iferr_return;
 	}
 	break;
 	default:
@@ -84,150 +90,225 @@ Bool SetupRenderer(maxon::JobGroupRef jobGroup, RENDERMODE renderMode, Raytracer
 	return true;
 }
 
-BaseObject* GetNextObject(BaseObject* op)
+JobTaskRunner::JobTaskRunner(Int32 threadCount) : _threadCount(threadCount)
 {
-	if (!op)
-		return nullptr;
-
-	if (op->GetDown())
-		return op->GetDown();
-
-	while (!op->GetNext() && op->GetUp())
-		op = op->GetUp();
-
-	return op->GetNext();
+	if (_threadCount <= 0)
+	{
+		_threadCount = GeGetCurrentThreadCount();
+	}
 }
 
-color ray_color_booktwo(const ray& r, const color& background, const hittable& world, int depth) {
-	hit_record rec;
-
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return color(0, 0, 0);
-
-	// If the ray hits nothing, return the background color.
-	if (!world.hit(r, 0.001, infinity, rec))
-		return background;
-
-	ray scattered;
-	color attenuation;
-	color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-	if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-		return emitted;
-
-	return emitted + attenuation * ray_color_booktwo(scattered, background, world, depth - 1);
+int JobTaskRunner::thread_count() const
+{
+	return _threadCount;
 }
 
-color ray_color_bookone(const ray& r, const hittable& world, int depth) {
-	hit_record rec;
-
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return color(0, 0, 0);
+static maxon::Result<void> RunTaskJobs(std::vector<std::function<void()>>& tasks, Int32 jobCount, std::atomic<size_t>& next)
+{
+	iferr_scope;
 
-	if (world.hit(r, 0.001, infinity, rec)) {
-		ray scattered;
-		color attenuation;
-		if (rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-			return attenuation * ray_color_bookone(scattered, world, depth - 1);
-		return color(0, 0, 0);
+	maxon::JobGroupRef group = maxon::JobGroupRef::Create() iferr_return;
+	for (Int32 i = 0; i < jobCount; i++)
+	{
+		group.Add([&tasks, &next]()
+		{
+			for (size_t task = next++; task < tasks.size(); task = next++)
+			{
+				tasks[task]();
+			}
+		}) iferr_return;
 	}
 
-	vec3 unit_direction = unit_vector(r.direction());
-	auto t = 0.5 * (unit_direction.y() + 1.0);
-	return (1.0 - t) * color(1.0, 1.0, 1.0) + t * color(0.5, 0.7, 1.0);
+	group.Enqueue();
+	group.Wait();
+	return maxon::OK;
 }
 
-color ray_color(const ray& r, const color& background, bool domeBackground, const hittable& world, int depth) {
+void JobTaskRunner::run(std::vector<std::function<void()>>& tasks)
+{
+	std::atomic<size_t> next(0);
+	Int32 jobCount = maxon::Min(_threadCount, Int32(tasks.size()));
 
-	if (domeBackground)
-	{
-		return ray_color_bookone(r, world, depth);
-	}
-	else
+	iferr (RunTaskJobs(tasks, jobCount, next))
 	{
-		return ray_color_booktwo(r, background, world, depth);
+		// The jobs could not be created, so finish whatever is left on this thread
+		for (size_t task = next++; task < tasks.size(); task = next++)
+		{
+			tasks[task]();
+		}
 	}
 }
 
-hittable_list random_scene() {
-	hittable_list world;
+void RunBVHBenchmark()
+{
+	const Int32 primitiveCounts[] = { 10000, 100000, 1000000 };
+	const Int32 runs = 3;
+	Int32 maxThreads = GeGetCurrentThreadCount();
 
-	auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-	world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
+	GeConsoleOut("BVH Benchmark: " + String::IntToString(maxThreads) + " threads available");
 
-	for (int a = -11; a < 11; a++) {
-		for (int b = -11; b < 11; b++) {
-			auto choose_mat = random_double();
-			point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+	for (Int32 primitiveCount : primitiveCounts)
+	{
+		// Small random boxes at roughly the density of a large cloner
+		Random rnd;
+		rnd.Init(1234);
+		Float extent = maxon::Pow(Float(primitiveCount), 1.0 / 3.0) * 2.0;
 
-			if ((center - point3(4, 0.2, 0)).length() > 0.9) {
-				shared_ptr<material> sphere_material;
+		std::vector<aabb> boxes(primitiveCount);
+		for (aabb& box : boxes)
+		{
+			point3 center(rnd.Get11() * extent, rnd.Get11() * extent, rnd.Get11() * extent);
+			vec3 half(0.1 + rnd.Get01() * 0.4, 0.1 + rnd.Get01() * 0.4, 0.1 + rnd.Get01() * 0.4);
+			box = aabb(center - half, center + half);
+		}
 
-				if (choose_mat < 0.8) {
-					// diffuse
-					auto albedo = color::random() * color::random();
-					sphere_material = make_shared<lambertian>(albedo);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
-				}
-				else if (choose_mat < 0.95) {
-					// metal
-					auto albedo = color::random(0.5, 1);
-					auto fuzz = random_double(0, 0.5);
-					sphere_material = make_shared<metal>(albedo, fuzz);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+		// The SAH build against the linear build with one rotation pass, the cost shows what the
+		// faster build gives up in tree quality
+		for (Bool linear : { false, true })
+		{
+			Float singleThreadTime = 0.0;
+			for (Int32 threads = 1; ; threads = maxon::Min(threads * 2, maxThreads))
+			{
+				JobTaskRunner runner(threads);
+				bvh_tree tree;
+				tree.linear = linear;
+				tree.rotation_passes = linear ? 1 : 0;
+
+				Float best = maxon::LIMIT<Float>::MAX;
+				for (Int32 run = 0; run < runs; run++)
+				{
+					tree.build(boxes, &runner);
+					best = maxon::Min(best, tree.stats.build_ms);
 				}
-				else {
-					// glass
-					sphere_material = make_shared<dielectric>(1.5);
-					world.add(make_shared<sphere>(center, 0.2, sphere_material));
+
+				if (threads == 1)
+				{
+					singleThreadTime = best;
 				}
+
+				GeConsoleOut("BVH Benchmark: " + String::IntToString(primitiveCount) + " primitives, " + (linear ? "Linear"_s : "SAH"_s) + ", "
+					+ String::IntToString(threads) + " threads: " + String::FloatToString(best) + " ms ("
+					+ String::FloatToString(singleThreadTime / best) + "x), Nodes: " + String::IntToString(tree.stats.node_count)
+					+ " Cost: " + String::FloatToString(tree.stats.build_cost));
+
+				if (threads >= maxThreads)
+					break;
 			}
 		}
 	}
+}
 
-	auto material1 = make_shared<dielectric>(1.5);
-	world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
+BaseObject* GetNextObject(BaseObject* op)
+{
+	if (!op)
+		return nullptr;
 
-	auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-	world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
+	if (op->GetDown())
+		return op->GetDown();
 
-	auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-	world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+	while (!op->GetNext() && op->GetUp())
+		op = op->GetUp();
 
-	return world;
+	return op->GetNext();
 }
 
-void write_color(int x, int y, TiledImage* image, color pixel_color, int samples_per_pixel, VPBuffer *buffer) {
-	auto r = pixel_color.x();
-	auto g = pixel_color.y();
-	auto b = pixel_color.z();
+void RunTraceBenchmark()
+{
+	const Int32 width = 400;
+	const Int32 height = 225;
+	const Int32 samples = 8;
+	const Int32 maxDepth = 50;
+	Int32 maxThreads = GeGetCurrentThreadCount();
 
-	// Replace NaN components with zero. See explanation in Ray Tracing: The Rest of Your Life.
-	if (r != r) r = 0.0;
-	if (g != g) g = 0.0;
-	if (b != b) b = 0.0;
+	hittable_list scene = random_scene();
+	JobTaskRunner buildRunner;
+	bvh world;
+	world.build(scene.objects, &buildRunner);
 
-	// Divide the color by the number of samples and gamma-correct for gamma=2.0.
-	auto scale = 1.0 / samples_per_pixel;
-	r = sqrt(scale * r);
-	g = sqrt(scale * g);
-	b = sqrt(scale * b);
+	camera cam(point3(13, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 20, Float(width) / Float(height), 0.1, 10.0);
 
-	if (buffer)
+	GeConsoleOut("Trace Benchmark: " + String::IntToString(Int(scene.objects.size())) + " objects, "
+		+ String::IntToString(width) + "x" + String::IntToString(height) + " at " + String::IntToString(samples) + " spp");
+
+	Float singleThreadRate = 0.0;
+	for (Int32 threads = 1; ; threads = maxon::Min(threads * 2, maxThreads))
 	{
-		Float32 data[4];
-		data[0] = r;
-		data[1] = g;
-		data[2] = b;
-		data[3] = 1.0;
+		JobTaskRunner runner(threads);
+
+		// One task per row, every row traces the same paths whatever the thread count
+		std::vector<std::function<void()>> rows;
+		for (Int32 j = 0; j < height; j++)
+		{
+			rows.push_back([&, j]()
+			{
+				sobol_sampler rng;
+				for (Int32 i = 0; i < width; i++)
+				{
+					for (Int32 s = 0; s < samples; s++)
+					{
+						rng.start(UInt32(j * width + i), UInt32(s));
+						double du, dv;
+						rng.next_2d(du, dv);
+						ray r = cam.get_ray((i + du) / (width - 1), (j + dv) / (height - 1), rng);
+						ray_color(r, color(0, 0, 0), true, world, light_list(), nullptr, maxDepth, rng);
+					}
+				}
+			});
+		}
+
+		Int32 startTime = GeGetTimer();
+		runner.run(rows);
+		Int32 renderTime = maxon::Max(GeGetTimer() - startTime, Int32(1));
+
+		Float rate = Float(width) * Float(height) * Float(samples) / (Float(renderTime) * 1000.0);
+		if (threads == 1)
+		{
+			singleThreadRate = rate;
+		}
+
+		GeConsoleOut("Trace Benchmark: " + String::IntToString(threads) + " threads: " + String::IntToString(renderTime) + " ms, "
+			+ String::FloatToString(rate) + " Msamples/s (" + String::FloatToString(rate / singleThreadRate) + "x)");
 
-		buffer->SetLine(x, y, 1, data, 32, true);
+		if (threads >= maxThreads)
+			break;
 	}
-	else
+}
+
+// Resolves count accumulated colors starting at x on row y and stores them with one SetLine
+// call per span instead of one per pixel. NaN components are replaced with zero (see Ray
+// Tracing: The Rest of Your Life) and the colors are gamma corrected for gamma=2.0. The loop
+// has no branches, so the compiler can vectorise it over the span.
+void write_row(int x, int y, int count, const color* pixel_colors, int samples_per_pixel, TiledImage* image, VPBuffer* buffer) {
+	const int spanSize = 256;
+	Float32 data[spanSize * 4];
+
+	auto scale = 1.0 / samples_per_pixel;
+	for (int start = 0; start < count; start += spanSize)
 	{
-		image->SetPixel(x, y, Vector32(r, g, b));
+		int n = maxon::Min(spanSize, count - start);
+		const color* src = pixel_colors + start;
+		for (int i = 0; i < n; ++i)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				auto v = src[i][c];
+				v = v == v ? v : 0.0;
+				data[i * 4 + c] = Float32(sqrt(scale * v));
+			}
+			data[i * 4 + 3] = 1.0f;
+		}
+
+		if (buffer)
+		{
+			buffer->SetLine(x + start, y, n, data, 32, true);
+		}
+		else
+		{
+			for (int i = 0; i < n; ++i)
+			{
+				image->SetPixel(x + start + i, y, Vector32(data[i * 4], data[i * 4 + 1], data[i * 4 + 2]));
+			}
+		}
 	}
 }
 
@@ -254,6 +335,7 @@ Bool Raytracer::Init(GeUserArea* pUserArea, TiledImage* image, Bool progressive)
 
 	SetupScene();
 	SetupCamera();
+	PrintTraversalStats();
 
 	if (progressive)
 	{
@@ -274,6 +356,7 @@ CameraObject* Raytracer::GetCamera()
 void Raytracer::SetupScene()
 {
 	_world.clear();
+	_objectList.Reset();
 
 	BaseDocument* doc = GetActiveDocument();
 	if (_doc)
@@ -286,6 +369,23 @@ void Raytracer::SetupScene()
 	}
 
 	ExportObject(doc->GetFirstObject(), nullptr);
+
+	JobTaskRunner runner;
+	ConfigureTree(_worldBVH.tree);
+	_worldBVH.build(_world.objects, &runner);
+	_lights.gather(_world.objects);
+
+	const bvh_stats& stats = _worldBVH.stats();
+	GeConsoleOut("BVH Primitives: " + String::IntToString(stats.primitive_count));
+	GeConsoleOut("BVH Nodes: " + String::IntToString(stats.node_count) + " Leaves: " + String::IntToString(stats.leaf_count) + " Depth: " + String::IntToString(stats.max_depth) + " Wide Nodes: " + String::IntToString(stats.wide_node_count));
+	GeConsoleOut("BVH BuildTime: " + String::FloatToString(stats.build_ms) + " ms " + (_bvhBuilder == BVHBUILDER::LINEAR ? "Linear"_s : "SAH"_s)
+		+ " Cost: " + String::FloatToString(stats.build_cost) + " Threads: " + String::IntToString(runner.thread_count()) + " Subtree Tasks: " + String::IntToString(stats.subtree_tasks));
+	GeConsoleOut("BVH Memory: " + String::IntToString(Int(stats.node_bytes / 1024)) + " KB" + (_compressedBVH ? " Compressed"_s : ""_s));
+	if (_spatialSplits)
+	{
+		GeConsoleOut("BVH References: " + String::IntToString(stats.reference_count) + " Spatial Splits: " + String::IntToString(stats.spatial_splits));
+	}
+	GeConsoleOut("Lights: " + String::IntToString(_lights.size()));
 }
 
 void Raytracer::ExportObject(BaseObject *pObj, BaseObject* original)
@@ -300,10 +400,16 @@ void Raytracer::ExportObject(BaseObject *pObj, BaseObject* original)
 		case Osymmetry:
 		case Oboole:
 		case Ometaball:
+		{
+			DoRecursionCacheAdd(pObj, original, false);
+			objectHandled = true;
+		}
+		break;
+
 		case Oatomarray:
 		case Oarray:
 		{
-			DoRecursionCacheAdd(pObj, original, false);
+			AddInstances(pObj, original, false);
 			objectHandled = true;
 		}
 		break;
@@ -332,7 +438,7 @@ void Raytracer::ExportObject(BaseObject *pObj, BaseObject* original)
 
 		case 1018544: //mograph cloner
 		{
-			DoRecursionCacheAdd(pObj, original);
+			AddInstances(pObj, original, true);
 			objectHandled = true;
 		}
 		break;
@@ -368,6 +474,10 @@ void Raytracer::ExportObject(BaseObject *pObj, BaseObject* original)
 			}
 			else if (pObj->GetInfo() & OBJECT_POLYGONOBJECT)
 			{
+				if (pObj->GetDeformCache())
+					DoRecursionCacheAdd(pObj->GetDeformCache(), original, false);
+				else
+					AddPolygonObject(pObj, original);
 			}
 			else
 			{
@@ -455,19 +565,28 @@ TextureTag* FindTextureTag(BaseObject* pObj)
 	return (TextureTag*)pTag;
 }
 
-Bool Raytracer::AddMaterial(BaseObject* pObj, BaseObject* original, DirtyObject &out)
+// Converts a global matrix into the render frame. Z is flipped on both sides of the linear part and the
+// offset is converted from centimetres, the geometry sizes are already in render units.
+static affine_transform GetRenderTransform(const Matrix& mg)
 {
-	if (!pObj)
-		return false;
-
-	ObjectColorProperties prop;
-	pObj->GetColorProperties(&prop);
+	const Vector* axes[3] = { &mg.sqmat.v1, &mg.sqmat.v2, &mg.sqmat.v3 };
+	const Float flip[3] = { 1.0, 1.0, -1.0 };
 
-	vec3 albedo(prop.color.x, prop.color.y, prop.color.z);
-
-	std::shared_ptr<material> mat;
+	affine_transform t;
+	for (Int32 i = 0; i < 3; i++)
+	{
+		for (Int32 j = 0; j < 3; j++)
+		{
+			t.m[i][j] = Float32((*axes[j])[i] * flip[i] * flip[j]);
+		}
+		t.m[i][3] = Float32(mg.off[i] * 0.01 * flip[i]);
+	}
+	return t;
+}
 
-	BaseMaterial* pMat = nullptr;
+// Returns the FunRay material assigned to the object or to the generator it came from.
+static BaseMaterial* FindFunRayMaterial(BaseObject* pObj, BaseObject* original)
+{
 	TextureTag* pTag = FindTextureTag(pObj);
 	TextureTag* pOriginalTag = FindTextureTag(original);
 	if (pOriginalTag)
@@ -476,96 +595,106 @@ Bool Raytracer::AddMaterial(BaseObject* pObj, BaseObject* original, DirtyObject
 	}
 	if (pTag)
 	{
-		BaseMaterial* pMatCheck = pTag->GetMaterial();
-		if (pMatCheck && pMatCheck->GetType() == GLD_ID_FUNRAYMATERIAL)
+		BaseMaterial* pMat = pTag->GetMaterial();
+		if (pMat && pMat->GetType() == GLD_ID_FUNRAYMATERIAL)
 		{
-			pMat = pMatCheck;
+			return pMat;
+		}
+	}
+	return nullptr;
+}
 
-			GeData dType;
-			pMat->GetParameter(FUNRAYMATERIAL_TYPE, dType, DESCFLAGS_GET::NONE);
+// Creates the render material for a FunRay material, or a lambertian with the object color if there is none.
+static std::shared_ptr<material> CreateMaterial(BaseMaterial* pMat, const vec3& albedo)
+{
+	std::shared_ptr<material> mat;
+
+	if (pMat)
+	{
+		GeData dType;
+		pMat->GetParameter(FUNRAYMATERIAL_TYPE, dType, DESCFLAGS_GET::NONE);
 
-			GeData dColor;
-			pMat->GetParameter(FUNRAYMATERIAL_COLOR, dColor, DESCFLAGS_GET::NONE);
+		GeData dColor;
+		pMat->GetParameter(FUNRAYMATERIAL_COLOR, dColor, DESCFLAGS_GET::NONE);
 
-			GeData dColorTexture;
-			pMat->GetParameter(FUNRAYMATERIAL_COLOR_TEXTURE, dColorTexture, DESCFLAGS_GET::NONE);
+		GeData dColorTexture;
+		pMat->GetParameter(FUNRAYMATERIAL_COLOR_TEXTURE, dColorTexture, DESCFLAGS_GET::NONE);
 
-			GeData dFuzz;
-			pMat->GetParameter(FUNRAYMATERIAL_FUZZ, dFuzz, DESCFLAGS_GET::NONE);
+		GeData dFuzz;
+		pMat->GetParameter(FUNRAYMATERIAL_FUZZ, dFuzz, DESCFLAGS_GET::NONE);
 
-			GeData dIOR;
-			pMat->GetParameter(FUNRAYMATERIAL_IOR, dIOR, DESCFLAGS_GET::NONE);
+		GeData dIOR;
+		pMat->GetParameter(FUNRAYMATERIAL_IOR, dIOR, DESCFLAGS_GET::NONE);
 
-			switch (dType.GetInt32())
-			{
-			case FUNRAYMATERIAL_TYPE_LAMBERT:
+		switch (dType.GetInt32())
+		{
+		case FUNRAYMATERIAL_TYPE_LAMBERT:
+		{
+			Vector c = dColor.GetVector();
+			Filename f = dColorTexture.GetFilename();
+			if (GeFExist(f))
 			{
-				Vector c = dColor.GetVector();
-				Filename f = dColorTexture.GetFilename();
-				if (GeFExist(f))
-				{
-					maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(f.GetString().GetCStringCopy());
-					std::shared_ptr<image_texture> texture = make_shared<image_texture>(filenameStr);
-					mat = make_shared<lambertian>(texture);
-				}
-				else
-				{
-					mat = make_shared<lambertian>(vec3(c.x, c.y, c.z));
-				}
+				maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(f.GetString().GetCStringCopy());
+				std::shared_ptr<image_texture> texture = make_shared<image_texture>(filenameStr);
+				mat = make_shared<lambertian>(texture);
 			}
-			break;
-			case FUNRAYMATERIAL_TYPE_METAL:
+			else
 			{
-				Vector c = dColor.GetVector();
-				Float f = dFuzz.GetFloat();
-				mat = make_shared<metal>(vec3(c.x, c.y, c.z), f);
+				mat = make_shared<lambertian>(vec3(c.x, c.y, c.z));
 			}
-			break;
-			case FUNRAYMATERIAL_TYPE_DIELECTRIC:
+		}
+		break;
+		case FUNRAYMATERIAL_TYPE_METAL:
+		{
+			Vector c = dColor.GetVector();
+			Float f = dFuzz.GetFloat();
+			mat = make_shared<metal>(vec3(c.x, c.y, c.z), f);
+		}
+		break;
+		case FUNRAYMATERIAL_TYPE_DIELECTRIC:
+		{
+			Float ior = dIOR.GetFloat();
+			mat = make_shared<dielectric>(ior);
+		}
+		break;
+		case FUNRAYMATERIAL_TYPE_ISOTROPIC:
+		{
+			Vector c = dColor.GetVector();
+			Filename f = dColorTexture.GetFilename();
+			if (GeFExist(f))
 			{
-				Float ior = dIOR.GetFloat();
-				mat = make_shared<dielectric>(ior);
+				maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(f.GetString().GetCStringCopy());
+				std::shared_ptr<image_texture> texture = make_shared<image_texture>(filenameStr);
+				mat = make_shared<isotropic>(texture);
 			}
-			break;
-			case FUNRAYMATERIAL_TYPE_ISOTROPIC:
+			else
 			{
-				Vector c = dColor.GetVector();
-				Filename f = dColorTexture.GetFilename();
-				if (GeFExist(f))
-				{
-					maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(f.GetString().GetCStringCopy());
-					std::shared_ptr<image_texture> texture = make_shared<image_texture>(filenameStr);
-					mat = make_shared<isotropic>(texture);
-				}
-				else
-				{
-					mat = make_shared<isotropic>(vec3(c.x, c.y, c.z));
-				}
+				mat = make_shared<isotropic>(vec3(c.x, c.y, c.z));
 			}
-			break;
-			case FUNRAYMATERIAL_TYPE_DIFFUSE_LIGHT:
+		}
+		break;
+		case FUNRAYMATERIAL_TYPE_DIFFUSE_LIGHT:
+		{
+			Vector c = dColor.GetVector();
+			Filename f = dColorTexture.GetFilename();
+			if (GeFExist(f))
 			{
-				Vector c = dColor.GetVector();
-				Filename f = dColorTexture.GetFilename();
-				if (GeFExist(f))
-				{
-					maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(f.GetString().GetCStringCopy());
-					std::shared_ptr<image_texture> texture = make_shared<image_texture>(filenameStr);
-					mat = make_shared<diffuse_light>(texture);
-				}
-				else
-				{
-					mat = make_shared<diffuse_light>(vec3(c.x, c.y, c.z));
-				}
+				maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(f.GetString().GetCStringCopy());
+				std::shared_ptr<image_texture> texture = make_shared<image_texture>(filenameStr);
+				mat = make_shared<diffuse_light>(texture);
 			}
-			break;
-			default:
+			else
 			{
-				mat = make_shared<lambertian>(albedo);
-			}
-			break;
+				mat = make_shared<diffuse_light>(vec3(c.x, c.y, c.z));
 			}
 		}
+		break;
+		default:
+		{
+			mat = make_shared<lambertian>(albedo);
+		}
+		break;
+		}
 	}
 
 	if (!mat)
@@ -573,15 +702,27 @@ Bool Raytracer::AddMaterial(BaseObject* pObj, BaseObject* original, DirtyObject
 		mat = make_shared<lambertian>(albedo);
 	}
 
-	Matrix mg = pObj->GetMg();
-	Vector pos = mg.off * 0.01;
+	return mat;
+}
+
+Bool Raytracer::AddMaterial(BaseObject* pObj, BaseObject* original, DirtyObject &out)
+{
+	if (!pObj)
+		return false;
+
+	ObjectColorProperties prop;
+	pObj->GetColorProperties(&prop);
+
+	vec3 albedo(prop.color.x, prop.color.y, prop.color.z);
+
+	BaseMaterial* pMat = FindFunRayMaterial(pObj, original);
 
 	out.mat->SetLink(pMat);
 	if (pMat)
 	{
 		out.matDirty = pMat->GetDirty(DIRTYFLAGS::DATA);
 	}
-	out.renderMat = mat;
+	out.renderMat = CreateMaterial(pMat, albedo);
 
 	return true;
 }
@@ -612,6 +753,7 @@ void Raytracer::AddSphere(BaseObject* pObj, BaseObject* original)
 			dirtyObj.originalDirty = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
 		}
 
+		dirtyObj.worldIndex = Int32(_world.objects.size());
 		_world.add(dirtyObj.renderObject);
 	}
 }
@@ -642,6 +784,7 @@ void Raytracer::AddCylinder(BaseObject* pObj, BaseObject* original)
 			dirtyObj.originalDirty = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
 		}
 
+		dirtyObj.worldIndex = Int32(_world.objects.size());
 		_world.add(dirtyObj.renderObject);
 	}
 }
@@ -655,21 +798,17 @@ void Raytracer::AddCube(BaseObject* pObj, BaseObject* original)
 	BaseContainer* bc = pObj->GetDataInstance();
 	Vector len = bc->GetVector(PRIM_CUBE_LEN) * 0.01 * 0.5;
 
-	Matrix mg = pObj->GetMg();
-	Vector pos = mg.off * 0.01;
+	// One transform carries the rotation and any non-uniform scale of the object matrix
+	std::shared_ptr<oriented_box> cube = make_shared<oriented_box>(nullptr);
+	if (!cube->set_transform(GetRenderTransform(pObj->GetMg()), vec3(len.x, len.y, len.z)))
+		return;
 
 	ifnoerr(DirtyObject & dirtyObj = _objectList.Append())
 	{
 		AddMaterial(pObj, original, dirtyObj);
 
-		Vector rot = MatrixToHPB(mg, ROTATIONORDER::XYZGLOBAL);
-
-		vec3 box_min = vec3(-len.x, -len.y, -len.z) + vec3(pos.x, pos.y, -pos.z);
-		vec3 box_max = vec3(len.x, len.y, len.z) + vec3(pos.x, pos.y, -pos.z);
-		dirtyObj.renderObject = make_shared<box>(box_min, box_max, dirtyObj.renderMat);
-		dirtyObj.renderObject = make_shared<rotate_x>(dirtyObj.renderObject, maxon::RadToDeg(-rot.x));
-		dirtyObj.renderObject = make_shared<rotate_y>(dirtyObj.renderObject, maxon::RadToDeg(rot.y));
-		dirtyObj.renderObject = make_shared<rotate_z>(dirtyObj.renderObject, maxon::RadToDeg(rot.z));
+		cube->mat_ptr = dirtyObj.renderMat;
+		dirtyObj.renderObject = cube;
 
 		dirtyObj.obj->SetLink(pObj);
 		dirtyObj.dirty = pObj->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
@@ -680,6 +819,7 @@ void Raytracer::AddCube(BaseObject* pObj, BaseObject* original)
 			dirtyObj.originalDirty = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
 		}
 
+		dirtyObj.worldIndex = Int32(_world.objects.size());
 		_world.add(dirtyObj.renderObject);
 	}
 }
@@ -726,75 +866,328 @@ void Raytracer::AddPlane(BaseObject* pObj, BaseObject* original)
 			dirtyObj.originalDirty = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
 		}
 
+		dirtyObj.worldIndex = Int32(_world.objects.size());
 		_world.add(dirtyObj.renderObject);
 	}
 }
 
-Bool Raytracer::UpdateObjects(Bool *rebuildScene)
+void Raytracer::AddPolygonObject(BaseObject* pObj, BaseObject* original)
 {
-	Bool objectChanged = false;
-	for (auto& obj : _objectList)
-	{
-		BaseObject* pObj = (BaseObject * )obj.obj->GetLink(GetActiveDocument());
-		if (pObj)
-		{ 
-			UInt32 d = pObj->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
-			if (d != obj.dirty)
-			{
-				obj.dirty = d;
+	if (!pObj)
+		return;
 
-				Matrix mg = pObj->GetMg();
-				Vector pos = mg.off * 0.01;
+	PolygonObject* pPoly = ToPoly(pObj);
+	const Vector* points = pPoly->GetPointR();
+	const CPolygon* polygons = pPoly->GetPolygonR();
+	Int32 pointCount = pPoly->GetPointCount();
+	Int32 polygonCount = pPoly->GetPolygonCount();
+	if (!points || !polygons || pointCount == 0 || polygonCount == 0)
+		return;
 
-				if (pObj->GetType() == Osphere)
-				{
-					BaseContainer* bc = pObj->GetDataInstance();
-					Float radius = bc->GetFloat(PRIM_SPHERE_RAD) * 0.01;
+	ifnoerr(DirtyObject & dirtyObj = _objectList.Append())
+	{
+		AddMaterial(pObj, original, dirtyObj);
 
-					std::shared_ptr<sphere> spherePtr = std::static_pointer_cast<sphere>(obj.renderObject);
-					if (spherePtr)
-					{
-						spherePtr->radius = radius;
-						spherePtr->center = vec3(pos.x, pos.y, -pos.z);
-						objectChanged = true;
-					}
-				}
-				else if (pObj->GetType() == Ocube)
-				{
-					BaseContainer* bc = pObj->GetDataInstance();
-					Vector len = bc->GetVector(PRIM_CUBE_LEN) * 0.01 * 0.5;
+		std::shared_ptr<triangle_mesh> mesh = make_shared<triangle_mesh>(dirtyObj.renderMat);
+		mesh->reserve(pointCount, polygonCount * 2);
 
-					std::shared_ptr<box> boxPtr = std::static_pointer_cast<box>(obj.renderObject);
-					if (boxPtr)
-					{
-						boxPtr->box_min = vec3(-len.x, -len.y, -len.z) + vec3(pos.x, pos.y, -pos.z);
-						boxPtr->box_max = vec3(len.x, len.y, len.z) + vec3(pos.x, pos.y, -pos.z);
-						objectChanged = true;
-					}
+		Matrix mg = pObj->GetMg();
+		for (Int32 i = 0; i < pointCount; i++)
+		{
+			Vector p = mg * points[i] * 0.01;
+			mesh->add_point(point3(p.x, p.y, -p.z));
+		}
 
-					objectChanged = true;
-					*rebuildScene = true;
-				}
-				else if (pObj->GetType() == Oplane)
-				{
-					objectChanged = true;
-					*rebuildScene = true;
-				}
-				else if (pObj->GetType() == Ocylinder)
-				{
-					objectChanged = true;
-					*rebuildScene = true;
-				}
+		// Flipping Z mirrors the mesh, so b and c trade places to keep the normals pointing outwards
+		for (Int32 i = 0; i < polygonCount; i++)
+		{
+			const CPolygon& poly = polygons[i];
+			mesh->add_triangle(poly.a, poly.c, poly.b);
+			if (poly.c != poly.d)
+			{
+				mesh->add_triangle(poly.a, poly.d, poly.c);
 			}
 		}
 
-		BaseObject* original = (BaseObject*)obj.original->GetLink(GetActiveDocument());
+		JobTaskRunner runner;
+		ConfigureTree(mesh->tree);
+		mesh->build(&runner);
+
+		dirtyObj.renderObject = mesh;
+		dirtyObj.obj->SetLink(pObj);
+		dirtyObj.dirty = pObj->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
+
 		if (original)
 		{
-			UInt32 d = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
-			if (d != obj.originalDirty)
-			{
-				obj.originalDirty = d;
+			dirtyObj.original->SetLink(original);
+			dirtyObj.originalDirty = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
+		}
+
+		dirtyObj.worldIndex = Int32(_world.objects.size());
+		_world.add(dirtyObj.renderObject);
+	}
+}
+
+// Object type and size parameters of a primitive. Clones with the same key share one object space geometry.
+typedef std::tuple<Int32, Float, Float, Float, Int32> InstanceGeometryKey;
+
+static Bool GetInstanceGeometryKey(BaseObject* pObj, InstanceGeometryKey& key)
+{
+	BaseContainer* bc = pObj->GetDataInstance();
+	switch (pObj->GetType())
+	{
+	case Osphere:
+	{
+		key = InstanceGeometryKey(Osphere, bc->GetFloat(PRIM_SPHERE_RAD) * 0.01, 0.0, 0.0, 0);
+		return true;
+	}
+	case Ocube:
+	{
+		Vector len = bc->GetVector(PRIM_CUBE_LEN) * 0.01 * 0.5;
+		key = InstanceGeometryKey(Ocube, len.x, len.y, len.z, 0);
+		return true;
+	}
+	case Ocylinder:
+	{
+		key = InstanceGeometryKey(Ocylinder, bc->GetFloat(PRIM_CYLINDER_RADIUS) * 0.01, bc->GetFloat(PRIM_CYLINDER_HEIGHT) * 0.01, 0.0, 0);
+		return true;
+	}
+	case Oplane:
+	{
+		key = InstanceGeometryKey(Oplane, bc->GetFloat(PRIM_PLANE_WIDTH) * 0.01 * 0.5, bc->GetFloat(PRIM_PLANE_HEIGHT) * 0.01 * 0.5, 0.0, bc->GetInt32(PRIM_AXIS));
+		return true;
+	}
+	}
+	return false;
+}
+
+// Builds the geometry for a key centred on the origin, the same shapes AddSphere, AddCube, AddCylinder and AddPlane create.
+// The material comes from the instance, so the geometry has none.
+static std::shared_ptr<hittable> CreateInstanceGeometry(const InstanceGeometryKey& key)
+{
+	Float a = std::get<1>(key);
+	Float b = std::get<2>(key);
+	Float c = std::get<3>(key);
+
+	switch (std::get<0>(key))
+	{
+	case Osphere:
+		return make_shared<sphere>(point3(0, 0, 0), a, nullptr);
+	case Ocube:
+		return make_shared<oriented_box>(affine_transform::identity(), vec3(a, b, c), nullptr);
+	case Ocylinder:
+		return make_shared<cylinder>(point3(0, 0, 0), b * 0.5, -b * 0.5, a, nullptr);
+	case Oplane:
+	{
+		switch (std::get<4>(key))
+		{
+		case PRIM_AXIS_XP:
+		case PRIM_AXIS_XN:
+			return make_shared<yz_rect>(-a, a, -b, b, 0.0, nullptr);
+		case PRIM_AXIS_YP:
+		case PRIM_AXIS_YN:
+			return make_shared<xz_rect>(-a, a, -b, b, 0.0, nullptr);
+		default:
+			return make_shared<xy_rect>(-a, a, -b, b, 0.0, nullptr);
+		}
+	}
+	}
+	return nullptr;
+}
+
+struct InstanceCollector
+{
+	explicit InstanceCollector(instance_set& set) : instances(set) { }
+
+	instance_set& instances;
+	std::map<InstanceGeometryKey, int> geometries;
+	std::map<std::tuple<BaseMaterial*, Float, Float, Float>, int> materials;
+	std::vector<BaseMaterial*> sourceMaterials;
+};
+
+// Adds every clone below op to the collector. Returns false as soon as a clone is not a primitive that
+// can be instanced, the caller then falls back to exporting the generator object by object.
+static Bool CollectInstances(BaseObject* op, BaseObject* original, InstanceCollector& collector)
+{
+	for (; op; op = op->GetNext())
+	{
+		// Inputs of a generator further down, its cache already holds the result
+		if (op->GetBit(BIT_CONTROLOBJECT))
+			continue;
+
+		InstanceGeometryKey key;
+		if (op->GetDeformCache())
+		{
+			if (!CollectInstances(op->GetDeformCache(), original, collector))
+				return false;
+		}
+		else if (GetInstanceGeometryKey(op, key))
+		{
+			auto geometry = collector.geometries.find(key);
+			if (geometry == collector.geometries.end())
+			{
+				std::shared_ptr<hittable> object = CreateInstanceGeometry(key);
+				if (!object)
+					return false;
+				geometry = collector.geometries.emplace(key, collector.instances.add_geometry(object)).first;
+			}
+
+			ObjectColorProperties prop;
+			op->GetColorProperties(&prop);
+			vec3 albedo(prop.color.x, prop.color.y, prop.color.z);
+
+			// The object color only matters without a FunRay material, so clones sharing one do not split it up
+			BaseMaterial* pMat = FindFunRayMaterial(op, original);
+			auto materialKey = pMat ? std::make_tuple(pMat, 0.0, 0.0, 0.0) : std::make_tuple(pMat, albedo.x(), albedo.y(), albedo.z());
+			auto mat = collector.materials.find(materialKey);
+			if (mat == collector.materials.end())
+			{
+				mat = collector.materials.emplace(materialKey, collector.instances.add_material(CreateMaterial(pMat, albedo))).first;
+				if (pMat)
+				{
+					collector.sourceMaterials.push_back(pMat);
+				}
+			}
+
+			// Emitters have to be single objects in the world to end up in the light tree
+			if (collector.instances.materials[mat->second]->emissive())
+				return false;
+
+			collector.instances.add_instance(GetRenderTransform(op->GetMg()), geometry->second, mat->second);
+		}
+		else if (op->GetCache(nullptr))
+		{
+			if (!CollectInstances(op->GetCache(nullptr), original, collector))
+				return false;
+		}
+		else if (op->GetType() != Onull)
+		{
+			return false;
+		}
+
+		if (!CollectInstances(op->GetDown(), original, collector))
+			return false;
+	}
+	return true;
+}
+
+void Raytracer::AddInstances(BaseObject* pObj, BaseObject* original, Bool processChildren)
+{
+	if (!pObj)
+		return;
+
+	BaseObject* instanceOriginal = original ? original : pObj;
+	BaseObject* cache = pObj->GetDeformCache() ? pObj->GetDeformCache() : pObj->GetCache(nullptr);
+
+	std::shared_ptr<instance_set> instances = make_shared<instance_set>();
+	InstanceCollector collector(*instances);
+	if (!cache || !CollectInstances(cache, instanceOriginal, collector) || instances->empty())
+	{
+		DoRecursionCacheAdd(pObj, original, processChildren);
+		return;
+	}
+
+	JobTaskRunner runner;
+	ConfigureTree(instances->tree);
+	instances->build(&runner);
+
+	GeConsoleOut("Instances: " + String::IntToString(Int(instances->instances.size())) + " Geometries: " + String::IntToString(Int(instances->geometries.size()))
+		+ " Materials: " + String::IntToString(Int(instances->materials.size())));
+
+	ifnoerr(DirtyObject & dirtyObj = _objectList.Append())
+	{
+		dirtyObj.renderObject = instances;
+		dirtyObj.original->SetLink(instanceOriginal);
+		dirtyObj.originalDirty = instanceOriginal->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
+
+		dirtyObj.worldIndex = Int32(_world.objects.size());
+		_world.add(dirtyObj.renderObject);
+	}
+
+	// The shared materials are watched separately, a change to any of them rebuilds the scene
+	for (BaseMaterial* pMat : collector.sourceMaterials)
+	{
+		ifnoerr(DirtyObject & matObj = _objectList.Append())
+		{
+			matObj.mat->SetLink(pMat);
+			matObj.matDirty = pMat->GetDirty(DIRTYFLAGS::DATA);
+		}
+	}
+}
+
+Bool Raytracer::UpdateObjects(Bool *rebuildScene)
+{
+	Bool objectChanged = false;
+	std::vector<int> movedObjects;
+	for (auto& obj : _objectList)
+	{
+		BaseObject* pObj = (BaseObject * )obj.obj->GetLink(GetActiveDocument());
+		if (pObj)
+		{ 
+			UInt32 d = pObj->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
+			if (d != obj.dirty)
+			{
+				obj.dirty = d;
+
+				Matrix mg = pObj->GetMg();
+				Vector pos = mg.off * 0.01;
+
+				if (pObj->GetType() == Osphere)
+				{
+					BaseContainer* bc = pObj->GetDataInstance();
+					Float radius = bc->GetFloat(PRIM_SPHERE_RAD) * 0.01;
+
+					std::shared_ptr<sphere> spherePtr = std::static_pointer_cast<sphere>(obj.renderObject);
+					if (spherePtr)
+					{
+						spherePtr->radius = radius;
+						spherePtr->center = vec3(pos.x, pos.y, -pos.z);
+						objectChanged = true;
+						movedObjects.push_back(obj.worldIndex);
+					}
+				}
+				else if (pObj->GetType() == Ocube)
+				{
+					BaseContainer* bc = pObj->GetDataInstance();
+					Vector len = bc->GetVector(PRIM_CUBE_LEN) * 0.01 * 0.5;
+
+					std::shared_ptr<oriented_box> boxPtr = std::static_pointer_cast<oriented_box>(obj.renderObject);
+					if (boxPtr && boxPtr->set_transform(GetRenderTransform(mg), vec3(len.x, len.y, len.z)))
+					{
+						movedObjects.push_back(obj.worldIndex);
+					}
+					else
+					{
+						*rebuildScene = true;
+					}
+
+					objectChanged = true;
+				}
+				else if (pObj->GetType() == Oplane)
+				{
+					objectChanged = true;
+					*rebuildScene = true;
+				}
+				else if (pObj->GetType() == Ocylinder)
+				{
+					objectChanged = true;
+					*rebuildScene = true;
+				}
+				else if (pObj->GetInfo() & OBJECT_POLYGONOBJECT)
+				{
+					objectChanged = true;
+					*rebuildScene = true;
+				}
+			}
+		}
+
+		BaseObject* original = (BaseObject*)obj.original->GetLink(GetActiveDocument());
+		if (original)
+		{
+			UInt32 d = original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE);
+			if (d != obj.originalDirty)
+			{
+				obj.originalDirty = d;
 
 				// Need to flush all generated objects and parse the scene
 				if (rebuildScene)
@@ -824,9 +1217,51 @@ Bool Raytracer::UpdateObjects(Bool *rebuildScene)
 			}
 		}
 	}
+
+	// Spheres and cubes are patched in place, so only their leaves and the nodes above them need new boxes.
+	// The tree is only rebuilt once the refits have made it noticeably worse to traverse.
+	if (!movedObjects.empty() && !(rebuildScene && *rebuildScene))
+	{
+		if (!_worldBVH.refit(movedObjects))
+		{
+			JobTaskRunner runner;
+			_worldBVH.build(_world.objects, &runner);
+		}
+
+		// The light tree is small next to the scene, it is simply built again
+		_lights.gather(_world.objects);
+	}
+
 	return objectChanged;
 }
 
+// Same dirty checks as UpdateObjects, without touching the scene, so it is safe to call while
+// the progressive workers are tracing.
+Bool Raytracer::ObjectsDirty()
+{
+	for (auto& obj : _objectList)
+	{
+		BaseObject* pObj = (BaseObject*)obj.obj->GetLink(GetActiveDocument());
+		if (pObj && pObj->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA) != obj.dirty)
+		{
+			return true;
+		}
+
+		BaseObject* original = (BaseObject*)obj.original->GetLink(GetActiveDocument());
+		if (original && original->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA | DIRTYFLAGS::CACHE) != obj.originalDirty)
+		{
+			return true;
+		}
+
+		BaseMaterial* pMat = (BaseMaterial*)obj.mat->GetLink(GetActiveDocument());
+		if (pMat && pMat->GetDirty(DIRTYFLAGS::DATA) != obj.matDirty)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 void Raytracer::SetupCamera()
 {
 	if (_imageWidth == 0)
@@ -944,47 +1379,23 @@ TiledImage* Raytracer::GetTiledImage()
 Bool Raytracer::Raytrace(maxon::JobRef job)
 {
 	Int32 startTime = GeGetTimer();
+	std::unique_ptr<sampler> rng = CreateSampler();
+	std::vector<color> row(_imageWidth);
+	_sampleTotal = 0;
+	PrepareDenoise();
 
 	for (int j = _imageHeight - 1; j >= 0; --j) 
 	{
 		StatusSetBar(Int32((Float(j) / Float(_imageHeight)) * 100));
 		for (int i = 0; i < _imageWidth; ++i) 
 		{
-			color pixel_color(0, 0, 0);
-			for (int s = 0; s < _samplesPerPixel; ++s) 
+			if (!RaytracePixel(job, *rng, i, j, row[i]))
 			{
-				if (job) 
-				{
-					if (job.IsCancelled()) 
-					{
-						return true;
-					}
-				}
-
-				if (_videopostThread && _videopostThread->TestBreak())
-				{
-					if (job)
-					{
-						if (job.GetJobGroup())
-						{
-							job.GetJobGroup()->Cancel();
-						}
-						job.Cancel();
-					}
-					return true;
-				}
-
-				auto u = (i + random_double()) / (_imageWidth - 1);
-				auto v = (j + random_double()) / (_imageHeight - 1);
-				ray r = _cam.get_ray(u, v);
-				pixel_color += ray_color(r, _background, _useDomeBackground, _world, _maxDepth);
+				return true;
 			}
-			write_color(i, _imageHeight - j - 1, _image, pixel_color, _samplesPerPixel, _videopostBuffer);
-		}
-		if (_area)
-		{
-			_area->Redraw(true);
 		}
+		write_row(0, _imageHeight - j - 1, _imageWidth, row.data(), 1, _image, _videopostBuffer);
+		RequestRedraw();
 	}
 
 	Int32 endTime = GeGetTimer();
@@ -992,74 +1403,176 @@ Bool Raytracer::Raytrace(maxon::JobRef job)
 	GeConsoleOut("Width: " + String::IntToString(_imageWidth));
 	GeConsoleOut("Height: " + String::IntToString(_imageHeight));
 	GeConsoleOut("RenderTime: " + String::IntToString(renderTime));
+	PrintSampleStats();
+
+	if (_denoise)
+	{
+		Int32 denoiseTime = DenoiseImage(_beauty.data(), _features.data(), nullptr);
+		GeConsoleOut("Denoise: " + String::IntToString(denoiseTime) + " ms");
+	}
+	RequestRedraw(true);
 
 	StatusClear();
 	return true;
 }
 
-Bool Raytracer::RaytraceTile(maxon::JobRef job, Int32 tileIndex)
+Bool Raytracer::TestBreak(maxon::JobRef job)
 {
-	Tile* tile = _image->GetTile(tileIndex);
-	if (!tile)
-		return false;
+	if (job)
+	{
+		if (job.IsCancelled())
+		{
+			return true;
+		}
+	}
 
-	Int32 tileSizeX = _image->GetNumTilesX();
-	Int32 xTile = tileIndex % tileSizeX;
-	Int32 yTile = tileIndex / tileSizeX;
-	Int32 xOff = xTile * TILESIZE;
-	Int32 yOff = yTile * TILESIZE;
+	if (_videopostThread && _videopostThread->TestBreak())
+	{
+		if (job)
+		{
+			if (job.GetJobGroup())
+			{
+				job.GetJobGroup()->Cancel();
+			}
+			job.Cancel();
+		}
+		return true;
+	}
+	return false;
+}
 
-	Int32 maxY = maxon::ClampValue(yOff + TILESIZE, 0, _imageHeight);
-	Int32 maxX = maxon::ClampValue(xOff + TILESIZE, 0, _imageWidth);
+// Rows finish on many threads at once, the view is redrawn at most at the display rate.
+void Raytracer::RequestRedraw(Bool force)
+{
+	if (!_area)
+		return;
 
-	Int32 startTime = GeGetTimer();
-	for (Int32 j = yOff; j < maxY; j++)
+	const Int32 redrawInterval = 33;
+
+	Int32 now = GeGetTimer();
+	Int32 last = _lastRedraw;
+	if (!force && (now - last < redrawInterval || !_lastRedraw.compare_exchange_strong(last, now)))
+		return;
+
+	_lastRedraw = now;
+	_area->Redraw(true);
+}
+
+// Traces the samples of one pixel and returns their average. In adaptive mode the pixel stops
+// as soon as the error of its estimate drops below the noise threshold. With denoising on, the
+// average and the first hit features are also kept for the denoiser.
+Bool Raytracer::RaytracePixel(maxon::JobRef job, sampler& rng, Int32 i, Int32 j, color& pixel_color)
+{
+	Int32 samples = _adaptive.enabled ? _adaptive.max_samples : _samplesPerPixel;
+	pixel_estimate estimate;
+	pixel_features firstHits;
+	pixel_features* features = _denoise ? &firstHits : nullptr;
+	for (Int32 s = 0; s < samples; ++s)
 	{
-		for (Int32 i = xOff; i < maxX + TILESIZE; ++i)
+		if (TestBreak(job))
 		{
-			color pixel_color(0, 0, 0);
-			for (int s = 0; s < _samplesPerPixel; ++s) 
-			{
-				if (job) 
-				{
-					if (job.IsCancelled()) 
-					{
-						return true;
-					}
-				}
+			return false;
+		}
 
-				if (_videopostThread && _videopostThread->TestBreak())
-				{
-					if (job)
-					{
-						if (job.GetJobGroup())
-						{
-							job.GetJobGroup()->Cancel();
-						}
-						job.Cancel();
-					}
-					return true;
-				}
+		rng.start(UInt32(j * _imageWidth + i), UInt32(s));
+		double du, dv;
+		rng.next_2d(du, dv);
+		auto u = (i + du) / (_imageWidth - 1);
+		auto v = (j + dv) / (_imageHeight - 1);
+		ray r = _cam.get_ray(u, v, rng);
+		estimate.add(ray_color(r, _background, _useDomeBackground, _worldBVH, _lights, _environment.get(), _maxDepth, rng, features));
 
-				auto u = (i + random_double()) / (_imageWidth - 1);
-				auto v = (j + random_double()) / (_imageHeight - 1);
-				ray r = _cam.get_ray(u, v);
-				pixel_color += ray_color(r, _background, _useDomeBackground, _world, _maxDepth);
-			}
-			write_color(i, _imageHeight - j - 1, _image, pixel_color, _samplesPerPixel, _videopostBuffer);
+		if (_adaptive.converged(estimate.count, estimate.display_error()))
+		{
+			break;
 		}
+	}
+
+	_sampleTotal += estimate.count;
+	pixel_color = estimate.average();
+
+	if (features)
+	{
+		Int32 index = j * _imageWidth + i;
+		_beauty[index] = pixel_color;
+		_features[index] = firstHits / estimate.count;
+	}
+	return true;
+}
+
+Bool Raytracer::RaytraceRow(maxon::JobRef job, sampler& rng, Int32 j, Int32 x0, Int32 x1)
+{
+	// Finished pixels are collected and written a span at a time
+	color pixels[TILESIZE];
+	Int32 count = 0;
 
-		if (_area)
+	for (Int32 i = x0; i < x1; ++i)
+	{
+		if (!RaytracePixel(job, rng, i, j, pixels[count++]))
 		{
-			_area->Redraw(true);
+			return false;
 		}
+
+		if (count == TILESIZE || i == x1 - 1)
+		{
+			write_row(i - count + 1, _imageHeight - j - 1, count, pixels, 1, _image, _videopostBuffer);
+			count = 0;
+		}
+	}
+
+	RequestRedraw();
+	return true;
+}
+
+void Raytracer::PrintSampleStats()
+{
+	Float average = Float(_sampleTotal) / Float(maxon::Max(_imageWidth * _imageHeight, Int32(1)));
+	if (_adaptive.enabled)
+	{
+		GeConsoleOut("Adaptive: " + String::FloatToString(average, -1, 1) + " samples per pixel on average, min " + String::IntToString(_adaptive.min_samples)
+			+ " max " + String::IntToString(_adaptive.max_samples) + " threshold " + String::FloatToString(_adaptive.noise_threshold, -1, 4));
+	}
+}
+
+Bool Raytracer::RaytraceTiles(maxon::JobRef job)
+{
+	Int32 startTime = GeGetTimer();
+	_sampleTotal = 0;
+	PrepareDenoise();
+
+	JobTaskRunner runner;
+	std::vector<std::unique_ptr<sampler>> samplers;
+	for (Int32 i = 0; i < runner.thread_count(); i++)
+	{
+		samplers.push_back(CreateSampler());
 	}
 
+	Bool finished = _scheduler.run(_imageWidth, _imageHeight, TILESIZE, runner, [this, job, &samplers](int worker, int y, int x0, int x1)
+	{
+		return RaytraceRow(job, *samplers[worker], y, x0, x1);
+	});
+
 	Int32 endTime = GeGetTimer();
 	Int32 renderTime = endTime - startTime;
 	GeConsoleOut("Width: " + String::IntToString(_imageWidth));
 	GeConsoleOut("Height: " + String::IntToString(_imageHeight));
 	GeConsoleOut("RenderTime: " + String::IntToString(renderTime));
+	PrintSampleStats();
+
+	if (finished)
+	{
+		const tile_scheduler_stats& stats = _scheduler.stats();
+		GeConsoleOut("Tiles: Workers: " + String::IntToString(stats.workers) + " Utilisation: " + String::FloatToString(stats.utilisation() * 100.0) + "%"
+			+ " Buckets: " + String::IntToString(stats.buckets) + " Steals: " + String::IntToString(stats.steals) + " Splits: " + String::IntToString(stats.splits)
+			+ " Tail: " + String::FloatToString(stats.tail_ms) + " ms");
+
+		if (_denoise)
+		{
+			Int32 denoiseTime = DenoiseImage(_beauty.data(), _features.data(), &runner);
+			GeConsoleOut("Denoise: " + String::IntToString(denoiseTime) + " ms");
+		}
+	}
+	RequestRedraw(true);
 
 	StatusClear();
 	return true;
@@ -1068,6 +1581,7 @@ Bool Raytracer::RaytraceTile(maxon::JobRef job, Int32 tileIndex)
 Bool Raytracer::RaytraceProgressive(maxon::JobRef job)
 {
 	Int32 startTime = GeGetTimer();
+	std::unique_ptr<sampler> rng = CreateSampler();
 
 	finally
 	{
@@ -1095,6 +1609,8 @@ Bool Raytracer::RaytraceProgressive(maxon::JobRef job)
 	}
 
 
+	PrepareDenoise();
+
 	Bool restart = false;
 	Int32 samplesPerPixel = 0;
 	while (true)
@@ -1166,10 +1682,14 @@ Bool Raytracer::RaytraceProgressive(maxon::JobRef job)
 					return true;
 				}
 
-				auto u = (i + random_double()) / (_imageWidth - 1);
-				auto v = (j + random_double()) / (_imageHeight - 1);
-				ray r = _cam.get_ray(u, v);
-				_progressiveSamples[j * _imageWidth + i] += ray_color(r, _background, _useDomeBackground, _world, _maxDepth);
+				rng->start(UInt32(j * _imageWidth + i), UInt32(samplesPerPixel - 1));
+				double du, dv;
+				rng->next_2d(du, dv);
+				auto u = (i + du) / (_imageWidth - 1);
+				auto v = (j + dv) / (_imageHeight - 1);
+				ray r = _cam.get_ray(u, v, *rng);
+				pixel_features* features = _denoise ? &_features[j * _imageWidth + i] : nullptr;
+				_progressiveSamples[j * _imageWidth + i] += ray_color(r, _background, _useDomeBackground, _worldBVH, _lights, _environment.get(), _maxDepth, *rng, features);
 			}
 
 			if (restart)
@@ -1177,130 +1697,358 @@ Bool Raytracer::RaytraceProgressive(maxon::JobRef job)
 				break;
 			}
 
-			for (int i = 0; i < _imageWidth; ++i)
+			// Once a pass has been denoised, noisy rows would only flicker through it
+			if (!_denoise || samplesPerPixel == 1)
 			{
-				if (job)
-				{
-					if (job.IsCancelled())
-					{
-						return true;
-					}
-				}
-				const color& pixel_color = _progressiveSamples[j * _imageWidth + i];
-				write_color(i, _imageHeight - j - 1, _image, pixel_color, samplesPerPixel, _videopostBuffer);
+				write_row(0, _imageHeight - j - 1, _imageWidth, _progressiveSamples + j * _imageWidth, samplesPerPixel, _image, _videopostBuffer);
 			}
 
-			if (_area)
+			RequestRedraw();
+		}
+
+		// Every pixel has the same sample count after a full pass, so the sums only need dividing
+		if (!restart && _denoise)
+		{
+			size_t count = size_t(_imageWidth) * size_t(_imageHeight);
+			std::vector<pixel_features> features(count);
+			for (size_t index = 0; index < count; index++)
 			{
-				_area->Redraw(true);
+				_beauty[index] = _progressiveSamples[index] / Float(samplesPerPixel);
+				features[index] = _features[index] / Float(samplesPerPixel);
 			}
+
+			DenoiseImage(_beauty.data(), features.data(), nullptr);
+			RequestRedraw();
 		}
 	}
 	return true;
 }
 
-void Raytracer::SetProgressiveSampleCount(Int32 samples)
+// Bands are numbered row by row like the tiles, each one a tile wide and _bandHeight rows high.
+void Raytracer::GetProgressiveBand(Int32 band, Int32& xOff, Int32& yOff, Int32& maxX, Int32& maxY) const
 {
-	_progressiveSampleCount = samples;
+	Int32 tileSizeX = _image->GetNumTilesX();
+	xOff = (band % tileSizeX) * TILESIZE;
+	yOff = (band / tileSizeX) * _bandHeight;
+	maxX = maxon::ClampValue(xOff + TILESIZE, 0, _imageWidth);
+	maxY = maxon::ClampValue(yOff + _bandHeight, 0, _imageHeight);
 }
 
-Bool Raytracer::RaytraceProgressiveTile(maxon::JobRef job, Int32 tileIndex)
+Bool Raytracer::RaytraceProgressiveBand(maxon::JobRef job, sampler& rng, Int32 band)
 {
-	Tile* tile = _image->GetTile(tileIndex);
-	if (!tile)
-		return false;
+	Int32 xOff, yOff, maxX, maxY;
+	GetProgressiveBand(band, xOff, yOff, maxX, maxY);
 
-	UInt32 cameraDirty = 0;
-	MAXON_SCOPE
+	Int32 sampleIndex = _bandSamples[band];
+	for (Int32 j = yOff; j < maxY; j++)
 	{
-		BaseObject * pCamera = GetCamera();
-		if (pCamera)
+		if (_pauseWorkers || _stopWorkers)
 		{
-			cameraDirty = pCamera->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
+			return false;
 		}
-	}
 
-	Int32 tileSizeX = _image->GetNumTilesX();
-	Int32 xTile = tileIndex % tileSizeX;
-	Int32 yTile = tileIndex / tileSizeX;
-	Int32 xOff = xTile * TILESIZE;
-	Int32 yOff = yTile * TILESIZE;
+		for (Int32 i = xOff; i < maxX; ++i)
+		{
+			if (TestBreak(job))
+			{
+				return false;
+			}
 
-	Int32 maxY = maxon::ClampValue(yOff + TILESIZE, 0, _imageHeight);
-	Int32 maxX = maxon::ClampValue(xOff + TILESIZE, 0, _imageWidth);
+			rng.start(UInt32(j * _imageWidth + i), UInt32(sampleIndex));
+			double du, dv;
+			rng.next_2d(du, dv);
+			auto u = (i + du) / (_imageWidth - 1);
+			auto v = (j + dv) / (_imageHeight - 1);
+			ray r = _cam.get_ray(u, v, rng);
+			pixel_features* features = _denoise ? &_features[j * _imageWidth + i] : nullptr;
+			_progressiveSamples[j * _imageWidth + i] += ray_color(r, _background, _useDomeBackground, _worldBVH, _lights, _environment.get(), _maxDepth, rng, features);
+		}
 
-	BaseTime time = _doc->GetTime();
+		// The denoised image is written by the controller, noisy rows would only flicker through it
+		if (!_denoise)
+		{
+			write_row(xOff, _imageHeight - j - 1, maxX - xOff, _progressiveSamples + j * _imageWidth + xOff, sampleIndex + 1, _image, _videopostBuffer);
+		}
+		_progressiveSampleTotal += maxX - xOff;
+	}
 
-	for (Int32 j = yOff; j < maxY; j++)
+	_bandSamples[band] = sampleIndex + 1;
+	return true;
+}
+
+void Raytracer::ProgressiveWorker(maxon::JobRef job)
+{
+	// Counted before anything else, so a worker that starts late still parks when asked to
+	_runningWorkers++;
+	std::unique_ptr<sampler> rng = CreateSampler();
+
+	while (!_stopWorkers)
 	{
-		for (Int32 i = xOff; i < maxX; ++i)
+		if (_pauseWorkers)
 		{
-			BaseObject* pCamera = GetCamera();
-			if (pCamera)
+			_parkedWorkers++;
+			while (_pauseWorkers && !_stopWorkers)
 			{
-				UInt32 dirty = pCamera->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
-				if (dirty != cameraDirty)
-				{
-					return true;
-				}
+				GeSleep(1);
 			}
+			_parkedWorkers--;
+			continue;
+		}
 
-			if (time != _doc->GetTime())
-			{
-				return true;
-			}
+		// Bands are taken round robin and one another worker is still busy with is skipped. There
+		// are at least as many bands as workers, so the next free one is only a few steps away.
+		Int32 band = Int32(_nextBand++ % UInt32(_numBands));
+		if (_bandBusy[band].exchange(true))
+		{
+			continue;
+		}
 
-			if (job)
-			{
-				if (job.IsCancelled())
-				{
-					return true;
-				}
-			}
+		Bool finished = RaytraceProgressiveBand(job, *rng, band);
+		_bandBusy[band] = false;
+
+		if (!finished && !_pauseWorkers)
+		{
+			_stopWorkers = true;
+		}
+	}
+
+	_runningWorkers--;
+}
+
+void Raytracer::PauseWorkers()
+{
+	_pauseWorkers = true;
+	while (_parkedWorkers < _runningWorkers)
+	{
+		GeSleep(1);
+	}
+}
+
+static maxon::Result<maxon::JobGroupRef> StartWorkerJobs(Int32 count, const std::function<void()>& worker)
+{
+	iferr_scope;
+
+	maxon::JobGroupRef group = maxon::JobGroupRef::Create() iferr_return;
+	for (Int32 i = 0; i < count; i++)
+	{
+		group.Add(worker) iferr_return;
+	}
+
+	group.Enqueue();
+	return group;
+}
+
+// Workers sample tiles continuously. This thread only watches the scene for changes, parks
+// the workers while the scene and camera are updated, and refreshes the display and status.
+Bool Raytracer::RaytraceProgressiveWorkers(maxon::JobRef job)
+{
+	const Int32 refreshInterval = 30;
+
+	Int32 numTilesX = _image->GetNumTilesX();
+	if (_image->GetNumTiles() == 0)
+		return false;
+
+	// Bands get shorter until there are two per worker, as the tiled renders hand out rows, so a
+	// small view keeps every core busy. Should the image have fewer rows than that, the surplus
+	// workers are not started rather than left spinning on bands that are all taken.
+	Int32 workerCount = GeGetCurrentThreadCount();
+	_bandHeight = maxon::ClampValue(numTilesX * _imageHeight / maxon::Max(2 * workerCount, Int32(1)), Int32(1), Int32(TILESIZE));
+	_numBands = numTilesX * ((_imageHeight + _bandHeight - 1) / _bandHeight);
+	workerCount = maxon::ClampValue(workerCount, Int32(1), _numBands);
+
+	_bandSamples.assign(_numBands, 0);
+	_bandBusy.reset(new std::atomic<Bool>[_numBands]);
+	for (Int32 i = 0; i < _numBands; i++)
+	{
+		_bandBusy[i] = false;
+	}
+	_stopWorkers = false;
+	_pauseWorkers = false;
+	_parkedWorkers = 0;
+	_nextBand = 0;
+	_progressiveSampleTotal = 0;
+	PrepareDenoise();
+
+	UInt32 cameraDirty = 0;
+	BaseObject* pCamera = GetCamera();
+	if (pCamera)
+	{
+		cameraDirty = pCamera->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
+	}
+	BaseTime time = _doc->GetTime();
+
+	maxon::JobGroupRef workers;
+	iferr (workers = StartWorkerJobs(workerCount, [this, job]() { ProgressiveWorker(job); }))
+	{
+		return false;
+	}
+
+	Int32 startTime = GeGetTimer();
+	Int32 rateTime = startTime;
+	Int64 rateSamples = 0;
+	Float samplesPerSecond = 0.0;
+	Int32 denoiseTime = startTime;
+	Int32 denoiseInterval = 250;
+
+	while (!job.IsCancelled() && !_stopWorkers)
+	{
+		Bool restart = ObjectsDirty();
 
-			if (_videopostThread && _videopostThread->TestBreak())
+		pCamera = GetCamera();
+		if (pCamera)
+		{
+			UInt32 dirty = pCamera->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
+			if (dirty != cameraDirty)
 			{
-				if (job)
-				{
-					if (job.GetJobGroup())
-					{
-						job.GetJobGroup()->Cancel();
-					}
-					job.Cancel();
-				}
-				return true;
+				cameraDirty = dirty;
+				restart = true;
 			}
+		}
 
-			auto u = (i + random_double()) / (_imageWidth - 1);
-			auto v = (j + random_double()) / (_imageHeight - 1);
-			ray r = _cam.get_ray(u, v);
-			_progressiveSamples[j * _imageWidth + i] += ray_color(r, _background, _useDomeBackground, _world, _maxDepth);
+		if (time != _doc->GetTime())
+		{
+			time = _doc->GetTime();
+			restart = true;
 		}
 
-		for (int i = xOff; i < maxX; ++i)
+		if (restart)
 		{
-			if (job)
+			PauseWorkers();
+
+			Bool rebuildScene = false;
+			UpdateObjects(&rebuildScene);
+			if (rebuildScene)
 			{
-				if (job.IsCancelled())
-				{
-					return true;
-				}
+				SetupScene();
 			}
-			const color& pixel_color = _progressiveSamples[j * _imageWidth + i];
-			write_color(i, _imageHeight - j - 1, _image, pixel_color, _progressiveSampleCount, _videopostBuffer);
+
+			SetupCamera();
+			ClearSamples();
+			_bandSamples.assign(_numBands, 0);
+			_nextBand = 0;
+			_progressiveSampleTotal = 0;
+			rateSamples = 0;
+			rateTime = GeGetTimer();
+
+			_pauseWorkers = false;
+		}
+
+		Int64 sampleTotal = _progressiveSampleTotal;
+		Int32 now = GeGetTimer();
+		if (now - rateTime >= 500)
+		{
+			samplesPerSecond = Float(sampleTotal - rateSamples) * 1000.0 / Float(now - rateTime);
+			rateSamples = sampleTotal;
+			rateTime = now;
 		}
-		if (_area)
+
+		Float sampleCount = Float(sampleTotal) / Float(_imageWidth * _imageHeight);
+		StatusSetText("Sample Count: " + String::FloatToString(sampleCount, -1, 1) + " Samples/s: " + String::FloatToString(samplesPerSecond / 1000000.0, -1, 2) + "M");
+
+		// The denoiser runs on this thread while the workers keep every core busy, so it is given
+		// at most a fifth of the time and the interval grows with the cost of a pass.
+		if (_denoise && now - denoiseTime >= denoiseInterval)
 		{
-			_area->Redraw(true);
+			DenoiseProgressive();
+			denoiseTime = GeGetTimer();
+			denoiseInterval = maxon::Max(Int32(250), (denoiseTime - now) * 4);
 		}
+
+		RequestRedraw(true);
+
+		GeSleep(refreshInterval);
 	}
 
+	_stopWorkers = true;
+	workers.Wait();
+
+	RequestRedraw(true);
+
+	Int32 endTime = GeGetTimer();
+	Int32 renderTime = endTime - startTime;
+	GeConsoleOut("RenderTime: " + String::IntToString(renderTime));
+
 	return true;
 }
 
+const tile_scheduler_stats& Raytracer::GetSchedulerStats() const
+{
+	return _scheduler.stats();
+}
+
 void Raytracer::ClearSamples()
 {
 	ClearMemType<color>(_progressiveSamples, _imageWidth * _imageHeight);
+	std::fill(_features.begin(), _features.end(), pixel_features());
+}
+
+void Raytracer::PrepareDenoise()
+{
+	if (!_denoise)
+	{
+		_beauty.clear();
+		_features.clear();
+		return;
+	}
+
+	size_t count = size_t(_imageWidth) * size_t(_imageHeight);
+	_beauty.assign(count, color(0, 0, 0));
+	_features.assign(count, pixel_features());
+}
+
+// Filters the averaged pixels and replaces the image with the result, returns the time taken in
+// milliseconds. Buffers are indexed like the samples, row 0 at the bottom.
+Int32 Raytracer::DenoiseImage(const color* colors, const pixel_features* features, bvh_task_runner* runner)
+{
+	Int32 startTime = GeGetTimer();
+
+	std::vector<color> denoised(size_t(_imageWidth) * size_t(_imageHeight));
+	atrous_denoiser denoiser(_denoiseSettings);
+	denoiser.run(_imageWidth, _imageHeight, colors, features, denoised.data(), runner);
+
+	for (Int32 j = 0; j < _imageHeight; ++j)
+	{
+		write_row(0, _imageHeight - j - 1, _imageWidth, denoised.data() + j * _imageWidth, 1, _image, _videopostBuffer);
+	}
+
+	return GeGetTimer() - startTime;
+}
+
+// Averages the progressive samples for the denoiser. Each band is claimed like a worker would
+// claim it, so its sums and its sample count belong together.
+void Raytracer::DenoiseProgressive()
+{
+	size_t count = size_t(_imageWidth) * size_t(_imageHeight);
+	_beauty.assign(count, color(0, 0, 0));
+	std::vector<pixel_features> features(count);
+
+	for (Int32 band = 0; band < _numBands; band++)
+	{
+		while (_bandBusy[band].exchange(true))
+		{
+			std::this_thread::yield();
+		}
+
+		Int32 samples = _bandSamples[band];
+		if (samples > 0)
+		{
+			Int32 xOff, yOff, maxX, maxY;
+			GetProgressiveBand(band, xOff, yOff, maxX, maxY);
+			for (Int32 j = yOff; j < maxY; j++)
+			{
+				for (Int32 i = xOff; i < maxX; i++)
+				{
+					Int32 index = j * _imageWidth + i;
+					_beauty[index] = _progressiveSamples[index] / Float(samples);
+					features[index] = _features[index] / Float(samples);
+				}
+			}
+		}
+
+		_bandBusy[band] = false;
+	}
+
+	DenoiseImage(_beauty.data(), features.data(), nullptr);
 }
 
 void Raytracer::SetVideoPost(VPBuffer* buffer, BaseThread* pThread, Bool mainViewport)
@@ -1323,4 +2071,97 @@ void Raytracer::SetSamplesPerPixel(Int32 samples)
 void Raytracer::SetMaxDepth(Int32 maxDepth)
 {
 	_maxDepth = maxDepth;
+}
+
+void Raytracer::SetSeed(UInt32 seed)
+{
+	_seed = seed;
+}
+
+void Raytracer::SetAdaptive(const adaptive_settings& adaptive)
+{
+	_adaptive = adaptive;
+	_adaptive.min_samples = maxon::Max(_adaptive.min_samples, 2);
+	_adaptive.max_samples = maxon::Max(_adaptive.max_samples, _adaptive.min_samples);
+}
+
+void Raytracer::SetDenoise(Bool denoise, Int32 iterations)
+{
+	_denoise = denoise;
+	_denoiseSettings.iterations = maxon::ClampValue(iterations, Int32(1), Int32(8));
+}
+
+void Raytracer::SetCompressedBVH(Bool compressed)
+{
+	_compressedBVH = compressed;
+}
+
+void Raytracer::SetBVHBuilder(BVHBUILDER builder, Int32 rotationPasses)
+{
+	_bvhBuilder = builder;
+	_bvhRotations = maxon::Max(rotationPasses, Int32(0));
+}
+
+void Raytracer::SetSpatialSplits(Bool spatial, Float budget)
+{
+	_spatialSplits = spatial;
+	_spatialBudget = maxon::Max(budget, 0.0);
+}
+
+void Raytracer::ConfigureTree(bvh_tree& tree) const
+{
+	tree.quantized = _compressedBVH;
+	tree.linear = _bvhBuilder == BVHBUILDER::LINEAR;
+	tree.rotation_passes = _bvhRotations;
+	tree.spatial = _spatialSplits;
+	tree.spatial_budget = _spatialBudget;
+}
+
+// Traces a coarse grid of camera rays and prints how many wide nodes and primitives each one
+// visits, the measure to compare tree settings by on the same scene and view.
+void Raytracer::PrintTraversalStats()
+{
+	const Int32 columns = maxon::Min(_imageWidth, Int32(128));
+	const Int32 rows = maxon::Max(Int32(1), columns * _imageHeight / maxon::Max(_imageWidth, Int32(1)));
+
+	std::unique_ptr<sampler> rng = CreateSampler();
+	bvh_traversal_stats traversal;
+	for (Int32 j = 0; j < rows; j++)
+	{
+		for (Int32 i = 0; i < columns; i++)
+		{
+			rng->start(UInt32(j * columns + i), 0);
+			ray r = _cam.get_ray((i + 0.5) / columns, (j + 0.5) / rows, *rng);
+			hit_record rec;
+			_worldBVH.hit(r, 0.001, infinity, rec, &traversal);
+		}
+	}
+
+	if (traversal.rays > 0)
+	{
+		GeConsoleOut("BVH Traversal: " + String::FloatToString(Float(traversal.nodes) / Float(traversal.rays)) + " nodes, "
+			+ String::FloatToString(Float(traversal.primitives) / Float(traversal.rays)) + " primitives per camera ray");
+	}
+}
+
+void Raytracer::SetEnvironment(std::shared_ptr<const environment_light> environment)
+{
+	_environment = environment;
+}
+
+void Raytracer::SetSampler(SAMPLER samplerType)
+{
+	_samplerType = samplerType;
+}
+
+std::unique_ptr<sampler> Raytracer::CreateSampler() const
+{
+	switch (_samplerType)
+	{
+	case SAMPLER::RANDOM:
+		return std::unique_ptr<sampler>(new random_sampler(_seed));
+	default:
+	case SAMPLER::SOBOL:
+		return std::unique_ptr<sampler>(new sobol_sampler(_seed));
+	}
 }
\ No newline at end of file
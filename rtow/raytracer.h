@@ -7,9 +7,19 @@
 #include "camera.h"
 #include "hittable_list.h"
 #include "sphere.h"
+#include "bvh.h"
+#include "tile_scheduler.h"
+#include "adaptive.h"
+#include "denoise.h"
+#include "lights.h"
+#include "environment.h"
 
 #include "tiledimage.h"
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #define TILEZIE 64
 
 enum class RENDERMODE
@@ -20,6 +30,19 @@ enum class RENDERMODE
 	MULTITHREADEDPROGRESSIVE,
 };
 
+enum class SAMPLER
+{
+	RANDOM,
+	SOBOL,
+};
+
+// Binned SAH for the best trees, Morton codes when the build has to be fast
+enum class BVHBUILDER
+{
+	SAH,
+	LINEAR,
+};
+
 struct DirtyObject
 {
 	AutoAlloc<BaseLink> obj;
@@ -28,12 +51,30 @@ struct DirtyObject
 	UInt32 dirty;
 	UInt32 originalDirty;
 	UInt32 matDirty;
+	Int32 worldIndex = -1;
 	std::shared_ptr<hittable> renderObject;
 	std::shared_ptr<material> renderMat;
 };
 
 typedef maxon::PointerArray<DirtyObject> DirtyObjectList;
 
+// Runs BVH build tasks on the maxon job system. At most threadCount jobs are started and each
+// one keeps pulling tasks until the list is empty, which also lets the benchmark limit the thread count.
+class JobTaskRunner : public bvh_task_runner
+{
+public:
+	explicit JobTaskRunner(Int32 threadCount = 0);
+
+	virtual int thread_count() const override;
+	virtual void run(std::vector<std::function<void()>>& tasks) override;
+
+private:
+	Int32 _threadCount;
+};
+
+void RunBVHBenchmark();
+void RunTraceBenchmark();
+
 class TiledImage;
 class Raytracer
 {
@@ -51,6 +92,8 @@ public:
 	void AddCube(BaseObject* pObj, BaseObject* original);
 	void AddPlane(BaseObject* pObj, BaseObject* original);
 	void AddCylinder(BaseObject* pObj, BaseObject* original);
+	void AddPolygonObject(BaseObject* pObj, BaseObject* original);
+	void AddInstances(BaseObject* pObj, BaseObject* original, Bool processChildren);
 
 	void DoRecursionCacheAdd(BaseObject* op, BaseObject* original, Bool processChildren = true);
 
@@ -58,13 +101,15 @@ public:
 	void SetVideoPost(VPBuffer* buffer, BaseThread* pThread, Bool mainViewport);
 
 	Bool Raytrace(maxon::JobRef job);
-	Bool RaytraceTile(maxon::JobRef job, Int32 tileIndex);
+	Bool RaytraceTiles(maxon::JobRef job);
 	Bool RaytraceProgressive(maxon::JobRef job);
-	Bool RaytraceProgressiveTile(maxon::JobRef job, Int32 tileIndex);
+	Bool RaytraceProgressiveWorkers(maxon::JobRef job);
+
+	// Utilisation of the workers in the last tiled render
+	const tile_scheduler_stats& GetSchedulerStats() const;
 
 	TiledImage* GetTiledImage();
 
-	void SetProgressiveSampleCount(Int32 samples);
 	void ClearSamples();
 
 	CameraObject* GetCamera();
@@ -72,11 +117,37 @@ public:
 	void SetDocument(BaseDocument* doc);
 	void SetSamplesPerPixel(Int32 samples);
 	void SetMaxDepth(Int32 maxDepth);
+	void SetSeed(UInt32 seed);
+	void SetSampler(SAMPLER samplerType);
+	void SetAdaptive(const adaptive_settings& adaptive);
+	void SetDenoise(Bool denoise, Int32 iterations);
+	void SetEnvironment(std::shared_ptr<const environment_light> environment);
+	void SetCompressedBVH(Bool compressed);
+	void SetBVHBuilder(BVHBUILDER builder, Int32 rotationPasses);
+	void SetSpatialSplits(Bool spatial, Float budget);
 
 	Bool UpdateObjects(Bool* rebuildScene = nullptr);
+	Bool ObjectsDirty();
 private:
+	std::unique_ptr<sampler> CreateSampler() const;
+	Bool TestBreak(maxon::JobRef job);
+	void RequestRedraw(Bool force = false);
+	Bool RaytracePixel(maxon::JobRef job, sampler& rng, Int32 i, Int32 j, color& pixel_color);
+	Bool RaytraceRow(maxon::JobRef job, sampler& rng, Int32 j, Int32 x0, Int32 x1);
+	void PrintSampleStats();
+	void GetProgressiveBand(Int32 band, Int32& xOff, Int32& yOff, Int32& maxX, Int32& maxY) const;
+	Bool RaytraceProgressiveBand(maxon::JobRef job, sampler& rng, Int32 band);
+	void ProgressiveWorker(maxon::JobRef job);
+	void PauseWorkers();
+	void PrepareDenoise();
+	Int32 DenoiseImage(const color* colors, const pixel_features* features, bvh_task_runner* runner);
+	void DenoiseProgressive();
+	void ConfigureTree(bvh_tree& tree) const;
+	void PrintTraversalStats();
+
 	BaseDocument* _doc = nullptr;
 	GeUserArea* _area = nullptr;
+	std::atomic<Int32> _lastRedraw{ 0 };
 	TiledImage* _image = nullptr;
 	maxon::JobRef _job;
 
@@ -84,6 +155,21 @@ private:
 	VPBuffer* _videopostBuffer = nullptr;
 
 	AutoAlloc<BaseLink> _camera;
+	tile_scheduler _scheduler;
+
+	// Persistent progressive workers. The image is cut into bands of rows one tile wide, enough
+	// of them that a worker always finds one free. Every band keeps its own sample count, so a
+	// worker can start the next sample of a band without waiting for the rest of the image.
+	std::atomic<Bool> _stopWorkers{ false };
+	std::atomic<Bool> _pauseWorkers{ false };
+	std::atomic<Int32> _runningWorkers{ 0 };
+	std::atomic<Int32> _parkedWorkers{ 0 };
+	std::atomic<UInt32> _nextBand{ 0 };
+	std::atomic<Int64> _progressiveSampleTotal{ 0 };
+	Int32 _numBands = 0;
+	Int32 _bandHeight = TILESIZE;
+	std::vector<Int32> _bandSamples;
+	std::unique_ptr<std::atomic<Bool>[]> _bandBusy;
 
 	DirtyObjectList _objectList;
 
@@ -93,9 +179,32 @@ private:
 	Int32 _imageHeight;
 	Int32 _samplesPerPixel = 10;
 	Int32 _maxDepth = 50;
+	UInt32 _seed = 0;
+	SAMPLER _samplerType = SAMPLER::SOBOL;
+	adaptive_settings _adaptive;
+	std::atomic<Int64> _sampleTotal{ 0 };
+
+	// Denoising. Final renders keep the averaged pixels and their first hit features, progressive
+	// renders sum the features next to the samples and divide by the tile sample count.
+	Bool _denoise = false;
+	denoise_settings _denoiseSettings;
+	std::vector<color> _beauty;
+	std::vector<pixel_features> _features;
 
 	// World
 	hittable_list _world;
+	bvh _worldBVH;
+	Bool _compressedBVH = false;	// 8 bit child bounds for the world, mesh and instance trees, rebuilt instead of refit, loose beside huge objects
+	BVHBUILDER _bvhBuilder = BVHBUILDER::SAH;
+	Int32 _bvhRotations = 0;	// Tree rotation passes after a linear build
+	Bool _spatialSplits = false;	// SAH builds may reference a primitive from both sides of a split
+	Float _spatialBudget = 0.3;	// Extra references the spatial splits may add, relative to the primitive count
+
+	// Emitting spheres and planes, sampled directly when the dome is off
+	light_list _lights;
+
+	// HDR image replacing the dome, loaded and kept by the caller across renders
+	std::shared_ptr<const environment_light> _environment;
 
 	// Camera
 	point3 _lookfrom = { 13, 2, 3 };
@@ -110,7 +219,6 @@ private:
 	camera _cam;
 
 	color* _progressiveSamples = nullptr;
-	Int32 _progressiveSampleCount = 0;
 
 	Bool _mainViewport = false;
 };
@@ -119,21 +227,19 @@ class TileJob : public maxon::JobInterfaceTemplate<TileJob, maxon::Bool>
 {
 public:
 	TileJob() { };
-	MAXON_IMPLICIT TileJob(Raytracer* tracer, Int32 tileIndex)
+	MAXON_IMPLICIT TileJob(Raytracer* tracer)
 	{
 		_tracer = tracer;
-		_tileIndex = tileIndex;
 	}
 
 	maxon::Result<void> operator ()()
 	{
-		_tracer->RaytraceTile(this, _tileIndex);
+		_tracer->RaytraceTiles(this);
 		return SetResult(std::move(true));
 	}
 
 private:
 	Raytracer* _tracer = nullptr;
-	Int32 _tileIndex;
 };
 
 class SingleThreadJob : public maxon::JobInterfaceTemplate<SingleThreadJob, maxon::Bool>
@@ -174,27 +280,6 @@ private:
 	Raytracer* _tracer = nullptr;
 };
 
-class ProgressiveTileJob : public maxon::JobInterfaceTemplate<ProgressiveTileJob, maxon::Bool>
-{
-public:
-	ProgressiveTileJob() { };
-	MAXON_IMPLICIT ProgressiveTileJob(Raytracer* tracer, Int32 tileIndex)
-	{
-		_tracer = tracer;
-		_tileIndex = tileIndex;
-	}
-
-	maxon::Result<void> operator ()()
-	{
-		_tracer->RaytraceProgressiveTile(this, _tileIndex);
-		return SetResult(std::move(true));
-	}
-
-private:
-	Raytracer* _tracer = nullptr;
-	Int32 _tileIndex;
-};
-
 class ProgressiveJob : public maxon::JobInterfaceTemplate<ProgressiveJob, maxon::Bool>
 {
 public:
@@ -206,81 +291,7 @@ public:
 
 	maxon::Result<void> operator ()()
 	{
-		iferr_scope_handler
-		{
-			return SetResult(std::move(false));
-		};
-
-		UInt32 cameraDirty = 0;
-		MAXON_SCOPE
-		{
-			BaseObject * pCamera = _tracer->GetCamera();
-			if (pCamera)
-			{
-				cameraDirty = pCamera->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
-			}
-		}
-
-		Int32 startTime = GeGetTimer();
-
-		Bool restart = false;
-		Int32 sampleCount = 0;
-		while (!IsCancelled())
-		{
-			Bool rebuildScene = false;
-			restart |= _tracer->UpdateObjects(&rebuildScene);
-
-			if (restart)
-			{
-				sampleCount = 0;
-				restart = false;
-
-				if (rebuildScene)
-				{
-					_tracer->SetupScene();
-				}
-
-				_tracer->SetupCamera();
-				_tracer->ClearSamples();
-			}
-
-			sampleCount++;
-
-			StatusSetText("Sample Count: " + String::IntToString(sampleCount));
-
-			_tracer->SetProgressiveSampleCount(sampleCount);
-			TiledImage* pImage = _tracer->GetTiledImage();
-			if (!pImage)
-				break;
-
-			maxon::JobGroupRef tileJobs = maxon::JobGroupRef::Create() iferr_return;
-
-			Int32 count = pImage->GetNumTiles();
-			for (Int32 i = 0; i < count; i++)
-			{
-				maxon::JobRef job = ProgressiveTileJob::Create(_tracer, i) iferr_return;
-				tileJobs->Add(job) iferr_return;
-			}
-			this->AddSubGroup<maxon::JobGroupRef>(tileJobs) iferr_return;
-			tileJobs->Wait();
-
-			BaseObject* pCamera = _tracer->GetCamera();
-			if (pCamera)
-			{
-				UInt32 dirty = pCamera->GetDirty(DIRTYFLAGS::MATRIX | DIRTYFLAGS::DATA);
-				if (cameraDirty != dirty)
-				{
-					cameraDirty = dirty;
-					restart = true;
-				}
-			}
-			GeSleep(60);
-		}
-
-		Int32 endTime = GeGetTimer();
-		Int32 renderTime = endTime - startTime;
-		GeConsoleOut("RenderTime: " + String::IntToString(renderTime));
-
+		_tracer->RaytraceProgressiveWorkers(this);
 		return SetResult(std::move(true));
 	}
 
@@ -0,0 +1,293 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "rtweekend.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "aarect.h"
+#include "box.h"
+#include "cylinder.h"
+#include "oriented_box.h"
+#include "scenes.h"
+#include "adaptive.h"
+#include "denoise.h"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+
+// Everything the renderer needs besides the geometry. The defaults match the Raytracer class.
+struct render_settings {
+    int image_width = 400;
+    int image_height = 225;
+    int samples_per_pixel = 10;
+    int max_depth = 50;
+    uint32_t seed = 0;
+    bool sobol = true;
+    adaptive_settings adaptive;
+    bool denoise = false;
+    denoise_settings denoiser;
+
+    color background = color(0, 0, 0);
+    bool dome_background = true;
+    std::string environment;    // Relative paths start at the scene file.
+    double environment_intensity = 1.0;
+    double environment_rotation = 0.0;   // Degrees around the y axis.
+
+    point3 lookfrom = point3(13, 2, 3);
+    point3 lookat = point3(0, 0, 0);
+    vec3 vup = vec3(0, 1, 0);
+    double vfov = 20.0;
+    double aperture = 0.1;
+    double focus_dist = 10.0;
+
+    camera make_camera() const {
+        return camera(lookfrom, lookat, vup, vfov, double(image_width) / image_height, aperture, focus_dist);
+    }
+};
+
+struct scene_description {
+    render_settings settings;
+    hittable_list world;
+};
+
+
+// Reads a scene description. One statement per line, '#' starts a comment:
+//
+//   image <width> <height>
+//   samples <count>
+//   depth <count>
+//   seed <value>
+//   sampler sobol|random
+//   adaptive <min samples> <max samples> <noise threshold>
+//   denoise [iterations]
+//   background dome | background <r> <g> <b>
+//   environment <image> [intensity] [rotation]
+//   camera <from x y z> <at x y z> <up x y z> <vfov> <aperture> <focus distance>
+//   material <name> lambertian <r> <g> <b>
+//   material <name> metal <r> <g> <b> <fuzz>
+//   material <name> dielectric <ior>
+//   material <name> light <r> <g> <b>
+//   material <name> isotropic <r> <g> <b>
+//   sphere <x> <y> <z> <radius> <material>
+//   rect xy|xz|yz <a0> <a1> <b0> <b1> <k> <material>
+//   box <min x y z> <max x y z> <material> [rotation x y z]
+//   cylinder <x> <y> <z> <height> <radius> <material>
+//   random_scene [seed]
+//
+// Returns false and describes the first problem in error.
+inline bool parse_scene(std::istream& in, scene_description& scene, std::string& error) {
+    std::map<std::string, shared_ptr<material>> materials;
+    render_settings& settings = scene.settings;
+
+    auto read_vec = [](std::istringstream& line, vec3& v) {
+        return static_cast<bool>(line >> v[0] >> v[1] >> v[2]);
+    };
+
+    std::string text;
+    for (int line_number = 1; std::getline(in, text); line_number++) {
+        auto comment = text.find('#');
+        if (comment != std::string::npos)
+            text.erase(comment);
+
+        std::istringstream line(text);
+        std::string keyword;
+        if (!(line >> keyword))
+            continue;
+
+        bool ok = true;
+        shared_ptr<material> mat;
+        auto find_material = [&]() {
+            std::string name;
+            if (!(line >> name))
+                return false;
+            auto found = materials.find(name);
+            if (found == materials.end()) {
+                error = "line " + std::to_string(line_number) + ": unknown material '" + name + "'";
+                return false;
+            }
+            mat = found->second;
+            return true;
+        };
+
+        if (keyword == "image") {
+            ok = static_cast<bool>(line >> settings.image_width >> settings.image_height)
+                && settings.image_width > 1 && settings.image_height > 1;
+        }
+        else if (keyword == "samples") {
+            ok = static_cast<bool>(line >> settings.samples_per_pixel) && settings.samples_per_pixel > 0;
+        }
+        else if (keyword == "depth") {
+            ok = static_cast<bool>(line >> settings.max_depth) && settings.max_depth > 0;
+        }
+        else if (keyword == "seed") {
+            ok = static_cast<bool>(line >> settings.seed);
+        }
+        else if (keyword == "sampler") {
+            std::string type;
+            ok = static_cast<bool>(line >> type) && (type == "sobol" || type == "random");
+            settings.sobol = type == "sobol";
+        }
+        else if (keyword == "adaptive") {
+            adaptive_settings& adaptive = settings.adaptive;
+            ok = static_cast<bool>(line >> adaptive.min_samples >> adaptive.max_samples >> adaptive.noise_threshold)
+                && adaptive.min_samples >= 2 && adaptive.max_samples >= adaptive.min_samples && adaptive.noise_threshold > 0.0;
+            adaptive.enabled = true;
+        }
+        else if (keyword == "denoise") {
+            settings.denoise = true;
+            int iterations;
+            if (line >> iterations)
+                settings.denoiser.iterations = iterations;
+            ok = settings.denoiser.iterations > 0;
+        }
+        else if (keyword == "background") {
+            std::string first;
+            ok = static_cast<bool>(line >> first);
+            if (ok && first == "dome") {
+                settings.dome_background = true;
+            }
+            else if (ok) {
+                std::istringstream red(first);
+                ok = static_cast<bool>(red >> settings.background[0])
+                    && static_cast<bool>(line >> settings.background[1] >> settings.background[2]);
+                settings.dome_background = false;
+            }
+        }
+        else if (keyword == "environment") {
+            ok = static_cast<bool>(line >> settings.environment);
+            if (ok && line >> settings.environment_intensity)
+                line >> settings.environment_rotation;
+        }
+        else if (keyword == "camera") {
+            ok = read_vec(line, settings.lookfrom) && read_vec(line, settings.lookat) && read_vec(line, settings.vup)
+                && static_cast<bool>(line >> settings.vfov >> settings.aperture >> settings.focus_dist);
+        }
+        else if (keyword == "material") {
+            std::string name, type;
+            ok = static_cast<bool>(line >> name >> type);
+            color c;
+            if (ok && type == "lambertian" && read_vec(line, c)) {
+                materials[name] = make_shared<lambertian>(c);
+            }
+            else if (ok && type == "metal" && read_vec(line, c)) {
+                double fuzz = 0.0;
+                ok = static_cast<bool>(line >> fuzz);
+                materials[name] = make_shared<metal>(c, fuzz);
+            }
+            else if (ok && type == "dielectric") {
+                double ior = 1.5;
+                ok = static_cast<bool>(line >> ior);
+                materials[name] = make_shared<dielectric>(ior);
+            }
+            else if (ok && type == "light" && read_vec(line, c)) {
+                materials[name] = make_shared<diffuse_light>(c);
+            }
+            else if (ok && type == "isotropic" && read_vec(line, c)) {
+                materials[name] = make_shared<isotropic>(c);
+            }
+            else {
+                ok = false;
+            }
+        }
+        else if (keyword == "sphere") {
+            point3 center;
+            double radius;
+            ok = read_vec(line, center) && static_cast<bool>(line >> radius) && find_material();
+            if (ok)
+                scene.world.add(make_shared<sphere>(center, radius, mat));
+        }
+        else if (keyword == "rect") {
+            std::string plane;
+            double a0, a1, b0, b1, k;
+            ok = static_cast<bool>(line >> plane >> a0 >> a1 >> b0 >> b1 >> k) && find_material();
+            if (ok && plane == "xy")
+                scene.world.add(make_shared<xy_rect>(a0, a1, b0, b1, k, mat));
+            else if (ok && plane == "xz")
+                scene.world.add(make_shared<xz_rect>(a0, a1, b0, b1, k, mat));
+            else if (ok && plane == "yz")
+                scene.world.add(make_shared<yz_rect>(a0, a1, b0, b1, k, mat));
+            else
+                ok = false;
+        }
+        else if (keyword == "box") {
+            point3 p0, p1;
+            ok = read_vec(line, p0) && read_vec(line, p1) && find_material();
+            vec3 rotation;
+            if (ok && read_vec(line, rotation)) {
+                // Degrees around the box center, applied around x, then y, then z, turning the
+                // same way as rotate_x, rotate_y and rotate_z.
+                double sx = sin(degrees_to_radians(rotation.x())), cx = cos(degrees_to_radians(rotation.x()));
+                double sy = sin(degrees_to_radians(rotation.y())), cy = cos(degrees_to_radians(rotation.y()));
+                double sz = sin(degrees_to_radians(rotation.z())), cz = cos(degrees_to_radians(rotation.z()));
+                const double rx[3][3] = { { 1, 0, 0 }, { 0, cx, sx }, { 0, -sx, cx } };
+                const double ry[3][3] = { { cy, 0, sy }, { 0, 1, 0 }, { -sy, 0, cy } };
+                const double rz[3][3] = { { cz, sz, 0 }, { -sz, cz, 0 }, { 0, 0, 1 } };
+
+                point3 center = 0.5 * (p0 + p1);
+                affine_transform object_to_world;
+                for (int i = 0; i < 3; i++) {
+                    for (int j = 0; j < 3; j++) {
+                        double sum = 0.0;
+                        for (int k = 0; k < 3; k++)
+                            for (int l = 0; l < 3; l++)
+                                sum += rz[i][k] * ry[k][l] * rx[l][j];
+                        object_to_world.m[i][j] = static_cast<float>(sum);
+                    }
+                    object_to_world.m[i][3] = static_cast<float>(center[i]);
+                }
+
+                auto object = make_shared<oriented_box>(mat);
+                ok = object->set_transform(object_to_world, 0.5 * (p1 - p0));
+                if (ok)
+                    scene.world.add(object);
+            }
+            else if (ok) {
+                scene.world.add(make_shared<box>(p0, p1, mat));
+            }
+        }
+        else if (keyword == "cylinder") {
+            point3 center;
+            double height, radius;
+            ok = read_vec(line, center) && static_cast<bool>(line >> height >> radius) && find_material();
+            if (ok)
+                scene.world.add(make_shared<cylinder>(center, height*0.5, -height*0.5, radius, mat));
+        }
+        else if (keyword == "random_scene") {
+            uint32_t seed = 0;
+            line >> seed;
+            auto objects = random_scene(seed);
+            for (const auto& object : objects.objects)
+                scene.world.add(object);
+        }
+        else {
+            error = "line " + std::to_string(line_number) + ": unknown statement '" + keyword + "'";
+            return false;
+        }
+
+        if (!ok) {
+            if (error.empty())
+                error = "line " + std::to_string(line_number) + ": invalid '" + keyword + "' statement";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+inline bool load_scene(const std::string& path, scene_description& scene, std::string& error) {
+    std::ifstream in(path);
+    if (!in) {
+        error = "cannot open " + path;
+        return false;
+    }
+    return parse_scene(in, scene, error);
+}
+
+
+#endif
@@ -14,6 +14,9 @@
 #include "rtweekend.h"
 
 #include "hittable.h"
+#include "material.h"
+#include "pdf.h"
+#include "lights.h"
 
 
 class sphere : public hittable {
@@ -30,6 +33,14 @@ class sphere : public hittable {
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+        virtual bool is_light() const override {
+            return mat_ptr && mat_ptr->emissive();
+        }
+
+        virtual double pdf_value(const point3& o, const vec3& v) const override;
+        virtual vec3 random(const point3& o, sampler& s) const override;
+        virtual bool emitter_bounds(light_bounds& bounds) const override;
+
     public:
         point3 center;
         double radius;
@@ -61,6 +72,48 @@ inline bool sphere::bounding_box(double time0, double time1, aabb& output_box) c
 }
 
 
+// Directions are picked uniformly inside the cone the sphere covers. From inside the sphere there
+// is no cone, it is then only found by scattering.
+inline double sphere::pdf_value(const point3& o, const vec3& v) const {
+    auto distance_squared = (center - o).length_squared();
+    if (distance_squared <= radius*radius)
+        return 0;
+
+    hit_record rec;
+    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+
+    auto cos_theta_max = sqrt(1 - radius*radius/distance_squared);
+    auto solid_angle = 2*pi*(1-cos_theta_max);
+
+    return 1 / solid_angle;
+}
+
+
+inline vec3 sphere::random(const point3& o, sampler& s) const {
+    vec3 direction = center - o;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius*radius)
+        return direction;
+
+    onb uvw;
+    uvw.build_from_w(direction);
+    return uvw.local(random_to_sphere(radius, distance_squared, s));
+}
+
+
+// Emits in every direction, so the normal cone is the whole sphere.
+inline bool sphere::emitter_bounds(light_bounds& bounds) const {
+    if (!bounding_box(0, 1, bounds.box))
+        return false;
+    auto emitted = mat_ptr->emitted(0.5, 0.5, center + vec3(0, radius, 0));
+    bounds.power = luminance(emitted) * 4*pi*radius*radius * pi;
+    bounds.cos_theta_o = -1.0;
+    bounds.cos_theta_e = 0.0;
+    return true;
+}
+
+
 inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     vec3 oc = r.origin() - center;
     auto a = r.direction().length_squared();
@@ -84,7 +137,7 @@ inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
 
     return true;
 }
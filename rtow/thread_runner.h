@@ -0,0 +1,44 @@
+#ifndef THREAD_RUNNER_H
+#define THREAD_RUNNER_H
+
+#include "bvh.h"
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+
+// Task runner on plain std::thread for hosts without a job system. Starts at most thread_count()
+// threads per batch and each one keeps pulling tasks until the batch is done.
+class thread_task_runner : public bvh_task_runner {
+    public:
+        thread_task_runner(int threads = 0) : threads(threads) {
+            if (this->threads <= 0)
+                this->threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        virtual int thread_count() const override { return threads; }
+
+        virtual void run(std::vector<std::function<void()>>& tasks) override {
+            std::atomic<size_t> next(0);
+            auto worker = [&]() {
+                for (size_t task = next++; task < tasks.size(); task = next++)
+                    tasks[task]();
+            };
+
+            int count = static_cast<int>(std::min(tasks.size(), static_cast<size_t>(threads)));
+            std::vector<std::thread> workers;
+            for (int i = 1; i < count; i++)
+                workers.emplace_back(worker);
+            worker();
+            for (auto& w : workers)
+                w.join();
+        }
+
+    private:
+        int threads;
+};
+
+
+#endif
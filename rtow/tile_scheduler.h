@@ -0,0 +1,227 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include "bvh.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Rows y0 to y1 and columns x0 to x1 of the image, end exclusive.
+struct tile_rect {
+    int x0, y0, x1, y1;
+};
+
+
+struct tile_scheduler_stats {
+    int workers = 0;
+    int buckets = 0;        // Work units rendered, tiles plus the pieces split off them.
+    int steals = 0;         // Buckets taken from another worker's queue.
+    int splits = 0;         // Buckets cut in two because a worker ran out of work.
+    double wall_ms = 0.0;
+    double busy_ms = 0.0;   // Summed over the workers, only time spent rendering rows.
+    double tail_ms = 0.0;   // From the first time a worker found nothing to take to the end of the pass.
+
+    // Fraction of the available worker time spent rendering.
+    double utilisation() const {
+        return workers > 0 && wall_ms > 0.0 ? busy_ms / (wall_ms * workers) : 0.0;
+    }
+};
+
+
+// Hands out the rows of an image to a fixed set of workers. The image starts out as tiles dealt
+// in contiguous runs to the workers' queues. A worker takes from the front of its own queue and,
+// when that is empty, steals from the back of another. A worker still busy with a bucket while
+// others are idle gives the lower half of its remaining rows back to its queue, so one expensive
+// tile is shared out instead of finishing on a single thread at the end of the pass.
+class tile_scheduler {
+    public:
+        // render_row(worker, y, x0, x1) renders one row of a bucket and returns false to cancel the pass.
+        typedef std::function<bool(int, int, int, int)> row_function;
+
+        // Renders the whole image with one task per runner thread. Returns false when cancelled.
+        bool run(int width, int height, int tile_size, bvh_task_runner& runner, const row_function& render_row);
+
+        const tile_scheduler_stats& stats() const { return last_stats; }
+
+    private:
+        struct worker_queue {
+            std::mutex lock;
+            std::deque<tile_rect> rects;
+        };
+
+        typedef std::chrono::steady_clock clock;
+
+        std::vector<std::unique_ptr<worker_queue>> queues;
+        std::atomic<int> pending;   // Buckets queued or being rendered, the pass is over at zero.
+        std::atomic<int> idle;      // Workers looking for a bucket.
+        std::atomic<int> steals;
+        std::atomic<int> splits;
+        std::atomic<int> buckets;
+        std::atomic<bool> cancelled;
+        std::atomic<bool> draining;
+        clock::time_point start_time;
+        std::atomic<long long> tail_start_ns;
+        tile_scheduler_stats last_stats;
+
+        void work(int worker, const row_function& render_row, double& busy_ms);
+        bool take(int worker, tile_rect& rect);
+        bool pop_front(int worker, tile_rect& rect);
+        bool pop_back(int victim, tile_rect& rect);
+};
+
+
+inline bool tile_scheduler::run(
+    int width, int height, int tile_size, bvh_task_runner& runner, const row_function& render_row
+) {
+    int worker_count = std::max(1, runner.thread_count());
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+    int tile_count = tiles_x * tiles_y;
+
+    queues.clear();
+    for (int w = 0; w < worker_count; w++)
+        queues.emplace_back(new worker_queue());
+
+    // Neighbouring tiles go to the same worker, which keeps the rays of a worker coherent.
+    for (int t = 0; t < tile_count; t++) {
+        int x0 = (t % tiles_x) * tile_size;
+        int y0 = (t / tiles_x) * tile_size;
+        tile_rect rect = { x0, y0, std::min(x0 + tile_size, width), std::min(y0 + tile_size, height) };
+        queues[size_t(t) * worker_count / tile_count]->rects.push_back(rect);
+    }
+
+    pending = tile_count;
+    idle = 0;
+    steals = 0;
+    splits = 0;
+    buckets = 0;
+    cancelled = false;
+    draining = false;
+    tail_start_ns = 0;
+    start_time = clock::now();
+
+    std::vector<double> busy_ms(worker_count, 0.0);
+    std::vector<std::function<void()>> tasks;
+    for (int w = 0; w < worker_count; w++)
+        tasks.push_back([this, w, &render_row, &busy_ms]() { work(w, render_row, busy_ms[w]); });
+
+    runner.run(tasks);
+
+    auto wall_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start_time).count();
+
+    last_stats = tile_scheduler_stats();
+    last_stats.workers = worker_count;
+    last_stats.buckets = buckets;
+    last_stats.steals = steals;
+    last_stats.splits = splits;
+    last_stats.wall_ms = wall_ns * 1e-6;
+    for (double ms : busy_ms)
+        last_stats.busy_ms += ms;
+    if (draining)
+        last_stats.tail_ms = (wall_ns - tail_start_ns) * 1e-6;
+
+    return !cancelled;
+}
+
+
+inline void tile_scheduler::work(int worker, const row_function& render_row, double& busy_ms) {
+    tile_rect rect;
+    while (take(worker, rect)) {
+        auto bucket_start = clock::now();
+        buckets++;
+
+        for (int y = rect.y0; y < rect.y1 && !cancelled; y++) {
+            if (!render_row(worker, y, rect.x0, rect.x1)) {
+                cancelled = true;
+                break;
+            }
+
+            // Somebody ran dry, so hand the lower half of what is left to the thieves.
+            int remaining = rect.y1 - (y + 1);
+            if (idle > 0 && remaining >= 2) {
+                int mid = y + 1 + remaining / 2;
+                pending++;
+                {
+                    std::lock_guard<std::mutex> guard(queues[worker]->lock);
+                    queues[worker]->rects.push_back({ rect.x0, mid, rect.x1, rect.y1 });
+                }
+                rect.y1 = mid;
+                splits++;
+            }
+        }
+
+        busy_ms += std::chrono::duration<double, std::milli>(clock::now() - bucket_start).count();
+        pending--;
+    }
+}
+
+
+inline bool tile_scheduler::take(int worker, tile_rect& rect) {
+    if (pop_front(worker, rect))
+        return true;
+
+    idle++;
+    for (;;) {
+        if (cancelled)
+            break;
+
+        for (size_t i = 1; i < queues.size(); i++) {
+            int victim = int((worker + i) % queues.size());
+            if (pop_back(victim, rect)) {
+                idle--;
+                steals++;
+                return true;
+            }
+        }
+
+        if (!draining.exchange(true)) {
+            tail_start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                clock::now() - start_time).count();
+        }
+
+        // Out of work for good once nobody holds a bucket that could still be split.
+        if (pending == 0)
+            break;
+
+        if (pop_front(worker, rect)) {
+            idle--;
+            return true;
+        }
+
+        std::this_thread::yield();
+    }
+    idle--;
+    return false;
+}
+
+
+inline bool tile_scheduler::pop_front(int worker, tile_rect& rect) {
+    std::lock_guard<std::mutex> guard(queues[worker]->lock);
+    auto& rects = queues[worker]->rects;
+    if (rects.empty())
+        return false;
+    rect = rects.front();
+    rects.pop_front();
+    return true;
+}
+
+
+inline bool tile_scheduler::pop_back(int victim, tile_rect& rect) {
+    std::lock_guard<std::mutex> guard(queues[victim]->lock);
+    auto& rects = queues[victim]->rects;
+    if (rects.empty())
+        return false;
+    rect = rects.back();
+    rects.pop_back();
+    return true;
+}
+
+
+#endif
@@ -25,12 +25,31 @@ SOFTWARE.
 #include "tiledimage.h"
 #include "raytracer.h"
 
+#include <memory>
+#include <mutex>
+#include <string>
+
 Bool FunRayVideoPostData::Init(GeListNode* node)
 {
 	BaseVideoPost* post = (BaseVideoPost*)node;
 	BaseContainer *bc = post->GetDataInstance();
 	bc->SetInt32(VP_FUNRAY_SAMPLES, 10);
 	bc->SetInt32(VP_FUNRAY_MAXDEPTH, 50);
+	bc->SetInt32(VP_FUNRAY_SEED, 0);
+	bc->SetInt32(VP_FUNRAY_SAMPLER, VP_FUNRAY_SAMPLER_SOBOL);
+	bc->SetBool(VP_FUNRAY_ADAPTIVE, false);
+	bc->SetInt32(VP_FUNRAY_ADAPTIVE_MIN_SAMPLES, 16);
+	bc->SetInt32(VP_FUNRAY_ADAPTIVE_MAX_SAMPLES, 400);
+	bc->SetFloat(VP_FUNRAY_ADAPTIVE_THRESHOLD, 0.01);
+	bc->SetBool(VP_FUNRAY_DENOISE, false);
+	bc->SetInt32(VP_FUNRAY_DENOISE_ITERATIONS, 5);
+	bc->SetFloat(VP_FUNRAY_ENVIRONMENT_INTENSITY, 1.0);
+	bc->SetFloat(VP_FUNRAY_ENVIRONMENT_ROTATION, 0.0);
+	bc->SetBool(VP_FUNRAY_BVH_COMPRESSED, false);
+	bc->SetInt32(VP_FUNRAY_BVH_BUILDER_VIEWPORT, VP_FUNRAY_BVH_BUILDER_LINEAR);
+	bc->SetInt32(VP_FUNRAY_BVH_ROTATIONS, 1);
+	bc->SetBool(VP_FUNRAY_BVH_SPATIAL, false);
+	bc->SetFloat(VP_FUNRAY_BVH_SPATIAL_BUDGET, 0.3);
 	bc->SetInt32(VP_FUNRAY_RENDERMODE_VIEWPORT, VP_FUNRAY_RENDERMODE_MULTITHREAD_PROGRESSIVE);
 	return true;
 }
@@ -51,6 +70,82 @@ Bool FunRayVideoPostData::RenderEngineCheck(BaseVideoPost* node, Int32 id)
 	return true;
 }
 
+Bool FunRayVideoPostData::GetDEnabling(GeListNode* node, const DescID& id, const GeData& t_data, DESCFLAGS_ENABLE flags, const BaseContainer* itemdesc)
+{
+	const BaseContainer* bc = ((BaseVideoPost*)node)->GetDataInstance();
+	Bool adaptive = bc->GetBool(VP_FUNRAY_ADAPTIVE);
+
+	switch (id[0].id)
+	{
+	case VP_FUNRAY_SAMPLES:
+		return !adaptive;
+	case VP_FUNRAY_ADAPTIVE_MIN_SAMPLES:
+	case VP_FUNRAY_ADAPTIVE_MAX_SAMPLES:
+	case VP_FUNRAY_ADAPTIVE_THRESHOLD:
+		return adaptive;
+	case VP_FUNRAY_DENOISE_ITERATIONS:
+		return bc->GetBool(VP_FUNRAY_DENOISE);
+	case VP_FUNRAY_ENVIRONMENT_INTENSITY:
+	case VP_FUNRAY_ENVIRONMENT_ROTATION:
+		return bc->GetFilename(VP_FUNRAY_ENVIRONMENT).IsPopulated();
+	case VP_FUNRAY_BVH_ROTATIONS:
+		return bc->GetInt32(VP_FUNRAY_BVH_BUILDER_VIEWPORT) == VP_FUNRAY_BVH_BUILDER_LINEAR;
+	case VP_FUNRAY_BVH_SPATIAL_BUDGET:
+		return bc->GetBool(VP_FUNRAY_BVH_SPATIAL);
+	}
+	return SUPER::GetDEnabling(node, id, t_data, flags, itemdesc);
+}
+
+// Loading the image and building its sampling tables takes a while. The result is kept for the
+// whole module until the file or its modification time changes, so the document clones rendered
+// in the Picture Viewer find it as well as the viewport
+static std::mutex g_environmentLock;
+static std::shared_ptr<const environment_light> g_environment;
+static std::string g_environmentPath;
+static LocalFileTime g_environmentTime;
+
+static std::shared_ptr<const environment_light> LoadEnvironment(const BaseContainer* bc)
+{
+	Filename file = bc->GetFilename(VP_FUNRAY_ENVIRONMENT);
+	if (!file.IsPopulated() || !GeFExist(file))
+	{
+		return nullptr;
+	}
+
+	maxon::UniqueRef<maxon::RawMem<Char>> filenameStr(file.GetString().GetCStringCopy());
+	std::string path(filenameStr);
+
+	LocalFileTime time;
+	GeGetFileTime(file, GE_FILETIME_MODIFIED, &time);
+
+	std::shared_ptr<const environment_light> loaded;
+	{
+		std::lock_guard<std::mutex> guard(g_environmentLock);
+		if (!g_environment || path != g_environmentPath || !(time == g_environmentTime))
+		{
+			std::string error;
+			auto environment = std::make_shared<environment_light>();
+			if (!environment->load(path, error))
+			{
+				GeConsoleOut("FunRay: cannot load environment image " + file.GetString());
+				g_environment.reset();
+				return nullptr;
+			}
+			g_environment = environment;
+			g_environmentPath = path;
+			g_environmentTime = time;
+		}
+		loaded = g_environment;
+	}
+
+	// A render may still be tracing with the cached light, the settings go on a copy that shares
+	// the image with it
+	auto environment = std::make_shared<environment_light>(*loaded);
+	environment->intensity = bc->GetFloat(VP_FUNRAY_ENVIRONMENT_INTENSITY);
+	environment->rotation = bc->GetFloat(VP_FUNRAY_ENVIRONMENT_ROTATION);
+	return environment;
+}
+
 RENDERRESULT FunRayVideoPostData::Execute(BaseVideoPost* node, VideoPostStruct* vps)
 {
 	if (vps == nullptr)
@@ -117,6 +212,27 @@ RENDERRESULT FunRayVideoPostData::Execute(BaseVideoPost* node, VideoPostStruct*
 			Int32 maxDepth = bc->GetInt32(VP_FUNRAY_MAXDEPTH);
 			raytracer.SetSamplesPerPixel(samples);
 			raytracer.SetMaxDepth(maxDepth);
+			raytracer.SetSeed(UInt32(bc->GetInt32(VP_FUNRAY_SEED)));
+			raytracer.SetSampler(bc->GetInt32(VP_FUNRAY_SAMPLER) == VP_FUNRAY_SAMPLER_RANDOM ? SAMPLER::RANDOM : SAMPLER::SOBOL);
+
+			adaptive_settings adaptive;
+			adaptive.enabled = bc->GetBool(VP_FUNRAY_ADAPTIVE);
+			adaptive.min_samples = bc->GetInt32(VP_FUNRAY_ADAPTIVE_MIN_SAMPLES);
+			adaptive.max_samples = bc->GetInt32(VP_FUNRAY_ADAPTIVE_MAX_SAMPLES);
+			adaptive.noise_threshold = bc->GetFloat(VP_FUNRAY_ADAPTIVE_THRESHOLD);
+			raytracer.SetAdaptive(adaptive);
+			raytracer.SetDenoise(bc->GetBool(VP_FUNRAY_DENOISE), bc->GetInt32(VP_FUNRAY_DENOISE_ITERATIONS));
+			raytracer.SetEnvironment(LoadEnvironment(bc));
+			raytracer.SetCompressedBVH(bc->GetBool(VP_FUNRAY_BVH_COMPRESSED));
+
+			// Viewport renders restart on every edit and may trade tree quality for build time,
+			// the picture viewer always gets the SAH tree
+			if (mainViewport && bc->GetInt32(VP_FUNRAY_BVH_BUILDER_VIEWPORT) == VP_FUNRAY_BVH_BUILDER_LINEAR)
+				raytracer.SetBVHBuilder(BVHBUILDER::LINEAR, bc->GetInt32(VP_FUNRAY_BVH_ROTATIONS));
+
+			// Spatial splits cost build time and memory, so only final renders pay for them
+			if (!mainViewport)
+				raytracer.SetSpatialSplits(bc->GetBool(VP_FUNRAY_BVH_SPATIAL), bc->GetFloat(VP_FUNRAY_BVH_SPATIAL_BUDGET));
 
 			auto jobGroup = maxon::JobGroupRef::Create() iferr_return;
 
@@ -29,9 +29,12 @@ SOFTWARE.
 
 class FunRayVideoPostData : public VideoPostData
 {
+	INSTANCEOF(FunRayVideoPostData, VideoPostData)
+
 public:
 	virtual Bool Init(GeListNode* node);
 	virtual Bool RenderEngineCheck(BaseVideoPost* node, Int32 id);
+	virtual Bool GetDEnabling(GeListNode* node, const DescID& id, const GeData& t_data, DESCFLAGS_ENABLE flags, const BaseContainer* itemdesc);
 	virtual RENDERRESULT Execute(BaseVideoPost* node, VideoPostStruct* vps);
 
 public:
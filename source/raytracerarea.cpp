@@ -52,41 +52,65 @@ Bool RaytracerArea::GetMinSize(Int32& w, Int32& h)
 	return true;
 }
 
-Bool RaytracerArea::Render(maxon::JobGroupRef jobGroup, RENDERMODE renderMode)
+Bool RaytracerArea::Render(maxon::JobGroupRef jobGroup, RENDERMODE renderMode, Bool denoise)
 {
+	_raytracer.SetDenoise(denoise, denoise_settings().iterations);
+	// The render view rebuilds the scene on most edits, so it takes the fast build
+	_raytracer.SetBVHBuilder(BVHBUILDER::LINEAR, 1);
 	return SetupRenderer(jobGroup, renderMode, &_raytracer, &_tiledImage, this);
 }
 
+// Converts a row of colors to 8 bit RGB. A flat loop over the components without branches,
+// so the compiler turns the clamp and scale into vector instructions.
+static void PackRGB(const Vector32* src, Int32 count, UChar* dst)
+{
+	const Float32* in = reinterpret_cast<const Float32*>(src);
+	for (Int32 i = 0; i < count * 3; i++)
+	{
+		Float32 v = maxon::ClampValue(in[i], 0.0f, 1.0f);
+		dst[i] = UChar(v * 255.0f + 0.5f);
+	}
+}
+
 void RaytracerArea::DrawMsg(Int32 x1, Int32 y1, Int32 x2, Int32 y2, const BaseContainer& msg)
 {
 	SetClippingRegion(0, 0, GetWidth(), GetHeight());
 
 	Int32 numTiles = _tiledImage.GetNumTiles();
 	Int32 numTilesx = _tiledImage.GetNumTilesX();
+	Int32 bw = _img->GetBw();
+	Int32 bh = _img->GetBh();
 
-	for (Int a = 0; a < numTiles; a++)
+	// Dirty tiles are copied one scanline at a time, clipped to the bitmap
+	UChar line[TILESIZE * 3];
+	for (Int32 a = 0; a < numTiles; a++)
 	{
 		Tile* pTile = _tiledImage.GetTile(a);
-		Int xTile = a % numTilesx;
-		Int yTile = a / numTilesx;
-		if (pTile && pTile->IsDirty())
+		if (!pTile || !pTile->IsDirty())
+			continue;
+
+		pTile->ClearDirty();
+
+		Int32 xOff = (a % numTilesx) * TILESIZE;
+		Int32 yOff = (a / numTilesx) * TILESIZE;
+		Int32 width = maxon::Min(Int32(TILESIZE), bw - xOff);
+		Int32 height = maxon::Min(Int32(TILESIZE), bh - yOff);
+
+		for (Int32 y = 0; y < height; y++)
 		{
-			pTile->ClearDirty();
-			for (Int y = 0; y < TILESIZE; y++)
-			{
-				for (Int x = 0; x < TILESIZE; x++)
-				{
-					Vector32 pixel = pTile->GetPixel(x, y);
-					_img->SetPixelCnt(xTile * TILESIZE + x, yTile * TILESIZE + y, 1, (UChar*)&pixel, 24,COLORMODE::RGBf, PIXELCNT::NONE);
-				}
-			}
+			const Vector32* row = pTile->GetRow(y);
+			if (!row)
+				break;
+
+			PackRGB(row, width, line);
+			_img->SetPixelCnt(xOff, yOff + y, width, line, 3, COLORMODE::RGB, PIXELCNT::NONE);
 		}
 	}
 
-	Int32 startX = (GetWidth() - _img->GetBw()) / 2;
-	Int32 starty = (GetHeight() - _img->GetBh()) / 2;
+	Int32 startX = (GetWidth() - bw) / 2;
+	Int32 starty = (GetHeight() - bh) / 2;
 
-	DrawBitmap(_img, startX + x1, starty + y1, _img->GetBw(), _img->GetBh(), 0, 0, _img->GetBw(), _img->GetBh(), BMP_NORMAL);
+	DrawBitmap(_img, startX + x1, starty + y1, bw, bh, 0, 0, bw, bh, BMP_NORMAL);
 }
 
 void RaytracerArea::Clear()
@@ -39,7 +39,7 @@ public:
 	void Clear();
 
 public:
-	Bool Render(maxon::JobGroupRef job, RENDERMODE renderMode = RENDERMODE::MULTITHREADED);
+	Bool Render(maxon::JobGroupRef job, RENDERMODE renderMode = RENDERMODE::MULTITHREADED, Bool denoise = false);
 
 private:
 	Raytracer _raytracer;
@@ -40,6 +40,7 @@ Bool RaytracerDialog::InitValues(void)
 	SetBool(RT_RENDER_MULTITHREADED, true);
 	SetBool(RT_RENDER_PROGRESSIVE, true);
 #endif
+	SetBool(RT_RENDER_DENOISE, false);
 
 	SetRenderState(false);
 	return true;
@@ -61,9 +62,10 @@ Bool RaytracerDialog::CreateLayout()
 	AddUserArea(RT_RENDERVIEW, BFH_SCALEFIT | BFV_SCALEFIT, SizePix(512), SizePix(512));
 	GroupEnd();
 
-	GroupBegin(0, BFH_SCALEFIT | BFV_FIT, 2, 0, ""_s, 0);
+	GroupBegin(0, BFH_SCALEFIT | BFV_FIT, 3, 0, ""_s, 0);
 	AddCheckbox(RT_RENDER_MULTITHREADED, BFH_SCALEFIT | BFV_FIT, 100, 20, "Multi-Threaded"_s);
 	AddCheckbox(RT_RENDER_PROGRESSIVE, BFH_SCALEFIT | BFV_FIT, 100, 20, "Progressive"_s);
+	AddCheckbox(RT_RENDER_DENOISE, BFH_SCALEFIT | BFV_FIT, 100, 20, "Denoise"_s);
 	GroupEnd();
 
 	GroupBegin(0, BFH_SCALEFIT | BFV_FIT, 2, 0, ""_s, 0);
@@ -71,6 +73,11 @@ Bool RaytracerDialog::CreateLayout()
 	AddButton(RT_RENDER_STOP, BFH_SCALEFIT | BFV_FIT, 100, 20, "Stop"_s);
 	GroupEnd();
 
+	GroupBegin(0, BFH_SCALEFIT | BFV_FIT, 2, 0, ""_s, 0);
+	AddButton(RT_BVH_BENCHMARK, BFH_SCALEFIT | BFV_FIT, 100, 20, "BVH Benchmark"_s);
+	AddButton(RT_TRACE_BENCHMARK, BFH_SCALEFIT | BFV_FIT, 100, 20, "Trace Benchmark"_s);
+	GroupEnd();
+
 	SetTitle("FunRay Raytracer"_s);
 	AttachUserArea(_area, RT_RENDERVIEW);
 
@@ -81,8 +88,11 @@ void RaytracerDialog::SetRenderState(Bool rendering)
 {
 	Enable(RT_RENDER_MULTITHREADED, !rendering);
 	Enable(RT_RENDER_PROGRESSIVE, !rendering);
+	Enable(RT_RENDER_DENOISE, !rendering);
 	Enable(RT_RENDER_START, !rendering);
 	Enable(RT_RENDER_STOP, rendering);
+	Enable(RT_BVH_BENCHMARK, !rendering);
+	Enable(RT_TRACE_BENCHMARK, !rendering);
 }
 
 Bool RaytracerDialog::Command(Int32 id, const BaseContainer& msg)
@@ -99,8 +109,10 @@ Bool RaytracerDialog::Command(Int32 id, const BaseContainer& msg)
 	{
 		Bool multiThreaded = true;
 		Bool progressive = true;
+		Bool denoise = false;
 		GetBool(RT_RENDER_MULTITHREADED, multiThreaded);
 		GetBool(RT_RENDER_PROGRESSIVE, progressive);
+		GetBool(RT_RENDER_DENOISE, denoise);
 		_jobs = maxon::JobGroupRef::Create() iferr_return;
 
 		RENDERMODE mode = RENDERMODE::SINGLETHREAD;
@@ -127,7 +139,7 @@ Bool RaytracerDialog::Command(Int32 id, const BaseContainer& msg)
 			}
 		}
 
-		if (!_area.Render(_jobs, mode))
+		if (!_area.Render(_jobs, mode, denoise))
 		{ 
 			DebugAssert(false);
 			return false;
@@ -158,6 +170,24 @@ Bool RaytracerDialog::Command(Int32 id, const BaseContainer& msg)
 		EventAdd();
 	}
 	break;
+	case RT_BVH_BENCHMARK:
+	{
+		// Build times for 10k, 100k and 1M primitives per thread count are written to the console
+		maxon::JobRef::Enqueue([]()
+			{
+				RunBVHBenchmark();
+			}) iferr_return;
+	}
+	break;
+	case RT_TRACE_BENCHMARK:
+	{
+		// Samples per second of random_scene() per thread count are written to the console
+		maxon::JobRef::Enqueue([]()
+			{
+				RunTraceBenchmark();
+			}) iferr_return;
+	}
+	break;
 	}
 	return true;
 }
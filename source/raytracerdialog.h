@@ -33,6 +33,9 @@ enum
 	RT_RENDER_STOP,
 	RT_RENDER_MULTITHREADED,
 	RT_RENDER_PROGRESSIVE,
+	RT_RENDER_DENOISE,
+	RT_BVH_BENCHMARK,
+	RT_TRACE_BENCHMARK,
 };
 
 class RaytracerDialog : public GeDialog
@@ -110,6 +110,14 @@ Vector32 Tile::GetPixel(Int32 x, Int32 y) const
 	return _data[y * TILESIZE + x];
 }
 
+const Vector32* Tile::GetRow(Int32 y) const
+{
+	if (!_data || y >= TILESIZE || y < 0)
+		return nullptr;
+
+	return _data + y * TILESIZE;
+}
+
 //======================================
 
 TiledImage::TiledImage()
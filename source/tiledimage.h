@@ -37,6 +37,7 @@ public:
 	Bool Init();
 
 	Vector32 GetPixel(Int32 x, Int32 y) const;
+	const Vector32* GetRow(Int32 y) const;
 	void SetPixel(Int32 x, Int32 y, const Vector32& col, Bool setDirtyFlag = true);
 
 	UInt GetDirty();
@@ -0,0 +1,226 @@
+// Traces the same random rays through a bvh and through a plain hittable_list and checks that
+// every builder mode finds the same closest hits, before and after objects move.
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "cylinder.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "oriented_box.h"
+#include "sphere.h"
+#include "thread_runner.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+
+struct test_mode {
+    const char* name;
+    bool quantized;
+    bool linear;
+    int rotation_passes;
+    bool spatial;
+};
+
+static const test_mode modes[] = {
+    { "sah",                false, false, 0, false },
+    { "linear",             false, true,  0, false },
+    { "linear rotations",   false, true,  2, false },
+    { "spatial",            false, false, 0, true },
+    { "compressed",         true,  false, 0, false },
+    { "compressed linear",  true,  true,  2, false },
+    { "compressed spatial", true,  false, 0, true },
+};
+
+
+static std::mt19937 generator(1234);
+
+static double uniform(double min, double max) {
+    return std::uniform_real_distribution<double>(min, max)(generator);
+}
+
+static vec3 uniform_direction() {
+    while (true) {
+        vec3 v(uniform(-1, 1), uniform(-1, 1), uniform(-1, 1));
+        if (v.length_squared() > 1e-4 && v.length_squared() <= 1.0)
+            return v;
+    }
+}
+
+static affine_transform random_transform(const point3& position) {
+    // Rows of a rotation about a random axis, followed by the translation.
+    vec3 axis = unit_vector(uniform_direction());
+    double angle = uniform(0, 2 * pi);
+    double c = cos(angle), s = sin(angle), k = 1 - c;
+    double x = axis.x(), y = axis.y(), z = axis.z();
+    double r[3][3] = {
+        { c + x*x*k,   x*y*k - z*s, x*z*k + y*s },
+        { y*x*k + z*s, c + y*y*k,   y*z*k - x*s },
+        { z*x*k - y*s, z*y*k + x*s, c + z*z*k   },
+    };
+
+    affine_transform t;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            t.m[i][j] = static_cast<float>(r[i][j]);
+        t.m[i][3] = static_cast<float>(position[i]);
+    }
+    return t;
+}
+
+struct moving_box {
+    shared_ptr<oriented_box> box;
+    vec3 half_size;
+    int index;  // In the scene list.
+};
+
+// Small spheres, long thin rotated boxes that give the spatial splits something to cut,
+// cylinders, and a sphere big enough to serve as the ground.
+static hittable_list make_scene(int count, std::vector<moving_box>& boxes) {
+    hittable_list world;
+    auto mat = make_shared<lambertian>(color(0.5, 0.5, 0.5));
+
+    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, mat));
+    for (int i = 0; i < count; i++) {
+        point3 p(uniform(-50, 50), uniform(0, 20), uniform(-50, 50));
+        int kind = i % 8;
+        if (kind < 6) {
+            world.add(make_shared<sphere>(p, uniform(0.05, 0.6), mat));
+        }
+        else if (kind == 6) {
+            vec3 half(uniform(2, 12), uniform(0.02, 0.2), uniform(0.02, 0.2));
+            auto b = make_shared<oriented_box>(random_transform(p), half, mat);
+            boxes.push_back({ b, half, static_cast<int>(world.objects.size()) });
+            world.add(b);
+        }
+        else {
+            world.add(make_shared<cylinder>(p, p.y() + uniform(0.2, 3), p.y(), uniform(0.1, 1), mat));
+        }
+    }
+    return world;
+}
+
+static std::vector<ray> make_rays(int count) {
+    std::vector<ray> rays;
+    for (int i = 0; i < count; i++) {
+        // Half start inside the objects' range, half look at it from far away.
+        point3 origin = i % 2 == 0
+            ? point3(uniform(-60, 60), uniform(-1, 25), uniform(-60, 60))
+            : point3(uniform(-300, 300), uniform(10, 300), uniform(-300, 300));
+        vec3 dir = i % 2 == 0 ? uniform_direction() : point3(uniform(-40, 40), uniform(0, 10), uniform(-40, 40)) - origin;
+        rays.push_back(ray(origin, dir));
+    }
+    return rays;
+}
+
+struct reference_hit {
+    bool hit;
+    double t;
+    vec3 normal;
+};
+
+static std::vector<reference_hit> trace_list(const hittable_list& world, const std::vector<ray>& rays) {
+    std::vector<reference_hit> hits;
+    for (const ray& r : rays) {
+        hit_record rec;
+        bool hit = world.hit(r, 0.001, infinity, rec);
+        hits.push_back({ hit, hit ? rec.t : 0.0, hit ? rec.normal : vec3() });
+    }
+    return hits;
+}
+
+static int compare(const bvh& tree, const std::vector<ray>& rays, const std::vector<reference_hit>& expected,
+    const std::string& label) {
+    int failures = 0;
+    for (size_t i = 0; i < rays.size(); i++) {
+        hit_record rec;
+        bool hit = tree.hit(rays[i], 0.001, infinity, rec);
+        const reference_hit& e = expected[i];
+        bool same = hit == e.hit;
+        if (same && hit)
+            same = fabs(rec.t - e.t) <= 1e-9 * fmax(1.0, e.t) && (rec.normal - e.normal).length() <= 1e-6;
+        if (!same) {
+            if (failures < 5) {
+                std::printf("%s: ray %d: bvh %s t=%g, list %s t=%g\n", label.c_str(), int(i),
+                    hit ? "hit" : "miss", hit ? rec.t : 0.0, e.hit ? "hit" : "miss", e.t);
+            }
+            failures++;
+        }
+    }
+    return failures;
+}
+
+static void configure(bvh& tree, const test_mode& mode) {
+    tree.tree.quantized = mode.quantized;
+    tree.tree.linear = mode.linear;
+    tree.tree.rotation_passes = mode.rotation_passes;
+    tree.tree.spatial = mode.spatial;
+}
+
+int main() {
+    // Enough objects for the parallel binning and subtree tasks to run.
+    std::vector<moving_box> boxes;
+    hittable_list world = make_scene(20000, boxes);
+    std::vector<ray> rays = make_rays(2000);
+    std::vector<reference_hit> expected = trace_list(world, rays);
+
+    thread_task_runner runner(4);
+    int failures = 0;
+    for (const test_mode& mode : modes) {
+        bvh tree;
+        configure(tree, mode);
+        tree.build(world.objects, &runner);
+        failures += compare(tree, rays, expected, mode.name);
+
+        bvh serial;
+        configure(serial, mode);
+        serial.build(world.objects);
+        failures += compare(serial, rays, expected, std::string(mode.name) + " serial");
+    }
+
+    // Refits, then the same comparison against the moved scene. A refit tree stays correct
+    // even when it asks for a rebuild, except for compressed trees and trees with primitives
+    // split across leaves, which keep their old boxes and are rebuilt like the renderer does.
+    std::vector<bvh> trees(sizeof(modes) / sizeof(modes[0]));
+    for (size_t m = 0; m < trees.size(); m++) {
+        configure(trees[m], modes[m]);
+        trees[m].build(world.objects, &runner);
+    }
+
+    std::vector<int> moved;
+    for (size_t i = 0; i < world.objects.size(); i++) {
+        if (i % 10 != 3)
+            continue;
+        if (auto s = std::dynamic_pointer_cast<sphere>(world.objects[i])) {
+            s->center += vec3(uniform(-5, 5), uniform(-2, 2), uniform(-5, 5));
+            moved.push_back(int(i));
+        }
+    }
+    for (size_t b = 0; b < boxes.size(); b += 7) {
+        boxes[b].box->set_transform(random_transform(point3(uniform(-50, 50), uniform(0, 20), uniform(-50, 50))), boxes[b].half_size);
+        moved.push_back(boxes[b].index);
+    }
+    expected = trace_list(world, rays);
+
+    for (size_t m = 0; m < trees.size(); m++) {
+        const bvh_stats& stats = trees[m].stats();
+        bool keeps_boxes = modes[m].quantized || stats.reference_count > stats.primitive_count;
+        if (trees[m].refit(moved) && keeps_boxes) {
+            std::printf("%s: refit did not ask for a rebuild\n", modes[m].name);
+            failures++;
+        }
+        if (keeps_boxes)
+            trees[m].build(world.objects, &runner);
+        failures += compare(trees[m], rays, expected, std::string(modes[m].name) + " refit");
+    }
+
+    if (failures > 0) {
+        std::printf("%d mismatches\n", failures);
+        return 1;
+    }
+    std::printf("all modes match the list\n");
+    return 0;
+}
@@ -0,0 +1,20 @@
+# Renders SCENE once on one thread and once on THREADS threads with a fixed seed and fails unless
+# both images are identical. Run with cmake -P, FUNRAY, SCENE, OUTPUT and THREADS set.
+foreach(threads 1 ${THREADS})
+	execute_process(
+		COMMAND ${FUNRAY} ${SCENE} ${OUTPUT}_t${threads}.ppm -t ${threads} -s 4 --seed 7
+		RESULT_VARIABLE result
+		ERROR_VARIABLE log
+	)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "funray failed on ${SCENE} with ${threads} threads:\n${log}")
+	endif()
+endforeach()
+
+execute_process(
+	COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT}_t1.ppm ${OUTPUT}_t${THREADS}.ppm
+	RESULT_VARIABLE different
+)
+if(different)
+	message(FATAL_ERROR "${SCENE} renders differently on 1 and ${THREADS} threads")
+endif()